@@ -0,0 +1,67 @@
+/* Shared helpers for the benchmarks in this directory.
+
+   Every benchmark prints one result per line, as CSV with the columns
+
+     bench,variant,param,value,unit
+
+   or, given --json, as one JSON object per line with the same keys. param is
+   the size of the input: bytes for I/O and byte swapping, the number of
+   dimensions for header parsing. */
+
+#ifndef NPIO_BENCH_H_
+#define NPIO_BENCH_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+static int bench_json = 0;
+
+
+static inline double bench_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/* Print the column names, unless the output is JSON. */
+static inline void bench_start()
+{
+  if (!bench_json)
+    printf("bench,variant,param,value,unit\n");
+}
+
+
+static inline void bench_report(const char* bench, const char* variant
+  , size_t param, double value, const char* unit)
+{
+  if (bench_json)
+    printf("{\"bench\": \"%s\", \"variant\": \"%s\", \"param\": %zu"
+      ", \"value\": %.6g, \"unit\": \"%s\"}\n", bench, variant, param, value
+      , unit);
+  else
+    printf("%s,%s,%zu,%.6g,%s\n", bench, variant, param, value, unit);
+  fflush(stdout);
+}
+
+
+/* Parse a size such as 4096, 64K, 16M or 10G. Returns 0 if it is invalid. */
+static inline size_t bench_parse_size(const char* s)
+{
+  char* end;
+  size_t n = strtoull(s, &end, 10);
+
+  switch (*end)
+  {
+    case 'G': case 'g': n <<= 10; /* fall through */
+    case 'M': case 'm': n <<= 10; /* fall through */
+    case 'K': case 'k': n <<= 10; ++end; break;
+  }
+  return *end ? 0 : n;
+}
+
+#endif
@@ -0,0 +1,75 @@
+/* Header parsing throughput, in headers per second, for npio_load_header_mem
+   and npio_stat_mem over generated headers of increasing dimensionality.
+   Build and run with "make bench". Pass --json for JSON output; see bench.h
+   for the format. */
+
+#include "bench.h"
+#include "../npio.h"
+
+
+/* Write a version 1 npy header for a little-endian float32 array. */
+static size_t make_header(char* buf, size_t dim)
+{
+  char dict[1024];
+  size_t i, len, total;
+
+  len = sprintf(dict, "{'descr': '<f4', 'fortran_order': False, 'shape': (");
+  for (i = 0; i < dim; ++i)
+    len += sprintf(dict + len, "%zu, ", i % 4 + 1);
+  len += sprintf(dict + len, "), }");
+
+  /* pad with spaces and a newline to a multiple of 16, as numpy does */
+  total = (10 + len + 1 + 15) & ~(size_t) 15;
+  memset(dict + len, ' ', total - 10 - len - 1);
+  dict[total - 10 - 1] = '\n';
+
+  memcpy(buf, "\x93NUMPY\x01\x00", 8);
+  buf[8] = (total - 10) & 0xff;
+  buf[9] = (total - 10) >> 8;
+  memcpy(buf + 10, dict, total - 10);
+  return total;
+}
+
+
+int main(int argc, char* argv[])
+{
+  static const size_t dims[] = {1, 3, 8, 16, 32};
+  const size_t iterations = 1000000;
+  char buf[2048];
+  npio_Array array;
+  npio_Info info;
+  size_t d, i, sz, sink = 0;
+  double t;
+
+  if (argc > 1 && strcmp(argv[1], "--json") == 0)
+    bench_json = 1;
+
+  bench_start();
+  for (d = 0; d < sizeof(dims) / sizeof(dims[0]); ++d)
+  {
+    sz = make_header(buf, dims[d]);
+
+    t = bench_now();
+    for (i = 0; i < iterations; ++i)
+    {
+      npio_init_array(&array);
+      if (npio_load_header_mem4(buf, sz, &array, 32))
+        return 1;
+      sink += array.size;
+      npio_free_array(&array);
+    }
+    bench_report("parse", "load_header_mem", dims[d]
+      , iterations / (bench_now() - t), "ops/s");
+
+    t = bench_now();
+    for (i = 0; i < iterations; ++i)
+    {
+      if (npio_stat_mem(buf, sz, &info))
+        return 1;
+      sink += info.size;
+    }
+    bench_report("parse", "stat_mem", dims[d]
+      , iterations / (bench_now() - t), "ops/s");
+  }
+  return sink == 0;
+}
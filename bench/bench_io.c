@@ -0,0 +1,262 @@
+/* Throughput of loading, saving and byte swapping, in GB per second.
+
+   Options:
+     --json            print JSON lines instead of CSV, see bench.h
+     --max-size SIZE   the largest file to try, 256M by default; files go
+                       from 1K up to this, and up to 10G if you ask for it
+     --dir DIR         where to put the scratch file, "." by default
+
+   Loads are timed with the page cache warm, and cold after dropping the
+   file from it with posix_fadvise. Either way each load reads every byte,
+   so that a lazy mapping pays for its page faults. Cold numbers are only
+   meaningful on a disk-backed file system, not on tmpfs. Saves are timed to
+   the page cache, and again including fdatasync. */
+
+#include <fcntl.h>
+#include "bench.h"
+#include "../npio.h"
+
+
+#define MIN_TIME 0.25
+
+static const size_t sizes[] = {
+  (size_t) 1 << 10, (size_t) 64 << 10, (size_t) 1 << 20, (size_t) 16 << 20
+  , (size_t) 256 << 20, (size_t) 1 << 30, (size_t) 10 << 30};
+
+static char path[4096];
+static volatile uint64_t sink;
+
+
+/* Describe n bytes of data as a one-dimensional uint64 array. */
+static void describe(npio_Array* array, size_t* shape, void* data, size_t n)
+{
+  npio_init_array(array);
+  shape[0] = n / 8;
+  array->dim = 1;
+  array->shape = shape;
+  array->floating_point = 0;
+  array->is_signed = 0;
+  array->bit_width = 64;
+  array->data = data;
+}
+
+
+static void drop_cache()
+{
+  int fd = open(path, O_RDONLY);
+  if (fd >= 0)
+  {
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+}
+
+
+static void touch(const npio_Array* array)
+{
+  const uint64_t* p = (const uint64_t*) array->data;
+  uint64_t sum = 0;
+  size_t i;
+
+  for (i = 0; i < array->size; ++i)
+    sum += p[i];
+  sink += sum;
+}
+
+
+static int bench_load(const char* bench, const char* variant, int flags
+  , int cold, size_t bytes)
+{
+  npio_Array array;
+  double t, elapsed = 0;
+  size_t iterations = 0;
+  int err;
+
+  do
+  {
+    if (cold)
+      drop_cache();
+
+    t = bench_now();
+    npio_init_array(&array);
+    if ((err = npio_load_header4(path, &array, 8, flags)) != 0
+      || (err = npio_load_data(&array)) != 0)
+    {
+      npio_free_array(&array);
+      return err;
+    }
+    touch(&array);
+    npio_free_array(&array);
+    elapsed += bench_now() - t;
+    ++iterations;
+  } while (elapsed < MIN_TIME);
+
+  bench_report(bench, variant, bytes, bytes * iterations / elapsed / 1e9
+    , "GB/s");
+  return 0;
+}
+
+
+static int bench_save(const char* variant, int sync, void* data, size_t bytes)
+{
+  npio_Array array;
+  size_t shape[1];
+  double t, elapsed = 0;
+  size_t iterations = 0;
+  int fd, err;
+
+  describe(&array, shape, data, bytes);
+  do
+  {
+    t = bench_now();
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+      return errno;
+    err = npio_save_fd(fd, &array);
+    if (!err && sync && fdatasync(fd))
+      err = errno;
+    close(fd);
+    if (err)
+      return err;
+    elapsed += bench_now() - t;
+    ++iterations;
+  } while (elapsed < MIN_TIME);
+
+  bench_report("save_fd", variant, bytes, bytes * iterations / elapsed / 1e9
+    , "GB/s");
+  return 0;
+}
+
+
+static int bench_swap(void* src, size_t bytes)
+{
+  static const size_t widths[] = {16, 32, 64, 128};
+  char variant[32];
+  double t;
+  size_t w, i, n;
+  void* dst;
+
+  if ((dst = aligned_alloc(64, bytes)) == 0)
+    return ENOMEM;
+  memset(dst, 0, bytes);
+
+  for (w = 0; w < sizeof(widths) / sizeof(widths[0]); ++w)
+  {
+    n = bytes * 8 / widths[w];
+
+    t = bench_now();
+    i = 0;
+    do
+    {
+      npio_swap_bytes(n, widths[w], src);
+      ++i;
+    } while (bench_now() - t < MIN_TIME);
+    sprintf(variant, "inplace%zu", widths[w]);
+    bench_report("swap_bytes", variant, bytes
+      , bytes * i / (bench_now() - t) / 1e9, "GB/s");
+
+    t = bench_now();
+    i = 0;
+    do
+    {
+      npio_swap_bytes4(n, widths[w], src, dst);
+      ++i;
+    } while (bench_now() - t < MIN_TIME);
+    sprintf(variant, "copy%zu", widths[w]);
+    bench_report("swap_bytes", variant, bytes
+      , bytes * i / (bench_now() - t) / 1e9, "GB/s");
+  }
+
+  free(dst);
+  return 0;
+}
+
+
+static int run(size_t bytes)
+{
+  static const struct { const char* name; int flags; } loads[] = {
+    {"mmap", 0},
+    {"mmap_populate", NPIO_MAP_POPULATE},
+    {"mmap_shared", NPIO_MAP_SHARED},
+    {"read", NPIO_NO_MMAP}};
+  uint64_t *data;
+  size_t i;
+  int err = 0;
+
+  if ((data = (uint64_t*) aligned_alloc(64, bytes)) == 0)
+    return ENOMEM;
+  for (i = 0; i < bytes / 8; ++i)
+    data[i] = i;
+
+  if ((err = bench_save("page_cache", 0, data, bytes)) != 0
+    || (err = bench_save("fdatasync", 1, data, bytes)) != 0)
+    goto done;
+
+  for (i = 0; i < sizeof(loads) / sizeof(loads[0]); ++i)
+  {
+    if ((err = bench_load("load_warm", loads[i].name, loads[i].flags, 0
+      , bytes)) != 0)
+      goto done;
+  }
+  for (i = 0; i < sizeof(loads) / sizeof(loads[0]); ++i)
+  {
+    if ((err = bench_load("load_cold", loads[i].name, loads[i].flags, 1
+      , bytes)) != 0)
+      goto done;
+  }
+
+  /* Swapping into a copy needs as much memory again, so only small sizes. */
+  if (bytes <= ((size_t) 256 << 20))
+    err = bench_swap(data, bytes);
+
+done:
+  free(data);
+  return err;
+}
+
+
+int main(int argc, char* argv[])
+{
+  const char* dir = ".";
+  size_t max_size = (size_t) 256 << 20;
+  size_t i;
+  int a, err = 0;
+
+  for (a = 1; a < argc; ++a)
+  {
+    if (strcmp(argv[a], "--json") == 0)
+      bench_json = 1;
+    else if (strcmp(argv[a], "--max-size") == 0 && a + 1 < argc)
+    {
+      if ((max_size = bench_parse_size(argv[++a])) == 0)
+        break;
+    }
+    else if (strcmp(argv[a], "--dir") == 0 && a + 1 < argc)
+      dir = argv[++a];
+    else
+      break;
+  }
+  if (a < argc)
+  {
+    fprintf(stderr, "usage: %s [--json] [--max-size SIZE] [--dir DIR]\n"
+      , argv[0]);
+    return 2;
+  }
+
+  snprintf(path, sizeof(path), "%s/npio-bench-%d.npy", dir, (int) getpid());
+
+  bench_start();
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && !err; ++i)
+  {
+    if (sizes[i] <= max_size)
+      err = run(sizes[i]);
+  }
+  unlink(path);
+
+  if (err)
+  {
+    fprintf(stderr, "%s: %s\n", argv[0], strerror(err));
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,117 @@
+/* libFuzzer target for the header parser and the npz directory parser.
+
+   Build with "make fuzz" (needs clang) and run it seeded with the test files:
+
+     mkdir -p fuzz/corpus && cp test1.npy test2.npy test1.npz fuzz/corpus
+     ./fuzz/fuzz_header -max_len=4096 fuzz/corpus
+
+   Defining NPIO_FUZZ_MAIN instead builds a plain driver that runs each file
+   given on the command line through the same code, which is useful to
+   replay crashes with another compiler or under a debugger. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "../npio.h"
+
+
+typedef struct
+{
+  const char* p;
+  size_t left;
+} MemStream;
+
+
+static int mem_read(void* ctx, void* p, size_t n)
+{
+  MemStream* s = (MemStream*) ctx;
+  if (n > s->left)
+    return EINVAL;
+  memcpy(p, s->p, n);
+  s->p += n;
+  s->left -= n;
+  return 0;
+}
+
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+  npio_Array array;
+  npio_Info info;
+  npio_Npz npz;
+  MemStream stream;
+  char *copy;
+  size_t i;
+
+  /* Loading from memory swaps in place, so work on a private copy. The
+     copy is exactly sized so that overreads are caught by the sanitizer. */
+  if ((copy = (char*) malloc(size ? size : 1)) == 0)
+    return 0;
+
+  memcpy(copy, data, size);
+  npio_init_array(&array);
+  npio_load_mem4(copy, size, &array, 8);
+  npio_free_array(&array);
+
+  npio_stat_mem(data, size, &info);
+
+  stream.p = (const char*) data;
+  stream.left = size;
+  npio_init_array(&array);
+  npio_load_header_stream_(&array, 8, mem_read, &stream);
+  npio_free_array(&array);
+
+  /* The npz parser takes ownership of the buffer on close. */
+  memcpy(copy, data, size);
+  npz.n = 0;
+  npz.members = 0;
+  npz._buf = copy;
+  npz._buf_size = size;
+  npz._mmapped = 0;
+  npz._names = 0;
+  if (size && npio_npz_parse_(&npz) == 0)
+  {
+    for (i = 0; i < npz.n; ++i)
+    {
+      npio_init_array(&array);
+      npio_npz_load_member4(&npz, &npz.members[i], &array, 8);
+      npio_free_array(&array);
+    }
+  }
+  npio_npz_close(&npz);
+  return 0;
+}
+
+
+#ifdef NPIO_FUZZ_MAIN
+int main(int argc, char* argv[])
+{
+  FILE* f;
+  char* buf;
+  long n;
+  int i;
+
+  for (i = 1; i < argc; ++i)
+  {
+    if ((f = fopen(argv[i], "rb")) == 0)
+    {
+      perror(argv[i]);
+      return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    n = ftell(f);
+    rewind(f);
+    buf = (char*) malloc(n ? n : 1);
+    if (fread(buf, 1, n, f) != (size_t) n)
+    {
+      perror(argv[i]);
+      return 1;
+    }
+    fclose(f);
+    LLVMFuzzerTestOneInput((const uint8_t*) buf, n);
+    free(buf);
+  }
+  return 0;
+}
+#endif
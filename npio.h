@@ -16,8 +16,9 @@ License: MIT (see LICENSE.txt)
 
 Limitations:
 
-Can only be used for homogenous arrays. Structured arrays and Object arrays are
-not supported.  Structured arrays may be supported at some point in the future.
+Can only be used for homogenous arrays and for structured arrays whose fields
+are plain numbers or subarrays of them. Object arrays, nested structured types
+and string fields are not supported.
 
 This code does not conform strictly to the specified format.  It is known to
 work with files actually generated by numpy, but there are lots of variations
@@ -37,17 +38,62 @@ Vishal (vishal@onutechnology.com)
 ******************************************************************************/
 
 
+/* We use POSIX and common BSD interfaces such as pread, posix_memalign and
+   openat, which strict modes like -std=c99 hide unless asked for. This only
+   helps if npio.h comes before any system header; otherwise the NPIO_HAVE_*_
+   macros below tell which are missing, and older calls are used instead. */
+#ifndef _DEFAULT_SOURCE
+  #define _DEFAULT_SOURCE 1
+#endif
+
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <dirent.h>
+
+#ifdef __linux__
+  #include <sys/sendfile.h>
+  #include <sys/syscall.h>
+#endif
+
+/* Whether we can set NUMA policies. glibc only declares syscall with
+   _DEFAULT_SOURCE, which is too late if a system header came first. */
+#if defined(__linux__) && defined(SYS_mbind) && defined(SYS_get_mempolicy) \
+  && (!defined(__GLIBC__) || defined(__USE_MISC))
+  #define NPIO_HAVE_MBIND_ 1
+#endif
+
+/* The same for the other interfaces that glibc hides in strict modes. */
+#if !defined(__GLIBC__) || defined(__USE_UNIX98) || defined(__USE_XOPEN2K8)
+  #define NPIO_HAVE_PREAD_ 1
+#endif
+#if !defined(__GLIBC__) || defined(__USE_XOPEN2K)
+  #define NPIO_HAVE_POSIX_MEMALIGN_ 1
+#endif
+#if !defined(__GLIBC__) || defined(__USE_XOPEN2K8)
+  #define NPIO_HAVE_OPENAT_ 1
+#endif
+#if !defined(__GLIBC__) || defined(__USE_POSIX199309) \
+  || defined(__USE_XOPEN_EXTENDED) || defined(__USE_XOPEN2K)
+  #define NPIO_HAVE_FTRUNCATE_ 1
+#endif
+
+/* Define NPIO_ENABLE_ZLIB, and link with -lz, to load compressed npz members. */
+#ifdef NPIO_ENABLE_ZLIB
+  #include <zlib.h>
+#endif
 
 
 /* Version of this header. */
@@ -57,6 +103,86 @@ Vishal (vishal@onutechnology.com)
 /* Some defaults */
 #define NPIO_DEFAULT_MAX_DIM 32
 
+/* The longest header that is read from a stream, rather than a mapped or
+   in-memory file, when it holds a record descriptor. Other headers are limited
+   by the number of dimensions, see npio_check_header_len_. */
+#ifndef NPIO_MAX_HEADER_LEN
+  #define NPIO_MAX_HEADER_LEN (1 << 20)
+#endif
+
+/* The largest amount of data passed to a single read or write call. Linux
+   transfers at most 0x7ffff000 bytes per call anyway, and smaller chunks keep
+   the process responsive to signals on slow sockets. */
+#ifndef NPIO_IO_CHUNK_SIZE
+  #define NPIO_IO_CHUNK_SIZE (1 << 30)
+#endif
+
+/* Seekable files of at most this many bytes are read into an allocated buffer
+   with a single pread rather than mapped, since for small files the mapping,
+   page faults and the munmap cost more than the copy. Set it to zero to map
+   all files. */
+#ifndef NPIO_MMAP_THRESHOLD
+  #define NPIO_MMAP_THRESHOLD 65536
+#endif
+
+/* Flags for npio_load_header4 and npio_load_header_fd4.
+
+NPIO_MAP_SHARED maps the file read-only and shared, so that processes loading
+the same file share the page cache instead of getting private copy-on-write
+pages. The data must then not be modified. If a byte swap is needed, the data
+is swapped into an allocated copy instead. Files are mapped in this mode even
+if they are below NPIO_MMAP_THRESHOLD.
+
+NPIO_KEEP_FD keeps the descriptor of a mapped file open, which together with
+NPIO_MAP_SHARED lets npio_save_fd send the data straight from the file. If you
+pass in your own descriptor with this flag, it must remain open for as long as
+the array is in use.
+
+NPIO_NO_MMAP reads the data instead of mapping the file, which helps where
+mappings are slow or unsupported, such as some network and FUSE file systems.
+On a seekable descriptor the read can then be split over several threads with
+npio_load_data3.
+
+NPIO_LAZY is only used by npio::Array, which then loads just the header when
+constructed, and the data when it is first accessed. The functions here ignore
+it.
+
+NPIO_NUMA_INTERLEAVE and NPIO_NUMA_NODE(n) set the NUMA memory policy of the
+data, spreading its pages over all nodes, or binding them to node n (0 to 63).
+The kernel places the pages of the page cache by its own rules, so these imply
+NPIO_NO_MMAP, and the policy is set on the allocated data before it is read.
+They are ignored together with NPIO_MAP_SHARED. Without them, pages go to the
+node of the thread that first touches them, which with npio_load_data3 is the
+thread that reads each range.
+
+The remaining flags are access hints passed on to the kernel for the mapping.
+They are ignored if the file is not mapped, or if the platform does not support
+them. The exception is NPIO_MADV_HUGEPAGE, which also applies to data of at
+least NPIO_HUGE_PAGE_SIZE bytes that is read into allocated memory, which is
+then aligned to that size. Explicit huge pages can be had with an allocator,
+see npio_Allocator.
+*/
+#define NPIO_MAP_SHARED      0x01  /* PROT_READ / MAP_SHARED mapping */
+#define NPIO_MAP_POPULATE    0x02  /* Prefault the whole mapping */
+#define NPIO_MADV_SEQUENTIAL 0x04  /* Expect sequential access */
+#define NPIO_MADV_RANDOM     0x08  /* Expect random access */
+#define NPIO_MADV_WILLNEED   0x10  /* Start reading ahead right away */
+#define NPIO_MADV_HUGEPAGE   0x20  /* Back the mapping with huge pages */
+#define NPIO_KEEP_FD         0x40  /* Keep the descriptor open after mapping */
+#define NPIO_NO_MMAP         0x80  /* Read the data instead of mapping it */
+#define NPIO_LAZY            0x100 /* npio::Array loads data on first use */
+#define NPIO_NUMA_INTERLEAVE 0x200 /* Interleave data pages over all nodes */
+#define NPIO_NUMA_BIND       0x400 /* Bind data pages, see NPIO_NUMA_NODE */
+
+/* Bind data pages to NUMA node n. */
+#define NPIO_NUMA_NODE(n)    (NPIO_NUMA_BIND | ((n) & 63) << 16)
+#define NPIO_NUMA_NODE_OF_(flags) (((flags) >> 16) & 63)
+
+/* The size of transparent huge pages, for NPIO_MADV_HUGEPAGE. */
+#ifndef NPIO_HUGE_PAGE_SIZE
+  #define NPIO_HUGE_PAGE_SIZE ((size_t) 2 << 20)
+#endif
+
 /* Summary of revisions:
 
 0.1  Initial version
@@ -64,6 +190,168 @@ Vishal (vishal@onutechnology.com)
 */
 
 
+/*
+Allocation hooks for the buffers owned by an npio_Array.
+
+By default the shape, the dtype string, the header and any data buffer are
+allocated with malloc. An npio_Allocator passed to npio_init_array2 replaces
+that, so that arrays can be carved out of an arena, or out of pinned or huge
+page memory. When data is not mapped it is read directly into storage from the
+allocator, aligned to NPIO_DATA_ALIGNMENT: either a buffer of exactly the data
+size, or for files below NPIO_MMAP_THRESHOLD a buffer holding the whole file.
+
+alloc returns size bytes aligned to alignment (a power of two), or null on
+failure.  free is handed back the same size and alignment that were passed to
+the matching alloc. It may be null, e.g. for an arena that is released as a
+whole. ctx is passed as is to both.
+*/
+typedef struct
+{
+  void* (*alloc)(void* ctx, size_t size, size_t alignment);
+  void  (*free)(void* ctx, void* p, size_t size, size_t alignment);
+  void* ctx;
+} npio_Allocator;
+
+
+/* The alignment of data buffers allocated by the library. */
+#ifndef NPIO_DATA_ALIGNMENT
+  #define NPIO_DATA_ALIGNMENT 64
+#endif
+
+
+/* The maximum number of dimensions of a subarray field of a record */
+#ifndef NPIO_FIELD_MAX_DIM
+  #define NPIO_FIELD_MAX_DIM 4
+#endif
+
+
+/* A field of a structured array, whose elements are records. The type fields
+   have the same meaning as in npio_Array below, and every field has the byte
+   order of the array. */
+typedef struct
+{
+  const char* name;      /* The name of the field */
+  size_t offset;         /* The offset of the field in a record, in bytes */
+  size_t dim;            /* The dimension of a subarray field, otherwise 0 */
+  size_t shape[NPIO_FIELD_MAX_DIM];  /* The shape of a subarray field */
+  size_t count;          /* The number of elements, 1 unless a subarray */
+  int    floating_point;
+  int    is_signed;
+  int    is_complex;
+  int    is_bfloat16;
+  int    bit_width;      /* The number of bits of each element */
+} npio_Field;
+
+
+/*
+
+Load statistics.
+
+With NPIO_ENABLE_STATS defined, every array records in its stats field how it
+was loaded: which paths were taken, the time spent in each phase, the number of
+bytes moved and the page faults taken while loading. Without it, neither the
+field nor any of the bookkeeping exist, so there is no cost at all. As the
+layout of npio_Array then changes, all code sharing arrays must agree on it.
+
+A mapped file is mostly faulted in when its data is first touched, after the
+load has returned, so the page faults of a lazy mapping are not counted here.
+The phases of data read by several threads include the byte swap.
+
+*/
+#ifdef NPIO_ENABLE_STATS
+
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#define NPIO_PATH_MMAP     0x01  /* The file was mapped */
+#define NPIO_PATH_PREAD    0x02  /* A small file was read whole with pread */
+#define NPIO_PATH_READ     0x04  /* The header was read from a stream */
+#define NPIO_PATH_READ_DATA 0x08 /* The data was read into a buffer */
+#define NPIO_PATH_PARALLEL 0x10  /* The data was read by several threads */
+#define NPIO_PATH_SWAP     0x20  /* The bytes of the data were swapped */
+#define NPIO_PATH_ALLOC    0x40  /* A buffer was allocated for the data */
+#define NPIO_PATH_MEM      0x80  /* Loaded from a caller's buffer */
+
+typedef struct
+{
+  int      path;           /* A combination of the NPIO_PATH_* flags */
+  uint64_t header_ns;      /* Time spent parsing the header */
+  uint64_t map_ns;         /* Time spent mapping the file */
+  uint64_t read_ns;        /* Time spent reading the file */
+  uint64_t swap_ns;        /* Time spent swapping bytes */
+  size_t   bytes_mapped;
+  size_t   bytes_read;
+  size_t   bytes_swapped;
+  size_t   bytes_allocated;  /* For the file or its data, not the header */
+  long     minor_faults;   /* Page faults of the thread while loading */
+  long     major_faults;
+} npio_Stats;
+
+/* The start of a timed phase. */
+typedef struct
+{
+  struct timespec t;
+  long minor_faults;
+  long major_faults;
+} npio_StatsMark_;
+
+static inline void npio_stats_faults_(long* minor, long* major)
+{
+  struct rusage ru;
+#ifdef RUSAGE_THREAD
+  getrusage(RUSAGE_THREAD, &ru);
+#else
+  getrusage(RUSAGE_SELF, &ru);
+#endif
+  *minor = ru.ru_minflt;
+  *major = ru.ru_majflt;
+}
+
+/* CLOCK_MONOTONIC is only defined where clock_gettime is declared. */
+static inline void npio_stats_now_(struct timespec* t)
+{
+#ifdef CLOCK_MONOTONIC
+  clock_gettime(CLOCK_MONOTONIC, t);
+#else
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  t->tv_sec = tv.tv_sec;
+  t->tv_nsec = tv.tv_usec * 1000;
+#endif
+}
+
+static inline void npio_stats_begin_(npio_StatsMark_* mark)
+{
+  npio_stats_faults_(&mark->minor_faults, &mark->major_faults);
+  npio_stats_now_(&mark->t);
+}
+
+/* Add the time and faults since mark to stats, and the time to phase. */
+static inline void npio_stats_end_(npio_Stats* stats
+  , const npio_StatsMark_* mark, uint64_t* phase)
+{
+  struct timespec t;
+  long minor, major;
+
+  npio_stats_now_(&t);
+  npio_stats_faults_(&minor, &major);
+  *phase += (uint64_t) (t.tv_sec - mark->t.tv_sec) * 1000000000
+    + t.tv_nsec - mark->t.tv_nsec;
+  stats->minor_faults += minor - mark->minor_faults;
+  stats->major_faults += major - mark->major_faults;
+}
+
+/* These expand to their argument only if the stats are enabled. */
+#define NPIO_STATS_(x) x
+
+#else
+
+#define NPIO_STATS_(x)
+
+#endif
+
+
 /* This struct represents the contents of a numpy file. */
 typedef struct
 {
@@ -79,17 +367,32 @@ typedef struct
   int    floating_point; /* Whether data is integral or floating point.*/
   int    is_signed;      /* Whether data is signed or unsigned */
   int    bit_width;      /* The number of bits to this datatype*/
+  int    is_complex;     /* Whether elements are (real, imag) pairs */
+  int    is_bfloat16;    /* Whether 16-bit floats are bfloat16 */
   void   *data;          /* Pointer to contents*/
+  size_t nfields;        /* The number of fields of records, or 0 */
+  npio_Field *fields;    /* The fields of records, sorted by offset */
 
   /* The following fields are private. */
   int    _fd;        /* File descriptor from which we are loading */
   void*  _buf;       /* Memory buffer from where we are loading */
   size_t _buf_size;  /* Size of memory buffer from where we are loading */
   char*  _hdr_buf;   /* A buffer for the header, if we are loading from fd */
+  size_t _hdr_buf_size;  /* The space allocated for _hdr_buf */
+  size_t _data_size; /* The space allocated for data, if _malloced */
   size_t _shape_capacity;  /* The space allocated for shape */
+  size_t _fields_size;  /* The space allocated for fields, if any */
   int    _mmapped;   /* Whether we mmapped the data into buf */
-  int    _malloced;  /* Whether we allocated the buffer */
+  int    _buf_malloced;  /* Whether we allocated buf and read the file in */
+  int    _malloced;  /* Whether we allocated the data */
   int    _opened;    /* Whether we opened the file descriptor */
+  int    _flags;     /* The NPIO_MAP_* and NPIO_MADV_* load flags */
+  npio_Allocator _alloc;  /* Where the buffers above come from */
+  size_t _shape_buf[NPIO_DEFAULT_MAX_DIM];  /* Inline storage for shape */
+  char   _dtype_buf[16];  /* Inline storage for dtype */
+#ifdef NPIO_ENABLE_STATS
+  npio_Stats stats;  /* How the array was loaded, see above */
+#endif
 } npio_Array;
 
 /*
@@ -108,13 +411,155 @@ typedef struct
 
 Some internal notes:
 
--  The _buf field is set if either loading from memory or from a mapped file.
--  The data field is allocated by us if _buf is null.
+-  The _buf field is set if either loading from memory or from a mapped file,
+   or if we read a whole (small) file into an allocated buffer.
+-  The data field is allocated by us if _buf is null, or if the mapping is
+   read-only and we had to swap bytes. _malloced is set in both cases.
 
 */
 
 
 
+/* The default allocator, on top of malloc and posix_memalign. Without
+   posix_memalign, larger blocks are aligned by hand, with the pointer returned
+   by malloc stored just before the aligned block. */
+static inline void* npio_default_alloc_(void* ctx, size_t size, size_t alignment)
+{
+  void* p;
+#ifndef NPIO_HAVE_POSIX_MEMALIGN_
+  void** q;
+#endif
+  (void) ctx;
+  if (size == 0)
+    size = 1;
+  if (alignment <= 2 * sizeof(void*))
+    return malloc(size);
+#ifdef NPIO_HAVE_POSIX_MEMALIGN_
+  if (posix_memalign(&p, alignment, size))
+    return 0;
+  return p;
+#else
+  if (size > (size_t) -1 - alignment || (p = malloc(size + alignment)) == 0)
+    return 0;
+  q = (void**) (((uintptr_t) p + alignment) & ~(uintptr_t) (alignment - 1));
+  q[-1] = p;
+  return q;
+#endif
+}
+
+
+static inline void npio_default_free_(void* ctx, void* p, size_t size
+  , size_t alignment)
+{
+  (void) ctx;
+  (void) size;
+#ifdef NPIO_HAVE_POSIX_MEMALIGN_
+  (void) alignment;
+#else
+  if (p && alignment > 2 * sizeof(void*))
+    p = ((void**) p)[-1];
+#endif
+  free(p);
+}
+
+
+/* Allocate from the allocator of an array. */
+static inline void* npio_alloc_(npio_Array* array, size_t size
+  , size_t alignment)
+{
+  return array->_alloc.alloc(array->_alloc.ctx, size, alignment);
+}
+
+
+/* Return memory obtained with npio_alloc_ to the allocator of an array. */
+static inline void npio_dealloc_(npio_Array* array, void* p, size_t size
+  , size_t alignment)
+{
+  if (array->_alloc.free)
+    array->_alloc.free(array->_alloc.ctx, p, size, alignment);
+}
+
+
+/* The alignment of sz bytes of data allocated with the load flags. Placement
+   works on whole pages, so the data must start on one. */
+static inline size_t npio_data_alignment_(int flags, size_t sz)
+{
+  size_t page;
+
+  if ((flags & NPIO_MADV_HUGEPAGE) && sz >= NPIO_HUGE_PAGE_SIZE
+    && NPIO_HUGE_PAGE_SIZE > NPIO_DATA_ALIGNMENT)
+    return NPIO_HUGE_PAGE_SIZE;
+  if (flags & (NPIO_NUMA_INTERLEAVE | NPIO_NUMA_BIND))
+  {
+    page = sysconf(_SC_PAGESIZE);
+    if (page > NPIO_DATA_ALIGNMENT)
+      return page;
+  }
+  return NPIO_DATA_ALIGNMENT;
+}
+
+
+/* Apply the huge page and NUMA flags to freshly allocated data, before any of
+   it is touched. Like the other hints, errors are ignored. MPOL_MF_MOVE
+   migrates any pages that the allocator had already touched. */
+static inline void npio_place_(void* p, size_t sz, int flags)
+{
+#ifdef NPIO_HAVE_MBIND_
+  const size_t bits = sizeof(unsigned long) * 8;
+  unsigned long mask[64 / (sizeof(unsigned long) * 8)];
+  size_t i, node;
+  int mode = 0;
+#endif
+
+#ifdef MADV_HUGEPAGE
+  if ((flags & NPIO_MADV_HUGEPAGE) && sz >= NPIO_HUGE_PAGE_SIZE)
+    madvise(p, sz, MADV_HUGEPAGE);
+#endif
+
+#ifdef NPIO_HAVE_MBIND_
+  if (flags & NPIO_NUMA_BIND)
+  {
+    mode = 2;  /* MPOL_BIND */
+    node = NPIO_NUMA_NODE_OF_(flags);
+    for (i = 0; i < 64 / bits; ++i)
+      mask[i] = 0;
+    mask[node / bits] = 1UL << node % bits;
+  }
+  else if (flags & NPIO_NUMA_INTERLEAVE)
+  {
+    /* MPOL_INTERLEAVE over the nodes that we may allocate from */
+    if (syscall(SYS_get_mempolicy, (int*) 0, mask, (unsigned long) 64 + 1
+      , (void*) 0, 4 /* MPOL_F_MEMS_ALLOWED */) == 0)
+      mode = 3;
+  }
+
+  /* The kernel counts one node less than maxnode. */
+  if (mode)
+    syscall(SYS_mbind, p, sz, mode, mask, (unsigned long) 64 + 1
+      , 1 << 1 /* MPOL_MF_MOVE */);
+#else
+  (void) p;
+  (void) sz;
+  (void) flags;
+#endif
+}
+
+
+/* Allocate sz bytes for the data of an array, placed as its flags say. */
+static inline int npio_alloc_data_(npio_Array* array, size_t sz)
+{
+  array->data = npio_alloc_(array, sz, npio_data_alignment_(array->_flags, sz));
+  if (!array->data)
+    return ENOMEM;
+  npio_place_(array->data, sz, array->_flags);
+  array->_malloced = 1;
+  array->_data_size = sz;
+  NPIO_STATS_(array->stats.path |= NPIO_PATH_ALLOC;)
+  NPIO_STATS_(array->stats.bytes_allocated += sz;)
+  return 0;
+}
+
+
 /* Compute the total number of elements from the shape. */
 static inline size_t npio_array_size(const npio_Array* array)
 {
@@ -134,91 +579,103 @@ static inline size_t npio_array_memsize(const npio_Array* array)
 
 
 /* Minimalist parser for python dict in the header. Lots of files that are
-valid as per the spec may not be deemed valid by this code. Caveat Emptor. */
+valid as per the spec may not be deemed valid by this code. Caveat Emptor.
+
+The header is parsed in a single pass that does not depend on the locale. Up
+to NPIO_DEFAULT_MAX_DIM dimensions and short dtype strings are stored inline
+in the array, so parsing usually allocates nothing. */
+
+
+/* Whether c is whitespace, as isspace in the C locale. */
+static inline int npio_ph_is_space_(char c)
+{
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f'
+    || c == '\v';
+}
 
 
 /* skip until we see a non-whitespace character. */
 static inline const char* npio_ph_skip_spaces_(const char* p, const char* end)
 {
-  while (p < end && isspace(*p))
+  while (p < end && npio_ph_is_space_(*p))
     ++p;
   return p;
 }
 
 
-/* append a value to array->shape, reallocating if needed. */
+/* append a value to array->shape, moving it out of the inline storage or
+   growing it if needed. */
 static inline int npio_ph_shape_append_(npio_Array* array, size_t val)
 {
   size_t *tmp;
   if (array->dim == array->_shape_capacity)
   {
-    array->_shape_capacity *= 2;
-    tmp = (size_t*) realloc(array->shape, sizeof(size_t) * array->_shape_capacity);
+    tmp = (size_t*) npio_alloc_(array
+      , sizeof(size_t) * array->_shape_capacity * 2, sizeof(size_t));
     if (tmp == 0)
       return ENOMEM;
+    memcpy(tmp, array->shape, sizeof(size_t) * array->dim);
+    if (array->shape != array->_shape_buf)
+      npio_dealloc_(array, array->shape
+        , sizeof(size_t) * array->_shape_capacity, sizeof(size_t));
     array->shape = tmp;
+    array->_shape_capacity *= 2;
   }
   array->shape[array->dim++] = val;
   return 0;
 }
 
 
-/* Parse a python tuple of integers.  Anything else should fail. */
+/* Parse a python tuple of integers, with at most max_dim entries. A trailing
+   comma and the L suffix of python 2 longs are allowed. Anything else should
+   fail. */
 static inline int npio_ph_parse_shape_(npio_Array* array, const char *start
-  , const char *end, const char **where)
+  , const char *end, const char **where, size_t max_dim)
 {
-  const char *p = start, *nbeg, *nend;
-  size_t val;
+  const char *p = start;
+  size_t val, size = 1;
   int err;
 
-  if (p == end)
-    return EINVAL;
-
-  if (*p++ != '(')
+  if (p == end || *p++ != '(')
     return EINVAL;
 
-  array->_shape_capacity = 8;
-  array->shape = (size_t*) malloc(sizeof(size_t) * array->_shape_capacity);
-  if (array->shape == 0)
-    return ENOMEM;
+  array->shape = array->_shape_buf;
+  array->_shape_capacity = NPIO_DEFAULT_MAX_DIM;
+  array->dim = 0;
 
-  while (1)
+  p = npio_ph_skip_spaces_(p, end);
+  while (p < end && *p != ')')
   {
-    p = npio_ph_skip_spaces_(p, end);
-
-    nbeg = p;
-    while (p < end && *p >= '0' && *p <= '9')
-      ++p;
-    nend = p;
-
-    if (p == end)
+    if (*p < '0' || *p > '9')
       return EINVAL;
-
-    if (nbeg < nend)  /* trailing comma is allowed in python, so must check */
+    for (val = 0; p < end && *p >= '0' && *p <= '9'; ++p)
     {
-      val = 0;
-      while (nbeg < nend)
-        val = (*nbeg++ - '0') + val * 10;
-      if ((err = npio_ph_shape_append_(array, val)))
-        return err;
+      if (val > (SIZE_MAX - (*p - '0')) / 10)
+        return ERANGE;
+      val = val * 10 + (*p - '0');
     }
+    if (p < end && *p == 'L')
+      ++p;
+
+    if (val && size > SIZE_MAX / val)
+      return ERANGE;
+    size *= val;
+    if (array->dim == max_dim)
+      return ERANGE;
+    if ((err = npio_ph_shape_append_(array, val)))
+      return err;
 
     p = npio_ph_skip_spaces_(p, end);
-    if (p == end)
-      return EINVAL;
-    if (*p == ',')
-      ++p;
-    else if (*p == ')')
-    {
-      ++p;
-      break;
-    }
-    else
+    if (p < end && *p == ',')
+      p = npio_ph_skip_spaces_(p + 1, end);
+    else if (p < end && *p != ')')
       return EINVAL;
   }
+  if (p == end)
+    return EINVAL;
 
-  *where = p;
-  array->size = npio_array_size(array);
+  *where = p + 1;
+  array->size = size;
   return 0;
 }
 
@@ -230,28 +687,52 @@ Parse a dtype for homogeneous arrays.
 The Numpy specification says that the dtype can be any Python object that would
 serve as a valid argument to numpy.dtype(). Right now we restrict the dtype to
 match strings of the form 'EDN' where E can be '<' or '>' for the endianness, D
-can be 'i', 'f' or 'u' for the c-type and N can be 1, 2, 4, or 8. All others we
-reject. If we really want support for structured data (tables), then we need a
-better parser and a single-header minimalist solution may not be appropriate.
+can be 'i', 'f', 'u' or 'c' for the c-type and N the number of bytes: 1, 2, 4
+or 8 for integers, 2, 4 or 8 for floats and 8 or 16 for complex numbers. All
+others we reject. If we really want support for structured data (tables), then
+we need a better parser and a single-header minimalist solution may not be
+appropriate. For the convenience of callers that describe a target type, E may
+also be '=' or '|' for the host byte order.
+
+numpy has no bfloat16 type of its own, but the ml_dtypes package registers one
+under the name 'bfloat16', which we accept as host-endian bfloat16.
 
 Arguments:
-  dtype is the null-terminated string value of the dtype in the header.
+  dtype is the null-terminated string value of the dtype.
+  array receives the parsed little_endian, is_signed, floating_point,
+    is_complex, is_bfloat16 and bit_width fields. No other field is touched.
 
 Return:
-  A parsed type if we understand the dtype, otherwise npio_unknown.
+  0 if we understand the dtype, otherwise ENOTSUP.
 
 */
-static inline int npio_ph_parse_dtype_(npio_Array* array)
+static inline int npio_parse_dtype(const char* dtype, npio_Array* array)
 {
-  const char* dtype = array->dtype;
+  size_t len = strlen(dtype);
 
-  if (strlen(dtype) != 3)
+  array->is_complex = 0;
+  array->is_bfloat16 = 0;
+  if (strcmp(dtype, "bfloat16") == 0)
+  {
+    array->little_endian = (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+    array->is_signed = 1;
+    array->floating_point = 1;
+    array->is_bfloat16 = 1;
+    array->bit_width = 16;
+    return 0;
+  }
+
+  if (len != 3 && !(len == 4 && dtype[1] == 'c'))
     return ENOTSUP;
 
   switch (dtype[0])
   {
     case '<': array->little_endian = 1; break;
     case '>': array->little_endian = 0; break;
+    case '=':
+    case '|':
+      array->little_endian = (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+      break;
     default : return ENOTSUP;
   }
 
@@ -270,8 +751,22 @@ static inline int npio_ph_parse_dtype_(npio_Array* array)
     case 'f':
       array->is_signed = 1;
       array->floating_point = 1;
+      if (dtype[2] == '1')
+        return ENOTSUP;
       break;
 
+    case 'c':
+      array->is_signed = 1;
+      array->floating_point = 1;
+      array->is_complex = 1;
+      if (strcmp(dtype + 2, "8") == 0)
+        array->bit_width = 64;
+      else if (strcmp(dtype + 2, "16") == 0)
+        array->bit_width = 128;
+      else
+        return ENOTSUP;
+      return 0;
+
     default:
       return ENOTSUP;
   }
@@ -295,15 +790,224 @@ static inline int npio_ph_is_quote_(char p)
 }
 
 
-/* parse a python dictionary containing the specific keys and value we expect */
-static inline int npio_ph_parse_dict_(npio_Array* array, const char* start, const char* end)
+/* Parse a quoted python string without escapes, setting *beg and *len. */
+static inline const char* npio_ph_parse_string_(const char* p
+  , const char* end, const char** beg, size_t* len)
 {
-  int err;
+  char quote;
+  if (p >= end || !npio_ph_is_quote_(quote = *p))
+    return 0;
+  *beg = ++p;
+  while (p < end && *p != quote)
+  {
+    if (*p == '\\')
+      return 0;
+    ++p;
+  }
+  if (p == end)
+    return 0;
+  *len = p - *beg;
+  return p + 1;
+}
+
+
+/* Parse the subarray shape of a field, either an integer or a tuple of them,
+   into the field. Returns zero or an errno code. */
+static inline int npio_ph_parse_field_shape_(const char* p, const char* end
+  , const char** where, npio_Field* field)
+{
+  int tuple = (p < end && *p == '(');
+  size_t val;
+
+  if (tuple)
+    p = npio_ph_skip_spaces_(p + 1, end);
+  while (p < end && *p >= '0' && *p <= '9')
+  {
+    for (val = 0; p < end && *p >= '0' && *p <= '9'; ++p)
+    {
+      if (val > (SIZE_MAX - (*p - '0')) / 10)
+        return ERANGE;
+      val = val * 10 + (*p - '0');
+    }
+    if (field->dim == NPIO_FIELD_MAX_DIM
+      || (val && field->count > SIZE_MAX / val))
+      return ERANGE;
+    field->shape[field->dim++] = val;
+    field->count *= val;
+    if (!tuple)
+    {
+      *where = p;
+      return 0;
+    }
+
+    p = npio_ph_skip_spaces_(p, end);
+    if (p < end && *p == ',')
+      p = npio_ph_skip_spaces_(p + 1, end);
+  }
+  if (!tuple || p == end || *p != ')')
+    return EINVAL;
+  *where = p + 1;
+  return 0;
+}
+
+
+/*
+Parse the record descriptor of a structured array, a python list of
+(name, dtype) or (name, dtype, shape) tuples such as
+
+  [('t', '<f8'), ('id', '<u4'), ('', '|V4'), ('pos', '<f4', (3,))]
+
+into array->fields. As numpy does, void fields without a name are padding.
+The fields and their names are allocated in a single block. Fields must be
+numbers of the kinds npio_parse_dtype accepts, all in the same byte order.
+The array then describes whole records: bit_width is the size of a record and
+little_endian the byte order of the fields.
+*/
+static inline int npio_ph_parse_record_(npio_Array* array)
+{
+  static const int little_endian = (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+  const char *p = array->dtype + 1, *end = p + strlen(p) - 1;
+  const char *name, *dt;
+  size_t i, n, name_len, dt_len, size, offset = 0;
+  char dtype[24], *names;
+  npio_Field* field;
+  npio_Array t;
+  int err = 0, order = -1;
+
+  /* Each field needs a parenthesis, and the names fit in the descriptor. */
+  for (i = 0, n = 0; p + i < end; ++i)
+    n += (p[i] == '(');
+  if (n == 0)
+    return ENOTSUP;
+  array->_fields_size = n * sizeof(npio_Field) + (end - p);
+  if ((array->fields = (npio_Field*) npio_alloc_(array, array->_fields_size
+    , sizeof(size_t))) == 0)
+  {
+    array->_fields_size = 0;
+    return ENOMEM;
+  }
+  names = (char*) (array->fields + n);
+
+  while (1)
+  {
+    p = npio_ph_skip_spaces_(p, end);
+    if (p == end)
+      break;
+
+    field = &array->fields[array->nfields];
+    field->dim = 0;
+    field->count = 1;
+
+    /* ( 'name' , 'dtype' [, shape] [,] ) */
+    if (*p != '(')
+      return EINVAL;
+    p = npio_ph_skip_spaces_(p + 1, end);
+    if ((p = npio_ph_parse_string_(p, end, &name, &name_len)) == 0)
+      return ENOTSUP;  /* titles, or an escape */
+    p = npio_ph_skip_spaces_(p, end);
+    if (p == end || *p++ != ',')
+      return EINVAL;
+    p = npio_ph_skip_spaces_(p, end);
+    if ((p = npio_ph_parse_string_(p, end, &dt, &dt_len)) == 0)
+      return ENOTSUP;  /* a nested record */
+    p = npio_ph_skip_spaces_(p, end);
+    if (p < end && *p == ',')
+    {
+      p = npio_ph_skip_spaces_(p + 1, end);
+      if (p < end && *p != ')'
+        && (err = npio_ph_parse_field_shape_(p, end, &p, field)))
+        return err;
+      p = npio_ph_skip_spaces_(p, end);
+      if (p < end && *p == ',')
+        p = npio_ph_skip_spaces_(p + 1, end);
+    }
+    if (p == end || *p++ != ')')
+      return EINVAL;
+    p = npio_ph_skip_spaces_(p, end);
+    if (p < end && *p == ',')
+      ++p;
+
+    if (dt_len >= sizeof(dtype))
+      return ENOTSUP;
+    memcpy(dtype, dt, dt_len);
+    dtype[dt_len] = 0;
+
+    /* unnamed void fields are padding */
+    if (name_len == 0 && dt_len > 2 && dtype[1] == 'V')
+    {
+      for (i = 2, size = 0; i < dt_len; ++i)
+      {
+        if (dtype[i] < '0' || dtype[i] > '9' || size > SIZE_MAX / 10 - 1)
+          return EINVAL;
+        size = size * 10 + (dtype[i] - '0');
+      }
+      if (size > SIZE_MAX / field->count
+        || size * field->count > SIZE_MAX - offset)
+        return ERANGE;
+      offset += size * field->count;
+      continue;
+    }
+
+    if (npio_parse_dtype(dtype, &t))
+      return ENOTSUP;
+    if (t.bit_width / (t.is_complex ? 2 : 1) > 8 && !t.is_bfloat16)
+    {
+      if (order >= 0 && order != t.little_endian)
+        return ENOTSUP;
+      order = t.little_endian;
+    }
+
+    memcpy(names, name, name_len);
+    names[name_len] = 0;
+    field->name = names;
+    names += name_len + 1;
+    field->offset = offset;
+    field->floating_point = t.floating_point;
+    field->is_signed = t.is_signed;
+    field->is_complex = t.is_complex;
+    field->is_bfloat16 = t.is_bfloat16;
+    field->bit_width = t.bit_width;
+    size = t.bit_width / 8;
+    if (field->count > (SIZE_MAX - offset) / size)
+      return ERANGE;
+    offset += field->count * size;
+    array->nfields++;
+  }
+
+  if (array->nfields == 0)
+    return ENOTSUP;
+  if (offset == 0 || offset > INT_MAX / 8)
+    return ERANGE;
+  array->little_endian = order >= 0 ? order : little_endian;
+  array->floating_point = 0;
+  array->is_signed = 0;
+  array->is_complex = 0;
+  array->is_bfloat16 = 0;
+  array->bit_width = offset * 8;
+  return 0;
+}
+
+
+/* Parse the dtype string from the header of a loaded array. */
+static inline int npio_ph_parse_dtype_(npio_Array* array)
+{
+  if (array->dtype[0] == '[')
+    return npio_ph_parse_record_(array);
+  return npio_parse_dtype(array->dtype, array);
+}
+
+
+/* parse a python dictionary containing the specific keys and value we expect.
+   Each key may only appear once, and descr and shape must be present. */
+static inline int npio_ph_parse_dict_(npio_Array* array, const char* start
+  , const char* end, size_t max_dim)
+{
+  int err, seen = 0;
   char open_quote;
   const char *p = start;
   const char *dtbeg, *dtend;
   size_t dtsz;
-  enum {k_descr, k_shape, k_fortran_order} key;
+  enum {k_descr = 1, k_shape = 2, k_fortran_order = 4} key;
 
   if (p >= end)
     return EINVAL;
@@ -348,6 +1052,10 @@ static inline int npio_ph_parse_dict_(npio_Array* array, const char* start, cons
     else
       return EINVAL;
 
+    if (seen & key)
+      return EINVAL;
+    seen |= key;
+
     /* Expect the close quote of the key */
     if (p >= end || *p++ != open_quote)
       return EINVAL;
@@ -365,17 +1073,41 @@ static inline int npio_ph_parse_dict_(npio_Array* array, const char* start, cons
     switch (key)
     {
       case k_descr:
-        if (!npio_ph_is_quote_(open_quote = *p++))
-          return EINVAL;
-        dtbeg = p;
-        while (p < end && *p != open_quote)
+        if (*p == '{')
+          return ENOTSUP;  /* a dtype with explicit offsets */
+        if (*p == '[')
+        {
+          /* A record descriptor is kept with its brackets, and parsed once
+             the whole dict has been seen. Nested lists are not supported. */
+          dtbeg = p++;
+          for (open_quote = 0; p < end && (open_quote || *p != ']'); ++p)
+          {
+            if (open_quote ? *p == open_quote : npio_ph_is_quote_(*p))
+              open_quote = open_quote ? 0 : *p;
+            else if (!open_quote && *p == '[')
+              return ENOTSUP;
+          }
+          if (p == end)
+            return EINVAL;
+          dtend = ++p;
+        }
+        else
+        {
+          if (!npio_ph_is_quote_(open_quote = *p++))
+            return EINVAL;
+          dtbeg = p;
+          while (p < end && *p != open_quote)
+            ++p;
+          dtend = p;
+          if (p == end)
+            return EINVAL;
           ++p;
-        dtend = p;
-        if (p == end)
-          return EINVAL;
-        ++p;
+        }
         dtsz = dtend - dtbeg;
-        array->dtype = (char*) malloc(dtsz + 1);
+        if (dtsz < sizeof(array->_dtype_buf))
+          array->dtype = array->_dtype_buf;
+        else if ((array->dtype = (char*) npio_alloc_(array, dtsz + 1, 1)) == 0)
+          return ENOMEM;
         memcpy(array->dtype, dtbeg, dtsz);
         array->dtype[dtsz] = 0;
         break;
@@ -396,7 +1128,7 @@ static inline int npio_ph_parse_dict_(npio_Array* array, const char* start, cons
         break;
 
       case k_shape:
-        if ((err = npio_ph_parse_shape_(array, p, end, &p)))
+        if ((err = npio_ph_parse_shape_(array, p, end, &p, max_dim)))
           return err;
         break;
     }
@@ -414,16 +1146,26 @@ static inline int npio_ph_parse_dict_(npio_Array* array, const char* start, cons
     /* next iteration takes care of any nonsense that might happen here! */
   }
 
-  /* Parse the (very restricted) numpy dtype and return */
-  return npio_ph_parse_dtype_(array);
+  if ((seen & (k_descr | k_shape)) != (k_descr | k_shape))
+    return EINVAL;
+
+  /* Parse the (very restricted) numpy dtype, and make sure that the size of
+     the data can be computed. */
+  if ((err = npio_ph_parse_dtype_(array)))
+    return err;
+  if (array->size > SIZE_MAX / (array->bit_width / 8))
+    return ERANGE;
+  return 0;
 }
 
 
 
 /* Initialize the struct so that we can cleanup correctly. Also provide
-defaults for npy_save
+defaults for npy_save. All buffers of the array are allocated from alloc,
+which is copied into the array. If alloc is null, malloc and free are used.
 */
-static inline void npio_init_array(npio_Array* array)
+static inline void npio_init_array2(npio_Array* array
+  , const npio_Allocator* alloc)
 {
   array->major_version = 1;
   array->minor_version = 0;
@@ -437,14 +1179,40 @@ static inline void npio_init_array(npio_Array* array)
   array->floating_point = 1;
   array->is_signed = 1;
   array->bit_width = 32;
+  array->is_complex = 0;
+  array->is_bfloat16 = 0;
   array->data = 0;
-  array->_fd = 0;
+  array->nfields = 0;
+  array->fields = 0;
+  array->_fd = -1;
   array->_buf = 0;
   array->_buf_size = 0;
   array->_hdr_buf = 0;
   array->_shape_capacity = 0;
+  array->_fields_size = 0;
   array->_mmapped = 0;
+  array->_buf_malloced = 0;
   array->_malloced = 0;
+  array->_opened = 0;
+  array->_flags = 0;
+  array->_hdr_buf_size = 0;
+  array->_data_size = 0;
+  NPIO_STATS_(memset(&array->stats, 0, sizeof(array->stats));)
+  if (alloc)
+    array->_alloc = *alloc;
+  else
+  {
+    array->_alloc.alloc = npio_default_alloc_;
+    array->_alloc.free = npio_default_free_;
+    array->_alloc.ctx = 0;
+  }
+}
+
+
+/* Same as above, using malloc and free. */
+static inline void npio_init_array(npio_Array* array)
+{
+  npio_init_array2(array, 0);
 }
 
 
@@ -465,49 +1233,97 @@ static inline void npio_free_array(npio_Array* array)
 {
   if (array->dtype)
   {
-    free(array->dtype);
+    if (array->dtype != array->_dtype_buf)
+      npio_dealloc_(array, array->dtype, strlen(array->dtype) + 1, 1);
     array->dtype = 0;
   }
 
   if (array->shape)
   {
-    free(array->shape);
+    if (array->shape != array->_shape_buf)
+      npio_dealloc_(array, array->shape
+        , sizeof(size_t) * array->_shape_capacity, sizeof(size_t));
     array->shape = 0;
+    array->_shape_capacity = 0;
+  }
+
+  if (array->_fields_size)
+  {
+    npio_dealloc_(array, array->fields, array->_fields_size, sizeof(size_t));
+    array->fields = 0;
+    array->nfields = 0;
+    array->_fields_size = 0;
   }
 
-  if (array->data && !array->_buf)
+  if (array->_malloced)
   {
-    free(array->data);
+    npio_dealloc_(array, array->data, array->_data_size
+      , npio_data_alignment_(array->_flags, array->_data_size));
     array->data = 0;
+    array->_malloced = 0;
   }
 
   if (array->_mmapped)
   {
     munmap(array->_buf, array->_buf_size);
     array->_buf = 0;
+    array->_mmapped = 0;
+  }
+
+  if (array->_buf_malloced)
+  {
+    npio_dealloc_(array, array->_buf, array->_buf_size, NPIO_DATA_ALIGNMENT);
+    array->_buf = 0;
+    array->_buf_malloced = 0;
   }
 
-  if (array->_fd >= 0)
+  /* Only close descriptors that we opened ourselves. */
+  if (array->_opened)
   {
     close(array->_fd);
+    array->_opened = 0;
     array->_fd = -1;
   }
 
   if (array->_hdr_buf)
   {
-    free(array->_hdr_buf);
+    npio_dealloc_(array, array->_hdr_buf, array->_hdr_buf_size, 1);
     array->_hdr_buf = 0;
   }
 }
 
 
+/*
+
+Transfer everything owned by from to the array to, leaving from as if just
+initialized with the same allocator. A plain struct copy is not enough, as
+shape and dtype may point into the struct itself. to must not own anything,
+so free or initialize it first.
+
+Arguments:
+  to: the array that takes ownership.
+  from: a loaded or initialized array.
+*/
+static inline void npio_move_array(npio_Array* to, npio_Array* from)
+{
+  *to = *from;
+  if (from->shape == from->_shape_buf)
+    to->shape = to->_shape_buf;
+  if (from->dtype == from->_dtype_buf)
+    to->dtype = to->_dtype_buf;
+  npio_init_array2(from, &to->_alloc);
+}
+
+
 /*
 Check the magic number, the format version and gets the HEADER_LEN field.
 The prelude should have atleast 10 characters for version 1 and 12 characters
-for version 2.
+for versions 2 and 3.
 */
 static inline int npio_load_header_prelude_(char* p, npio_Array* array, char** end)
 {
+  const unsigned char* u;
+
   /* assert magic string. Basic size check was done above. */
   if (memcmp(p, "\x93NUMPY", 6) != 0)
     return EINVAL;
@@ -517,19 +1333,23 @@ static inline int npio_load_header_prelude_(char* p, npio_Array* array, char** e
   array->major_version = *p++;
   array->minor_version = *p++;
 
-  /* get the header length. Version 1 uses 2 bytes, version 2 uses 4 bytes. */
+  /* get the header length. Version 1 uses 2 bytes, versions 2 and 3 use 4
+     bytes. The bytes must be treated as unsigned. Version 3 only differs in
+     allowing utf8 in the header, which we pass through as is. */
+  u = (const unsigned char*) p;
   switch (array->major_version)
   {
     case 1:
-      array->header_len = p[0] + (p[1] << 8);
+      array->header_len = u[0] + (u[1] << 8);
       p += 2;
       break;
 
     case 2:
-      array->header_len = p[0]
-        + (p[1] << 8)
-        + (p[2] << 16)
-        + (p[3] << 24);
+    case 3:
+      array->header_len = u[0]
+        + (u[1] << 8)
+        + (u[2] << 16)
+        + ((size_t) u[3] << 24);
       p += 4;
       break;
 
@@ -548,6 +1368,7 @@ static inline int npio_load_header_mem4(void* p_, size_t sz
   int err;
   char* p = (char*) p_;
   char *end = p + sz;
+  NPIO_STATS_(npio_StatsMark_ mark;)
 
   /* sanity check, to avoid some checks a bit later. */
   if (sz < 16)
@@ -559,6 +1380,9 @@ static inline int npio_load_header_mem4(void* p_, size_t sz
     array->_buf = p;
     array->_buf_size = sz;
   }
+  NPIO_STATS_(if (!array->_mmapped && !array->_buf_malloced)
+    array->stats.path |= NPIO_PATH_MEM;)
+  NPIO_STATS_(npio_stats_begin_(&mark);)
 
   if ((err = npio_load_header_prelude_(p, array, &p)))
     return err;
@@ -568,7 +1392,9 @@ static inline int npio_load_header_mem4(void* p_, size_t sz
     end = p + array->header_len;
 
   /* Parse the header and return */
-  return npio_ph_parse_dict_(array, p, end);
+  err = npio_ph_parse_dict_(array, p, end, max_dim);
+  NPIO_STATS_(npio_stats_end_(&array->stats, &mark, &array->stats.header_ns);)
+  return err;
 }
 
 
@@ -579,18 +1405,245 @@ static inline int npio_load_header_mem(void *p, size_t sz, npio_Array* array)
 }
 
 
-/* Loads the header using read calls instead of mmap. */
-static inline int npio_load_header_fd_read_(int fd, npio_Array* array, size_t max_dim)
+/*
+Read exactly n bytes, in chunks of at most NPIO_IO_CHUNK_SIZE, retrying on
+EINTR and on the short reads that are normal for pipes and sockets.
+
+Return:
+  0 on success.
+  EINVAL   end of file was reached before n bytes were read.
+  Other errno codes from read.
+*/
+static inline int npio_read_full_(int fd, void* p, size_t n)
+{
+  char *q = (char*) p;
+  ssize_t nr;
+  while (n)
+  {
+    nr = read(fd, q, n < NPIO_IO_CHUNK_SIZE ? n : NPIO_IO_CHUNK_SIZE);
+    if (nr < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    if (nr == 0)
+      return EINVAL;
+    q += nr;
+    n -= nr;
+  }
+  return 0;
+}
+
+
+/* Write exactly n bytes, with the same chunking and retries as above. */
+static inline int npio_write_full_(int fd, const void* p, size_t n)
+{
+  const char *q = (const char*) p;
+  ssize_t nw;
+  while (n)
+  {
+    nw = write(fd, q, n < NPIO_IO_CHUNK_SIZE ? n : NPIO_IO_CHUNK_SIZE);
+    if (nw < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    q += nw;
+    n -= nw;
+  }
+  return 0;
+}
+
+
+#ifdef NPIO_HAVE_PREAD_
+  #define npio_pread_ pread
+  #define npio_pwrite_ pwrite
+#else
+/* pread and pwrite with lseek, restoring the file offset. Unlike them, these
+   cannot be used by several threads on one descriptor. */
+static inline ssize_t npio_pread_(int fd, void* p, size_t n, off_t offset)
+{
+  off_t pos = lseek(fd, 0, SEEK_CUR);
+  ssize_t nr;
+  int err;
+
+  if (pos < 0 || lseek(fd, offset, SEEK_SET) < 0)
+    return -1;
+  nr = read(fd, p, n);
+  err = errno;
+  if (lseek(fd, pos, SEEK_SET) < 0)
+    return -1;
+  errno = err;
+  return nr;
+}
+
+static inline ssize_t npio_pwrite_(int fd, const void* p, size_t n
+  , off_t offset)
+{
+  off_t pos = lseek(fd, 0, SEEK_CUR);
+  ssize_t nw;
+  int err;
+
+  if (pos < 0 || lseek(fd, offset, SEEK_SET) < 0)
+    return -1;
+  nw = write(fd, p, n);
+  err = errno;
+  if (lseek(fd, pos, SEEK_SET) < 0)
+    return -1;
+  errno = err;
+  return nw;
+}
+#endif
+
+
+/* Write exactly n bytes at the given offset, as above. */
+static inline int npio_pwrite_full_(int fd, const void* p, size_t n
+  , off_t offset)
+{
+  const char *q = (const char*) p;
+  ssize_t nw;
+  while (n)
+  {
+    nw = npio_pwrite_(fd, q, n < NPIO_IO_CHUNK_SIZE ? n : NPIO_IO_CHUNK_SIZE
+      , offset);
+    if (nw < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    q += nw;
+    n -= nw;
+    offset += nw;
+  }
+  return 0;
+}
+
+
+/* Read n bytes at offset, retrying on short counts and EINTR. Reaching the end
+   of the file first is reported as EINVAL. */
+static inline int npio_pread_full_(int fd, void* p, size_t n, off_t offset)
+{
+  char *q = (char*) p;
+  ssize_t nr;
+  while (n)
+  {
+    nr = npio_pread_(fd, q, n < NPIO_IO_CHUNK_SIZE ? n : NPIO_IO_CHUNK_SIZE
+      , offset);
+    if (nr < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    if (nr == 0)
+      return EINVAL;
+    q += nr;
+    n -= nr;
+    offset += nr;
+  }
+  return 0;
+}
+
+
+/* Write all of the given buffers, retrying on short counts and EINTR. The iov
+   array is modified. */
+static inline int npio_writev_full_(int fd, struct iovec* iov, int iovcnt)
+{
+  ssize_t nw;
+  while (iovcnt && iov->iov_len == 0)
+    ++iov, --iovcnt;
+  while (iovcnt)
+  {
+    nw = writev(fd, iov, iovcnt);
+    if (nw < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    /* Skip what was written, which may end in the middle of a buffer. */
+    while (iovcnt && (size_t) nw >= iov->iov_len)
+    {
+      nw -= iov->iov_len;
+      ++iov, --iovcnt;
+    }
+    if (iovcnt)
+    {
+      iov->iov_base = (char*) iov->iov_base + nw;
+      iov->iov_len -= nw;
+    }
+  }
+  return 0;
+}
+
+
+/* Read exactly n bytes into p from the descriptor pointed to by ctx. */
+static inline int npio_read_fd_(void* ctx, void* p, size_t n)
+{
+  return npio_read_full_(*(int*) ctx, p, n);
+}
+
+
+/* We suppose here that each dimension in shape should not take more than 20
+   characters to estimate a limit on the header_len. Admitted, this is sloppy.
+   Record descriptors can be much longer, but we only know whether we have one
+   once the header is in, so the prelude is checked against the larger of the
+   limits, and the whole header by npio_check_header_len_ below. */
+#define NPIO_SHAPE_HEADER_LEN_(max_dim) (1024 + (max_dim) * 20)
+
+static inline int npio_check_prelude_len_(const npio_Array* array
+  , size_t max_dim)
+{
+  size_t limit = NPIO_SHAPE_HEADER_LEN_(max_dim);
+  if (limit < NPIO_MAX_HEADER_LEN)
+    limit = NPIO_MAX_HEADER_LEN;
+  return array->header_len > limit ? ERANGE : 0;
+}
+
+
+/* Check the length of the header from p to end, which is only allowed to go
+   beyond the limit for shapes if its descr is a list of fields. */
+static inline int npio_check_header_len_(const npio_Array* array
+  , const char* p, const char* end, size_t max_dim)
+{
+  if (array->header_len <= NPIO_SHAPE_HEADER_LEN_(max_dim))
+    return 0;
+  for (; p + 7 <= end; ++p)
+  {
+    if ((*p == '\'' || *p == '"') && memcmp(p + 1, "descr", 5) == 0
+      && p[6] == *p)
+    {
+      for (p += 7; p < end && (*p == ' ' || *p == ':'); ++p)
+        ;
+      return p < end && *p == '[' ? 0 : ERANGE;
+    }
+  }
+  return ERANGE;
+}
+
+
+/* Load the header from a stream, where read fills exactly n bytes of p or
+   fails with an errno code. The header is copied into _hdr_buf. */
+static inline int npio_load_header_stream_(npio_Array* array, size_t max_dim
+  , int (*read)(void* ctx, void* p, size_t n), void* ctx)
 {
   /* Read just enough to know how much more we need to read */
   char prelude[12];
   char *end;
-  int nr, err;
+  int err;
   size_t prelude_size;
+  NPIO_STATS_(npio_StatsMark_ mark;)
 
-  nr = read(fd, prelude, sizeof(prelude));
-  if (nr < (int) sizeof(prelude))
-    return errno;
+  NPIO_STATS_(array->stats.path |= NPIO_PATH_READ;)
+  NPIO_STATS_(npio_stats_begin_(&mark);)
+  err = read(ctx, prelude, sizeof(prelude));
+  NPIO_STATS_(npio_stats_end_(&array->stats, &mark, &array->stats.read_ns);)
+  if (err)
+    return err;
+  NPIO_STATS_(array->stats.bytes_read += sizeof(prelude);)
 
   if ((err = npio_load_header_prelude_(prelude, array, &end)))
     return err;
@@ -598,23 +1651,105 @@ static inline int npio_load_header_fd_read_(int fd, npio_Array* array, size_t ma
   /* Keep track of how many bytes of prelude were present */
   prelude_size = end - prelude;
 
-  /* We suppose here that each dimension in shape should not take more than 20
-  characters to estimate a limit on the header_len. Admitted, this is sloppy. */
-  if (array->header_len > 1024 + max_dim * 20)
-    return ERANGE;
+  if ((err = npio_check_prelude_len_(array, max_dim)))
+    return err;
+
+  /* The header is padded to a multiple of 16 bytes, so it always extends
+     beyond the prelude we have read. */
+  if (prelude_size + array->header_len < sizeof(prelude))
+    return EINVAL;
 
   /* We stick the prelude back together with the rest of the header */
-  if ((array->_hdr_buf = (char*) malloc(prelude_size + array->header_len)) == 0)
+  if ((array->_hdr_buf = (char*) npio_alloc_(array
+    , prelude_size + array->header_len, 1)) == 0)
     return ENOMEM;
+  array->_hdr_buf_size = prelude_size + array->header_len;
   memcpy(array->_hdr_buf, prelude, sizeof(prelude));
 
   /* Now read in the rest of the header, accounting for excess bytes possibly
      read in with the prelude. */
-  nr = read(fd, array->_hdr_buf + sizeof(prelude)
+  NPIO_STATS_(npio_stats_begin_(&mark);)
+  err = read(ctx, array->_hdr_buf + sizeof(prelude)
     , array->header_len - (sizeof(prelude) - prelude_size));
+  NPIO_STATS_(npio_stats_end_(&array->stats, &mark, &array->stats.read_ns);)
+  if (err)
+    return err;
+  NPIO_STATS_(array->stats.bytes_read += array->_hdr_buf_size
+    - sizeof(prelude);)
 
   /* Parse the header */
-  return npio_ph_parse_dict_(array, array->_hdr_buf + prelude_size, end);
+  NPIO_STATS_(npio_stats_begin_(&mark);)
+  end = array->_hdr_buf + prelude_size + array->header_len;
+  if ((err = npio_check_header_len_(array, array->_hdr_buf + prelude_size, end
+    , max_dim)))
+    return err;
+  err = npio_ph_parse_dict_(array, array->_hdr_buf + prelude_size, end
+    , max_dim);
+  NPIO_STATS_(npio_stats_end_(&array->stats, &mark, &array->stats.header_ns);)
+  return err;
+}
+
+
+/* Loads the header using read calls instead of mmap. */
+static inline int npio_load_header_fd_read_(int fd, npio_Array* array, size_t max_dim)
+{
+  return npio_load_header_stream_(array, max_dim, npio_read_fd_, &fd);
+}
+
+
+/* Apply the NPIO_MADV_* hints in flags to a mapping. These are only hints, so
+   errors are deliberately ignored. */
+static inline void npio_advise_(void* p, size_t sz, int flags)
+{
+  /* Both kinds of hint may be missing in strict modes. */
+  (void) p;
+  (void) sz;
+  (void) flags;
+#ifdef POSIX_MADV_SEQUENTIAL
+  if (flags & NPIO_MADV_SEQUENTIAL)
+    posix_madvise(p, sz, POSIX_MADV_SEQUENTIAL);
+  if (flags & NPIO_MADV_RANDOM)
+    posix_madvise(p, sz, POSIX_MADV_RANDOM);
+  if (flags & NPIO_MADV_WILLNEED)
+    posix_madvise(p, sz, POSIX_MADV_WILLNEED);
+#endif
+#ifdef MADV_HUGEPAGE
+  if (flags & NPIO_MADV_HUGEPAGE)
+    madvise(p, sz, MADV_HUGEPAGE);
+#endif
+}
+
+
+/*
+Load the header of a regular file of file_size bytes by reading the whole file
+into an allocated buffer with a single pread, instead of mapping it. For small
+files this is much cheaper than setting up and tearing down a mapping. The
+data can then be loaded with npio_load_data as usual.
+*/
+static inline int npio_load_header_pread_(int fd, npio_Array* array
+  , size_t max_dim, size_t file_size)
+{
+  char *p;
+  int err;
+  NPIO_STATS_(npio_StatsMark_ mark;)
+
+  if (!array->_opened)
+    array->_fd = fd;
+  if ((p = (char*) npio_alloc_(array, file_size, NPIO_DATA_ALIGNMENT)) == 0)
+    return ENOMEM;
+  array->_buf = p;
+  array->_buf_size = file_size;
+  array->_buf_malloced = 1;
+  NPIO_STATS_(array->stats.path |= NPIO_PATH_PREAD | NPIO_PATH_ALLOC;)
+  NPIO_STATS_(array->stats.bytes_allocated += file_size;)
+
+  NPIO_STATS_(npio_stats_begin_(&mark);)
+  err = npio_pread_full_(fd, p, file_size, 0);
+  NPIO_STATS_(npio_stats_end_(&array->stats, &mark, &array->stats.read_ns);)
+  if (err)
+    return err;
+  NPIO_STATS_(array->stats.bytes_read += file_size;)
+  return npio_load_header_mem4(p, file_size, array, max_dim);
 }
 
 
@@ -631,6 +1766,7 @@ Arguments:
     on array prior to calling this function.
   max_hdr_size: as a security measure, return an error if the header size
     is larger than this limit.
+  flags: a combination of the NPIO_MAP_* and NPIO_MADV_* flags.
 
 Return:
   0 on success.
@@ -639,14 +1775,23 @@ Return:
   ERANGE   header exceeded max_hdr_size
   Other errno codes if file could not be accessed etc.
 */
-static inline int npio_load_header_fd3(int fd, npio_Array* array, size_t max_dim)
+static inline int npio_load_header_fd4(int fd, npio_Array* array, size_t max_dim
+  , int flags)
 {
   ssize_t file_size;
   char *p;
+  int prot, map_flags;
+  NPIO_STATS_(npio_StatsMark_ mark;)
 
-  /* Store the file descriptor for load_data */
+  /* Only allocated data can be placed on NUMA nodes. */
+  if ((flags & (NPIO_NUMA_INTERLEAVE | NPIO_NUMA_BIND))
+    && !(flags & NPIO_MAP_SHARED))
+    flags |= NPIO_NO_MMAP;
+
+  /* Store the file descriptor and the flags for load_data */
   if (!array->_opened)
     array->_fd = fd;
+  array->_flags = flags;
 
   /* Get the file size in preparation to mmap */
   file_size = lseek(fd, 0, SEEK_END);
@@ -655,8 +1800,29 @@ static inline int npio_load_header_fd3(int fd, npio_Array* array, size_t max_dim
   if (file_size < 0)
     return npio_load_header_fd_read_(fd, array, max_dim);
 
+  /* Small files are cheaper to read than to map. */
+  if ((size_t) file_size <= NPIO_MMAP_THRESHOLD && !(flags & NPIO_MAP_SHARED))
+    return npio_load_header_pread_(fd, array, max_dim, file_size);
+
   /* map-in the file */
-  p = (char*) mmap(0, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (flags & NPIO_MAP_SHARED)
+  {
+    prot = PROT_READ;
+    map_flags = MAP_SHARED;
+  }
+  else
+  {
+    prot = PROT_READ | PROT_WRITE;
+    map_flags = MAP_PRIVATE;
+  }
+#ifdef MAP_POPULATE
+  if (flags & NPIO_MAP_POPULATE)
+    map_flags |= MAP_POPULATE;
+#endif
+
+  NPIO_STATS_(npio_stats_begin_(&mark);)
+  p = (flags & NPIO_NO_MMAP) ? (char*) MAP_FAILED
+    : (char*) mmap(0, file_size, prot, map_flags, fd, 0);
   if (p == MAP_FAILED)
   {
     if (lseek(fd, 0, SEEK_SET))
@@ -667,11 +1833,22 @@ static inline int npio_load_header_fd3(int fd, npio_Array* array, size_t max_dim
   array->_mmapped = 1;
   array->_buf = p;
   array->_buf_size = file_size;
+  npio_advise_(p, file_size, flags);
+  NPIO_STATS_(npio_stats_end_(&array->stats, &mark, &array->stats.map_ns);)
+  NPIO_STATS_(array->stats.path |= NPIO_PATH_MMAP;)
+  NPIO_STATS_(array->stats.bytes_mapped += file_size;)
 
   return npio_load_header_mem4(p, file_size, array, max_dim);
 }
 
 
+/* Same as above, without any flags */
+static inline int npio_load_header_fd3(int fd, npio_Array* array, size_t max_dim)
+{
+  return npio_load_header_fd4(fd, array, max_dim, 0);
+}
+
+
 /* Same as above, with default max_dim */
 static inline int npio_load_header_fd(int fd, npio_Array* array)
 {
@@ -681,9 +1858,9 @@ static inline int npio_load_header_fd(int fd, npio_Array* array)
 
 /* Load the header of a numpy array from a file. The data is not explicitly
    loaded (although it may be mapped into memory if the specified path is
-   mappable). */
-static inline int npio_load_header3(const char* filename, npio_Array* array
-  , size_t max_dim)
+   mappable). See npio_load_header_fd4 for the flags. */
+static inline int npio_load_header4(const char* filename, npio_Array* array
+  , size_t max_dim, int flags)
 {
   int fd, err;
   fd = open(filename, O_RDONLY);
@@ -691,10 +1868,10 @@ static inline int npio_load_header3(const char* filename, npio_Array* array
     return errno;
   array->_fd = fd;
   array->_opened = 1;
-  err = npio_load_header_fd3(fd, array, max_dim);
+  err = npio_load_header_fd4(fd, array, max_dim, flags);
 
-  /* we don't need to hang on the fd if we managed to map */
-  if (array->_mmapped)
+  /* we don't need to hang on the fd if we managed to map or read the file */
+  if ((array->_mmapped || array->_buf_malloced) && !(flags & NPIO_KEEP_FD))
   {
     close(fd);
     array->_fd = -1;
@@ -704,104 +1881,454 @@ static inline int npio_load_header3(const char* filename, npio_Array* array
 }
 
 
-/* Same as above, with a default max_dim */
-static inline int npio_load_header(const char* filename, npio_Array* array)
+/* Same as above, without any flags */
+static inline int npio_load_header3(const char* filename, npio_Array* array
+  , size_t max_dim)
 {
-  return npio_load_header3(filename, array, NPIO_DEFAULT_MAX_DIM);
+  return npio_load_header4(filename, array, max_dim, 0);
 }
 
 
-/* Swap two bytes, used for endian conversion below. */
-static inline void npio_swap_bytes_(char* p1, char* p2)
+/* Same as above, with a default max_dim */
+static inline int npio_load_header(const char* filename, npio_Array* array)
 {
-  char tmp;
-  tmp = *p2;
-  *p2 = *p1;
-  *p1 = tmp;
+  return npio_load_header3(filename, array, NPIO_DEFAULT_MAX_DIM);
 }
 
 
 /*
 
-Reverse the bytes of each element in the array to go from little to big or big
-to little endian. This is a simple non-optimized implementation for the sake of
-portability and ease-of-compilation of this code. Performance will be quite
-poor.
-
-Note: assumption: 1 byte == 1 octet.
+Endian conversion.
 
-Arguments:
-  n: the number of elements in the array
-  bit_width: number of bits per element, with 8 bits == 1 byte
-  data: pointer to data.
+The kernels below reverse the bytes of each element from src into dst, which
+may be the same buffer for an in-place conversion. We always have a portable
+scalar implementation built on the compiler's bswap builtins. On x86 with GCC
+or Clang we additionally compile SSSE3 and AVX2 shuffle kernels using target
+attributes and pick one at runtime, so no special compiler flags are needed. On
+ARM we use NEON when the compiler says it is available. Define NPIO_NO_SIMD to
+force the scalar code.
 
 */
-static inline int npio_swap_bytes(size_t n, size_t bit_width, void* data)
-{
-  size_t i;
-  char *p = (char*) data;
 
-  if (bit_width == 8)
-    return 0;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) \
+  && !defined(NPIO_NO_SIMD)
+  #define NPIO_SIMD_X86_ 1
+  #include <immintrin.h>
+#endif
 
-  switch (bit_width)
-  {
-    case 16:
-      for (i = 0; i < n; ++i)
-      {
-        npio_swap_bytes_(p, p + 1);
-        p += 2;
-      }
-      return 0;
+#if defined(__ARM_NEON) && !defined(NPIO_NO_SIMD)
+  #define NPIO_SIMD_NEON_ 1
+  #include <arm_neon.h>
+#endif
 
-    case 32:
-      for (i = 0; i < n; ++i)
-      {
-        npio_swap_bytes_(p, p + 3);
-        npio_swap_bytes_(p + 1, p + 2);
-        p += 4;
-      }
-      return 0;
+#if defined(__GNUC__)
+  #define npio_bswap16_(x) __builtin_bswap16(x)
+  #define npio_bswap32_(x) __builtin_bswap32(x)
+  #define npio_bswap64_(x) __builtin_bswap64(x)
+#else
+  #define npio_bswap16_(x) ((uint16_t) (((x) >> 8) | ((x) << 8)))
+  #define npio_bswap32_(x) ((((uint32_t) npio_bswap16_((uint16_t) (x))) << 16) \
+    | npio_bswap16_((uint16_t) ((x) >> 16)))
+  #define npio_bswap64_(x) ((((uint64_t) npio_bswap32_((uint32_t) (x))) << 32) \
+    | npio_bswap32_((uint32_t) ((x) >> 32)))
+#endif
 
-    case 64:
-      for (i = 0; i < n; ++i)
-      {
-        npio_swap_bytes_(p, p + 7);
-        npio_swap_bytes_(p + 1, p + 6);
-        npio_swap_bytes_(p + 2, p + 5);
-        npio_swap_bytes_(p + 3, p + 4);
-        p += 8;
-      }
-      return 0;
 
-    default:
-      return ENOTSUP;
+/* Scalar kernels. We go through memcpy so that unaligned buffers are fine;
+   the compiler turns these into plain loads and stores. */
+static inline void npio_swap16_scalar_(size_t n, const char* s, char* d)
+{
+  size_t i;
+  uint16_t v;
+  for (i = 0; i < n; ++i, s += 2, d += 2)
+  {
+    memcpy(&v, s, 2);
+    v = npio_bswap16_(v);
+    memcpy(d, &v, 2);
   }
 }
 
 
-/*
-Load the array data, having previously read a header via npio_load_header.
-
-If swap_bytes is true, the loaded data is converted to host endian.
+static inline void npio_swap32_scalar_(size_t n, const char* s, char* d)
+{
+  size_t i;
+  uint32_t v;
+  for (i = 0; i < n; ++i, s += 4, d += 4)
+  {
+    memcpy(&v, s, 4);
+    v = npio_bswap32_(v);
+    memcpy(d, &v, 4);
+  }
+}
 
-*/
 
-static inline int npio_load_data2(npio_Array* array, int swap_bytes)
+static inline void npio_swap64_scalar_(size_t n, const char* s, char* d)
 {
-  /* These macros work on both GCC and CLANG without an additional include.
+  size_t i;
+  uint64_t v;
+  for (i = 0; i < n; ++i, s += 8, d += 8)
+  {
+    memcpy(&v, s, 8);
+    v = npio_bswap64_(v);
+    memcpy(d, &v, 8);
+  }
+}
+
+
+/* Shuffle masks for 16, 32 and 64-bit elements, indexed by log2(bytes) - 1. */
+static const unsigned char npio_swap_masks_[3][16] = {
+  {1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14},
+  {3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12},
+  {7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8}
+};
+
+
+#ifdef NPIO_SIMD_X86_
+
+/* Each of these swaps as many whole 16 or 32-byte blocks as there are in
+   nbytes and returns the number of bytes processed. */
+__attribute__((target("ssse3")))
+static inline size_t npio_swap_ssse3_(size_t nbytes, const char* s, char* d
+  , const unsigned char* mask)
+{
+  size_t i;
+  __m128i m = _mm_loadu_si128((const __m128i*) mask);
+  for (i = 0; i + 16 <= nbytes; i += 16)
+    _mm_storeu_si128((__m128i*) (d + i)
+      , _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (s + i)), m));
+  return i;
+}
+
+
+/* vpshufb works within 128-bit lanes, so the same mask goes into both. */
+__attribute__((target("avx2")))
+static inline size_t npio_swap_avx2_(size_t nbytes, const char* s, char* d
+  , const unsigned char* mask)
+{
+  size_t i;
+  __m256i m = _mm256_broadcastsi128_si256(
+    _mm_loadu_si128((const __m128i*) mask));
+  for (i = 0; i + 64 <= nbytes; i += 64)
+  {
+    __m256i a = _mm256_loadu_si256((const __m256i*) (s + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*) (s + i + 32));
+    _mm256_storeu_si256((__m256i*) (d + i), _mm256_shuffle_epi8(a, m));
+    _mm256_storeu_si256((__m256i*) (d + i + 32), _mm256_shuffle_epi8(b, m));
+  }
+  for (; i + 32 <= nbytes; i += 32)
+    _mm256_storeu_si256((__m256i*) (d + i)
+      , _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*) (s + i)), m));
+  return i;
+}
+
+
+/* 0: scalar, 1: SSSE3, 2: AVX2. Probed once and cached. */
+static inline int npio_simd_level_(void)
+{
+  static int level = -1;
+  int l = __atomic_load_n(&level, __ATOMIC_RELAXED);
+  if (l < 0)
+  {
+    __builtin_cpu_init();
+    l = __builtin_cpu_supports("avx2") ? 2
+      : __builtin_cpu_supports("ssse3") ? 1 : 0;
+    __atomic_store_n(&level, l, __ATOMIC_RELAXED);
+  }
+  return l;
+}
+
+#endif  /* NPIO_SIMD_X86_ */
+
+
+/* Vectorized part of the swap. Returns the number of bytes processed, which
+   is always a multiple of the element width. The caller finishes the tail. */
+static inline size_t npio_swap_simd_(size_t nbytes, const char* s, char* d
+  , int mask_index)
+{
+#if defined(NPIO_SIMD_X86_)
+  switch (npio_simd_level_())
+  {
+    case 2: return npio_swap_avx2_(nbytes, s, d, npio_swap_masks_[mask_index]);
+    case 1: return npio_swap_ssse3_(nbytes, s, d, npio_swap_masks_[mask_index]);
+    default: return 0;
+  }
+#elif defined(NPIO_SIMD_NEON_)
+  size_t i;
+  for (i = 0; i + 16 <= nbytes; i += 16)
+  {
+    uint8x16_t v = vld1q_u8((const uint8_t*) (s + i));
+    switch (mask_index)
+    {
+      case 0: v = vrev16q_u8(v); break;
+      case 1: v = vrev32q_u8(v); break;
+      default: v = vrev64q_u8(v); break;
+    }
+    vst1q_u8((uint8_t*) (d + i), v);
+  }
+  return i;
+#else
+  (void) nbytes; (void) s; (void) d; (void) mask_index;
+  return 0;
+#endif
+}
+
+
+/*
+
+Reverse the bytes of each element in src and store the result in dst, to go
+from little to big or big to little endian. src and dst may be the same buffer
+but must not otherwise overlap.
+
+A bit_width of 128 is treated as a pair of 64-bit values, each swapped
+separately, which is what complex128 data needs.
+
+Note: assumption: 1 byte == 1 octet.
+
+Arguments:
+  n: the number of elements in the array
+  bit_width: number of bits per element, with 8 bits == 1 byte
+  src: pointer to the source data.
+  dst: pointer to the destination, which must have room for n elements.
+
+Return:
+  0 on success, ENOTSUP if bit_width is not one of 8, 16, 32, 64 or 128.
+
+*/
+static inline int npio_swap_bytes4(size_t n, size_t bit_width, const void* src
+  , void* dst)
+{
+  const char *s = (const char*) src;
+  char *d = (char*) dst;
+  size_t done;
+
+  switch (bit_width)
+  {
+    case 8:
+      if (s != d)
+        memcpy(d, s, n);
+      return 0;
+
+    case 16:
+      done = npio_swap_simd_(n * 2, s, d, 0);
+      npio_swap16_scalar_(n - done / 2, s + done, d + done);
+      return 0;
+
+    case 32:
+      done = npio_swap_simd_(n * 4, s, d, 1);
+      npio_swap32_scalar_(n - done / 4, s + done, d + done);
+      return 0;
+
+    case 128:
+      n *= 2;
+      /* fall through */
+    case 64:
+      done = npio_swap_simd_(n * 8, s, d, 2);
+      npio_swap64_scalar_(n - done / 8, s + done, d + done);
+      return 0;
+
+    default:
+      return ENOTSUP;
+  }
+}
+
+
+/* Same as above, in-place. */
+static inline int npio_swap_bytes(size_t n, size_t bit_width, void* data)
+{
+  return npio_swap_bytes4(n, bit_width, data, data);
+}
+
+
+/* The width in bits of the values to byte swap in elements of an array: the
+   real and imaginary parts of complex numbers are swapped separately. */
+static inline size_t npio_swap_width_(const npio_Array* array)
+{
+  return array->is_complex ? array->bit_width / 2 : array->bit_width;
+}
+
+
+/* Swap n records of a structured array from src into dst, field by field. */
+static inline int npio_swap_records_(const npio_Array* array, size_t n
+  , const void* src, void* dst)
+{
+  size_t i, j, w, size = array->bit_width / 8;
+  const npio_Field* f;
+  char *d = (char*) dst;
+
+  if (src != dst)
+    memcpy(dst, src, n * size);
+  for (j = 0; j < array->nfields; ++j)
+  {
+    f = &array->fields[j];
+    w = f->is_complex ? f->bit_width / 2 : f->bit_width;
+    if (w > 8)
+      for (i = 0; i < n; ++i)
+        npio_swap_bytes(f->count * (f->bit_width / w), w
+          , d + i * size + f->offset);
+  }
+  return 0;
+}
+
+
+/* Swap n elements of the type described by array from src into dst. */
+static inline int npio_swap_elements_(const npio_Array* array, size_t n
+  , const void* src, void* dst)
+{
+  size_t w = npio_swap_width_(array);
+  if (array->nfields)
+    return npio_swap_records_(array, n, src, dst);
+  return npio_swap_bytes4(n * (array->bit_width / w), w, src, dst);
+}
+
+
+/* Compute the offset of the data from the start of the file and check that
+   it matches the alignment requirements of the format. */
+static inline int npio_data_offset_(const npio_Array* array, size_t* offset)
+{
+  *offset = array->header_len + 6 + (array->major_version == 1 ? 4 : 6);
+  if (*offset % 16)
+    return EINVAL;
+  return 0;
+}
+
+
+/* The smallest range of a parallel read that is worth a thread */
+#ifndef NPIO_PARALLEL_RANGE
+  #define NPIO_PARALLEL_RANGE (1 << 22)
+#endif
+
+/* Threads can only share a descriptor with pread and pwrite. */
+#ifdef NPIO_HAVE_PREAD_
+  #define NPIO_PARALLEL_PREAD_ 1
+#else
+  #define NPIO_PARALLEL_PREAD_ 0
+#endif
+
+
+/* The alignment of O_DIRECT writes. Ranges of parallel IO are multiples of
+   this too. */
+#ifndef NPIO_DIRECT_ALIGNMENT
+  #define NPIO_DIRECT_ALIGNMENT 4096
+#endif
+
+
+/* A read or write of data split into ranges that are handed out to threads. */
+typedef struct
+{
+  int fd;
+  char* data;
+  off_t offset;       /* The file offset of data */
+  size_t size;
+  size_t range;       /* The size of each range */
+  size_t next;        /* The next range to transfer */
+  int bit_width;      /* The element size, if ranges read are to be swapped */
+  int write;          /* Whether to write rather than read */
+  int err;            /* The first error */
+} npio_ParallelIO_;
+
+
+static inline void* npio_parallel_io_thread_(void* arg)
+{
+  npio_ParallelIO_* r = (npio_ParallelIO_*) arg;
+  size_t i, off, n;
+  int err, expected;
+
+  while (!__atomic_load_n(&r->err, __ATOMIC_RELAXED))
+  {
+    i = __atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED);
+    off = i * r->range;
+    if (off >= r->size)
+      break;
+    n = r->size - off < r->range ? r->size - off : r->range;
+
+    if (r->write)
+      err = npio_pwrite_full_(r->fd, r->data + off, n, r->offset + off);
+    else
+      err = npio_pread_full_(r->fd, r->data + off, n, r->offset + off);
+
+    /* Swap each range while it is still in cache. */
+    if (!err && r->bit_width)
+      err = npio_swap_bytes(n * 8 / r->bit_width, r->bit_width, r->data + off);
+    if (err)
+    {
+      expected = 0;
+      __atomic_compare_exchange_n(&r->err, &expected, err, 0
+        , __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+  }
+  return 0;
+}
+
+
+/* Read or write sz bytes of data at offset with nthreads threads, including
+   the calling thread. Data read is swapped in elements of bit_width bits,
+   unless it is 0. */
+static inline int npio_parallel_io_(int fd, void* data, size_t sz
+  , off_t offset, size_t nthreads, int bit_width, int write)
+{
+  npio_ParallelIO_ r;
+  pthread_t threads[64];
+  size_t i, started = 0;
+
+  if (nthreads == 0)
+    nthreads = 1;
+  if (nthreads > sizeof(threads) / sizeof(threads[0]))
+    nthreads = sizeof(threads) / sizeof(threads[0]);
+
+  /* A few ranges per thread even out differences in their speed. */
+  r.fd = fd;
+  r.data = (char*) data;
+  r.offset = offset;
+  r.size = sz;
+  r.range = (sz / (nthreads * 4) + NPIO_DIRECT_ALIGNMENT - 1)
+    & ~(size_t) (NPIO_DIRECT_ALIGNMENT - 1);
+  if (r.range < NPIO_PARALLEL_RANGE)
+    r.range = NPIO_PARALLEL_RANGE;
+  r.next = 0;
+  r.bit_width = bit_width;
+  r.write = write;
+  r.err = 0;
+
+  for (i = 1; i < nthreads && i * r.range < sz; ++i, ++started)
+    if (pthread_create(&threads[started], 0, npio_parallel_io_thread_, &r))
+      break;
+  npio_parallel_io_thread_(&r);
+  for (i = 0; i < started; ++i)
+    pthread_join(threads[i], 0);
+  return r.err;
+}
+
+
+/*
+Load the array data, having previously read a header via npio_load_header.
+
+If swap_bytes is true, the loaded data is converted to host endian.
+
+If the data is read rather than mapped, from a descriptor that supports pread,
+it is read in ranges by nthreads threads, including the calling thread, each
+swapping the bytes of its ranges as they arrive. This can make much better use
+of storage and file systems that serve parallel requests, but costs a thread
+start per call, so it only helps with large arrays. Data smaller than
+NPIO_PARALLEL_RANGE is read by the calling thread alone.
+
+*/
+static inline int npio_load_data3(npio_Array* array, int swap_bytes
+  , size_t nthreads)
+{
+  /* These macros work on both GCC and CLANG without an additional include.
      Right now we do not support any other endianness than big and little.
      Numpy also only supports these two ('<' and '>'). */
   static const int little_endian = (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
   size_t data_offset;
   size_t sz;
-  ssize_t nr;
+  void *src;
+  int err;
+  NPIO_STATS_(npio_StatsMark_ mark;)
 
   /* Check that the header_len matches the alignment requirements
      of the format */
-  data_offset = array->header_len + 6 + (array->major_version == 1 ? 4 : 6);
-  if (data_offset % 16)
-    return EINVAL;
+  if ((err = npio_data_offset_(array, &data_offset)))
+    return err;
 
   if (array->_buf)
   {
@@ -819,27 +2346,85 @@ static inline int npio_load_data2(npio_Array* array, int swap_bytes)
     sz = array->size * array->bit_width / 8;
     if ((ssize_t) sz < 0)
       return ERANGE;
-    array->data = malloc(sz);
-    if (!array->data)
-      return ENOMEM;
-    nr = read(array->_fd, array->data, sz);
-    if (nr < 0)
-      return errno;
-    if (nr != (ssize_t) sz)
-      return EINVAL;
+    if ((err = npio_alloc_data_(array, sz)))
+      return err;
+    NPIO_STATS_(array->stats.path |= NPIO_PATH_READ_DATA;)
+
+    /* Read in parallel if the descriptor is positioned at the data of a
+       seekable file. Records are swapped field by field afterwards, so they
+       are read by one thread. */
+    if (nthreads > 1 && sz >= 2 * NPIO_PARALLEL_RANGE && !array->nfields
+      && NPIO_PARALLEL_PREAD_
+      && lseek(array->_fd, 0, SEEK_CUR) == (off_t) data_offset)
+    {
+      NPIO_STATS_(npio_stats_begin_(&mark);)
+      err = npio_parallel_io_(array->_fd, array->data, sz, data_offset
+        , nthreads, (swap_bytes && little_endian != array->little_endian)
+          ? npio_swap_width_(array) : 0, 0);
+      NPIO_STATS_(npio_stats_end_(&array->stats, &mark
+        , &array->stats.read_ns);)
+      if (err)
+        return err;
+      NPIO_STATS_(array->stats.path |= NPIO_PATH_PARALLEL;)
+      NPIO_STATS_(array->stats.bytes_read += sz;)
+      NPIO_STATS_(if (swap_bytes && little_endian != array->little_endian)
+      {
+        array->stats.path |= NPIO_PATH_SWAP;
+        array->stats.bytes_swapped += sz;
+      })
+      if (swap_bytes)
+        array->little_endian = little_endian;
+      if (lseek(array->_fd, data_offset + sz, SEEK_SET) < 0)
+        return errno;
+      return 0;
+    }
+
+    /* This is a hint that only helps with regular files, so any error such
+       as ESPIPE for a pipe is ignored. */
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(array->_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    NPIO_STATS_(npio_stats_begin_(&mark);)
+    err = npio_read_full_(array->_fd, array->data, sz);
+    NPIO_STATS_(npio_stats_end_(&array->stats, &mark, &array->stats.read_ns);)
+    if (err)
+      return err;
+    NPIO_STATS_(array->stats.bytes_read += sz;)
   }
 
   /* Swap bytes if necessary */
   if (swap_bytes && little_endian != array->little_endian)
   {
     array->little_endian = little_endian;
-    return npio_swap_bytes(array->size, array->bit_width, array->data);
+    src = array->data;
+    sz = npio_array_memsize(array);
+
+    /* A shared mapping or an npz archive is read-only, so swap into a copy
+       instead. */
+    if (array->_buf && (array->_flags & NPIO_MAP_SHARED))
+    {
+      if ((err = npio_alloc_data_(array, sz)))
+        return err;
+    }
+    NPIO_STATS_(npio_stats_begin_(&mark);)
+    err = npio_swap_elements_(array, array->size, src, array->data);
+    NPIO_STATS_(npio_stats_end_(&array->stats, &mark, &array->stats.swap_ns);)
+    NPIO_STATS_(array->stats.path |= NPIO_PATH_SWAP;)
+    NPIO_STATS_(array->stats.bytes_swapped += sz;)
+    return err;
   }
 
   return 0;
 }
 
 
+/* Same as above, with a single thread. */
+static inline int npio_load_data2(npio_Array* array, int swap_bytes)
+{
+  return npio_load_data3(array, swap_bytes, 1);
+}
+
+
 /* Same as above, but always swaps the byte order to match host. */
 static inline int npio_load_data(npio_Array* array)
 {
@@ -848,517 +2433,5987 @@ static inline int npio_load_data(npio_Array* array)
 
 
 /*
-Load a numpy file.
-
-Arguments:
-  fd: file descriptor of a file in numpy format.
-  array: pointer to an Array struct that will be populated on success.
+Hint that rows begin to end (exclusive) along axis 0 of an array, whose header
+has been loaded, will be needed soon. Only the pages of those rows are read
+ahead: with madvise for a mapped file, or with posix_fadvise on the descriptor
+if the data is yet to be read from it. Data that is already in memory needs
+nothing. In Fortran order rows are not contiguous, so the whole data is read
+ahead instead. This returns right away, and the read ahead is only a hint.
 
 Return:
-  0 on success, error code otherwise.
+  0 on success, EINVAL if begin > end or the header is invalid.
 */
-static inline int npio_load_fd3(int fd, npio_Array* array, size_t max_dim)
+static inline int npio_prefetch(const npio_Array* array, size_t begin
+  , size_t end)
 {
-  int err;
-
-  /* First load the header. */
-  if ((err = npio_load_header_fd3(fd, array, max_dim)))
-    return err;
+  size_t offset, total, row, page;
+  size_t lo = 0, hi;
+  off_t pos;
 
-  return npio_load_data(array);
-}
+  if (begin > end || npio_data_offset_(array, &offset))
+    return EINVAL;
 
+  hi = total = npio_array_memsize(array);
+  if (array->dim > 0 && !(array->fortran_order && array->dim > 1)
+    && array->shape[0])
+  {
+    row = total / array->shape[0];
+    if (end > array->shape[0])
+      end = array->shape[0];
+    lo = begin < end ? begin * row : 0;
+    hi = begin < end ? end * row : 0;
+  }
+  if (lo >= hi)
+    return 0;
 
-/* Same as above but with defaulted max_dim */
-static inline int npio_load_fd(int fd, npio_Array* array)
-{
-  return npio_load_fd3(fd, array, NPIO_DEFAULT_MAX_DIM);
+  if (array->_mmapped && !array->_malloced)
+  {
+    page = sysconf(_SC_PAGESIZE);
+    lo = (offset + lo) & ~(page - 1);
+    hi += offset;
+#ifdef POSIX_MADV_WILLNEED
+    posix_madvise((char*) array->_buf + lo, hi - lo, POSIX_MADV_WILLNEED);
+#endif
+  }
+  else if (!array->_buf && !array->data && array->_fd >= 0)
+  {
+    /* The descriptor is positioned at the start of the data. */
+    if ((pos = lseek(array->_fd, 0, SEEK_CUR)) >= 0)
+    {
+#ifdef POSIX_FADV_WILLNEED
+      posix_fadvise(array->_fd, pos + lo, hi - lo, POSIX_FADV_WILLNEED);
+#endif
+    }
+  }
+  return 0;
 }
 
 
 /*
-Load a numpy file.
 
-Arguments:
-  filename: name of the file to be loaded.
-  array: an Array struct that will be populated on return.  You should not
-    have called npio_init_array on the array. On success, you can access
-    the header information and data in array.  When done with it, you must
-    call npio_free_array() on the array to cleanup.
+Half precision.
+
+These convert n 16-bit floats, either IEEE half precision (float16) or
+bfloat16, to and from host-endian float32, rounding to nearest even. The
+buffers may be unaligned. On x86 with GCC or Clang, F16C and AVX2 kernels are
+compiled with target attributes and picked at runtime as for the byte swaps;
+on AArch64, NEON is used. The scalar code gives the same results, except that
+the payload of a NaN may differ.
 
-Return:
-  0 on success, error code otherwise.
 */
 
-static inline int npio_load3(const char* filename, npio_Array* array
-  , size_t max_dim)
+static inline float npio_f16_to_f32_scalar_(uint16_t h)
 {
-  int fd, err;
-  fd = open(filename, O_RDONLY);
-  if (fd < 0)
-    return errno;
-  err = npio_load_fd3(fd, array, max_dim);
-  close(fd);
-  return err;
+  uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+  uint32_t exp = (h >> 10) & 0x1f, mant = h & 0x3ff, bits;
+  float f;
+
+  if (exp == 0x1f)
+    bits = sign | 0x7f800000 | (mant << 13);
+  else if (exp)
+    bits = sign | ((exp + 112) << 23) | (mant << 13);
+  else
+  {
+    /* zero or subnormal, which is exact in float32 */
+    f = mant * (1.0f / 16777216.0f);
+    memcpy(&bits, &f, 4);
+    bits |= sign;
+  }
+  memcpy(&f, &bits, 4);
+  return f;
 }
 
 
-/* Same as above, but with a reasonable default for the max_hdr_size
-safety parameter. */
-static inline int npio_load(const char* filename, npio_Array* array)
+/* See Fabian Giesen's float_to_half_fast3_rtne. */
+static inline uint16_t npio_f32_to_f16_scalar_(float value)
 {
-  /* This covers all version-1 files and should not be in any danger
-  of bringing down the calling code. */
-  return npio_load3(filename, array, 65536);
+  const uint32_t f16max = (127 + 16) << 23, denorm_magic = 126 << 23;
+  uint32_t x, sign;
+  float f;
+
+  memcpy(&x, &value, 4);
+  sign = (x >> 16) & 0x8000;
+  x &= 0x7fffffff;
+
+  if (x >= f16max)
+    return sign | (x > 0x7f800000 ? 0x7e00 : 0x7c00);
+
+  if (x < (113 << 23))
+  {
+    /* The result is subnormal; let the FPU do the rounding. */
+    memcpy(&f, &x, 4);
+    memcpy(&value, &denorm_magic, 4);
+    f += value;
+    memcpy(&x, &f, 4);
+    return sign | (x - denorm_magic);
+  }
+
+  x += ((uint32_t) (15 - 127) << 23) + 0xfff + ((x >> 13) & 1);
+  return sign | (x >> 13);
 }
 
 
-/* Load an numpy array from a memory buffer.  The contents point to the
-   buffer and are not copied. */
-static inline int npio_load_mem4(void *p, size_t sz, npio_Array* array
-  , size_t max_dim)
+static inline float npio_bf16_to_f32_scalar_(uint16_t h)
 {
-  int err;
-  if ((err = npio_load_header_mem4(p, sz, array, max_dim)))
-    return err;
-  return npio_load_data(array);
+  uint32_t bits = (uint32_t) h << 16;
+  float f;
+  memcpy(&f, &bits, 4);
+  return f;
 }
 
 
-/* Same as above, with a default for max_dim. */
-static inline int npio_load_mem(void *p, size_t sz, npio_Array* array)
+static inline uint16_t npio_f32_to_bf16_scalar_(float value)
 {
-  return npio_load_mem4(p, sz, array, NPIO_DEFAULT_MAX_DIM);
+  uint32_t x;
+  memcpy(&x, &value, 4);
+  if ((x & 0x7fffffff) > 0x7f800000)
+    return (x >> 16) | 0x40;  /* keep NaNs quiet */
+  x += 0x7fff + ((x >> 16) & 1);
+  return x >> 16;
 }
 
 
-/* Prepare a numpy header in the designated memory buffer. On success, zero is
-returned and out is set to 1 beyond the last written byte of the header. */
-static inline int npio_save_header_mem(void* p, size_t sz, const npio_Array* array
-  , void **out)
+#ifdef NPIO_SIMD_X86_
+
+__attribute__((target("avx,f16c")))
+static inline size_t npio_f16_to_f32_f16c_(size_t n, const char* s, float* d)
 {
-  size_t i, hdr_len;
-  char* hdr_buf = (char*) p;
-  char* hdr_end = hdr_buf + sz;
-  char* hdr = hdr_buf;
+  size_t i;
+  for (i = 0; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(d + i
+      , _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*) (s + 2 * i))));
+  return i;
+}
 
-  /* This is the absolute minimum space for the header the way we write it. */
-  if (sz < 64)
-    return ERANGE;
 
-  memcpy(hdr, "\x93NUMPY\x1\x0", 8);
-  hdr = hdr_buf + 8 + 2; /* leave 2 bytes for header_len, to be filled later*/
-  hdr += sprintf(hdr, "{\"descr\": \"%c%c%d\", "
-    , array->little_endian ? '<' : '>'
-    , array->floating_point ? 'f' : array->is_signed ? 'i' : 'u'
-    , array->bit_width / 8);
-  /* There is no way hdr can overflow at this point! */
+__attribute__((target("avx,f16c")))
+static inline size_t npio_f32_to_f16_f16c_(size_t n, const float* s, char* d)
+{
+  size_t i;
+  for (i = 0; i + 8 <= n; i += 8)
+    _mm_storeu_si128((__m128i*) (d + 2 * i)
+      , _mm256_cvtps_ph(_mm256_loadu_ps(s + i), _MM_FROUND_TO_NEAREST_INT));
+  return i;
+}
 
-  hdr += sprintf(hdr, "\"fortran_order\": %s, "
-    , array->fortran_order ? "True" : "False");
-  /* Again, no need to check for overflow here. */
 
-  hdr += sprintf(hdr, "\"shape\": (");
-  for (i = 0; i < array->dim; ++i)
+__attribute__((target("avx2")))
+static inline size_t npio_bf16_to_f32_avx2_(size_t n, const char* s, float* d)
+{
+  size_t i;
+  for (i = 0; i + 8 <= n; i += 8)
+    _mm256_storeu_si256((__m256i*) (d + i), _mm256_slli_epi32(
+      _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*) (s + 2 * i)))
+      , 16));
+  return i;
+}
+
+
+/* Same rounding as the scalar code, eight at a time. vpackusdw works within
+   128-bit lanes, so the halves are gathered with a permute. */
+__attribute__((target("avx2")))
+static inline size_t npio_f32_to_bf16_avx2_(size_t n, const float* s, char* d)
+{
+  const __m256i one = _mm256_set1_epi32(1), round = _mm256_set1_epi32(0x7fff);
+  const __m256i quiet = _mm256_set1_epi32(0x400000);
+  size_t i;
+  for (i = 0; i + 8 <= n; i += 8)
   {
-    hdr += snprintf(hdr, hdr_end - hdr, "%ld, ", array->shape[i]);
-    if (hdr >= hdr_end - 3)
-      return ERANGE;
+    __m256 f = _mm256_loadu_ps(s + i);
+    __m256i x = _mm256_castps_si256(f);
+    __m256i r = _mm256_add_epi32(x, _mm256_add_epi32(round
+      , _mm256_and_si256(_mm256_srli_epi32(x, 16), one)));
+    __m256i nan = _mm256_castps_si256(_mm256_cmp_ps(f, f, _CMP_UNORD_Q));
+    r = _mm256_blendv_epi8(r, _mm256_or_si256(x, quiet), nan);
+    r = _mm256_srli_epi32(r, 16);
+    r = _mm256_permute4x64_epi64(_mm256_packus_epi32(r, r), 0x08);
+    _mm_storeu_si128((__m128i*) (d + 2 * i), _mm256_castsi256_si128(r));
   }
-  hdr += sprintf(hdr, ")} ");  /* hence the -3 above. */
+  return i;
+}
 
-  /* insert pad spaces */
-  while (hdr < hdr_end && ((hdr - hdr_end) % 16))
-    *hdr++ = ' ';
 
-  /* check that we still have space */
-  if ((hdr - hdr_end) % 16)
-    return ERANGE;
+/* Whether the CPU has F16C, probed once and cached. */
+static inline int npio_has_f16c_(void)
+{
+  static int has = -1;
+  int h = __atomic_load_n(&has, __ATOMIC_RELAXED);
+  if (h < 0)
+  {
+    __builtin_cpu_init();
+    h = __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+    __atomic_store_n(&has, h, __ATOMIC_RELAXED);
+  }
+  return h;
+}
 
-  /* terminate with a \n.  The npy specification is vague on this. One
-  interpretation is that the \n can occur first and then be followed by
-  spaces, but that causes "IndentationError: unexpected indent" from the
-  python loader. */
-  hdr[-1] = '\n';
+#endif  /* NPIO_SIMD_X86_ */
+
+
+/* Convert n 16-bit floats at s, bfloat16 if bf16 is true, into float32. */
+static inline void npio_half_to_f32_(int bf16, size_t n, const void* src
+  , float* d)
+{
+  const char *s = (const char*) src;
+  size_t i = 0;
+  uint16_t h;
+
+#if defined(NPIO_SIMD_X86_)
+  if (bf16 && npio_simd_level_() >= 2)
+    i = npio_bf16_to_f32_avx2_(n, s, d);
+  else if (!bf16 && npio_has_f16c_())
+    i = npio_f16_to_f32_f16c_(n, s, d);
+#elif defined(NPIO_SIMD_NEON_) && defined(__aarch64__)
+  for (; i + 4 <= n; i += 4)
+  {
+    uint16x4_t v = vld1_u16((const uint16_t*) (s + 2 * i));
+    if (bf16)
+      vst1q_f32(d + i, vreinterpretq_f32_u32(vshll_n_u16(v, 16)));
+    else
+      vst1q_f32(d + i, vcvt_f32_f16(vreinterpret_f16_u16(v)));
+  }
+#endif
+
+  for (; i < n; ++i)
+  {
+    memcpy(&h, s + 2 * i, 2);
+    d[i] = bf16 ? npio_bf16_to_f32_scalar_(h) : npio_f16_to_f32_scalar_(h);
+  }
+}
+
+
+/* Convert n float32 at s into 16-bit floats, bfloat16 if bf16 is true. */
+static inline void npio_f32_to_half_(int bf16, size_t n, const float* s
+  , void* dst)
+{
+  char *d = (char*) dst;
+  size_t i = 0;
+  uint16_t h;
+
+#if defined(NPIO_SIMD_X86_)
+  if (bf16 && npio_simd_level_() >= 2)
+    i = npio_f32_to_bf16_avx2_(n, s, d);
+  else if (!bf16 && npio_has_f16c_())
+    i = npio_f32_to_f16_f16c_(n, s, d);
+#elif defined(NPIO_SIMD_NEON_) && defined(__aarch64__)
+  if (!bf16)
+    for (; i + 4 <= n; i += 4)
+      vst1_u16((uint16_t*) (d + 2 * i)
+        , vreinterpret_u16_f16(vcvt_f16_f32(vld1q_f32(s + i))));
+#endif
+
+  for (; i < n; ++i)
+  {
+    h = bf16 ? npio_f32_to_bf16_scalar_(s[i]) : npio_f32_to_f16_scalar_(s[i]);
+    memcpy(d + 2 * i, &h, 2);
+  }
+}
+
+
+/*
+
+Type conversion.
+
+npio_convert casts n elements described by `from` into the representation
+described by `to`, byte-swapping on either side as needed. Only the type
+fields (little_endian, floating_point, is_signed, is_complex, is_bfloat16 and
+bit_width) of the two descriptors are consulted. Elements are processed in
+blocks small enough to stay in cache, so the swap and the cast happen in a
+single pass over memory. Values are converted as with a C cast, except that
+floats converted to integers saturate at the limits of the integer type and
+NaN becomes 0, since a C cast of such values is undefined and they may come
+from untrusted files. 16-bit floats go through float32. Complex numbers can only be converted to other complex
+numbers, since dropping the imaginary part silently is rarely what is meant.
+
+*/
+
+/* Elements per conversion block. 1024 * 16 bytes stays within L1. */
+#define NPIO_CONVERT_BLOCK 1024
+
+/* Type codes used to dispatch the conversion loops. */
+enum
+{
+  npio_t_i1_, npio_t_i2_, npio_t_i4_, npio_t_i8_,
+  npio_t_u1_, npio_t_u2_, npio_t_u4_, npio_t_u8_,
+  npio_t_f4_, npio_t_f8_, npio_t_f2_, npio_t_bf2_,
+  npio_t_c8_, npio_t_c16_
+};
+
+
+/* Map the type fields of an array to a type code, or -1 if unsupported. */
+static inline int npio_type_code_(const npio_Array* array)
+{
+  int w;
+  if (array->nfields)
+    return -1;
+  switch (array->bit_width)
+  {
+    case 8: w = 0; break;
+    case 16: w = 1; break;
+    case 32: w = 2; break;
+    case 64: w = 3; break;
+    case 128: w = 4; break;
+    default: return -1;
+  }
+  if (array->is_complex)
+    return w == 3 ? npio_t_c8_ : w == 4 ? npio_t_c16_ : -1;
+  if (w == 4)
+    return -1;
+  if (array->floating_point)
+    return w == 1 ? (array->is_bfloat16 ? npio_t_bf2_ : npio_t_f2_)
+      : w == 2 ? npio_t_f4_ : w == 3 ? npio_t_f8_ : -1;
+  return (array->is_signed ? npio_t_i1_ : npio_t_u1_) + w;
+}
+
+
+#define NPIO_CVT_TO_(DT) \
+  { \
+    DT* d_ = (DT*) d; \
+    for (i = 0; i < n; ++i) \
+      d_[i] = (DT) s_[i]; \
+  } \
+  break;
+
+#define NPIO_CVT_INT_TO_(DT, MIN, MAX) NPIO_CVT_TO_(DT)
+
+/* From floats, compared in the source type. MAX may round up to a power of
+   two there, which is then out of range itself. */
+#define NPIO_CVT_SAT_TO_(DT, MIN, MAX) \
+  { \
+    DT* d_ = (DT*) d; \
+    for (i = 0; i < n; ++i) \
+      d_[i] = s_[i] != s_[i] ? 0 : s_[i] <= MIN ? MIN : s_[i] >= MAX ? MAX \
+        : (DT) s_[i]; \
+  } \
+  break;
+
+/* Defines npio_cvt_<name>_, which casts n host-endian elements of type ST
+   at s into the type with code dcode at d, using TO for integer targets. */
+#define NPIO_DEFINE_CVT_(NAME, ST, TO) \
+  static inline void npio_cvt_##NAME##_(const void* s, void* d, size_t n \
+    , int dcode) \
+  { \
+    size_t i; \
+    const ST* s_ = (const ST*) s; \
+    switch (dcode) \
+    { \
+      case npio_t_i1_: TO(int8_t, INT8_MIN, INT8_MAX) \
+      case npio_t_i2_: TO(int16_t, INT16_MIN, INT16_MAX) \
+      case npio_t_i4_: TO(int32_t, INT32_MIN, INT32_MAX) \
+      case npio_t_i8_: TO(int64_t, INT64_MIN, INT64_MAX) \
+      case npio_t_u1_: TO(uint8_t, 0, UINT8_MAX) \
+      case npio_t_u2_: TO(uint16_t, 0, UINT16_MAX) \
+      case npio_t_u4_: TO(uint32_t, 0, UINT32_MAX) \
+      case npio_t_u8_: TO(uint64_t, 0, UINT64_MAX) \
+      case npio_t_f4_: NPIO_CVT_TO_(float) \
+      case npio_t_f8_: NPIO_CVT_TO_(double) \
+    } \
+  }
+
+NPIO_DEFINE_CVT_(i1, int8_t, NPIO_CVT_INT_TO_)
+NPIO_DEFINE_CVT_(i2, int16_t, NPIO_CVT_INT_TO_)
+NPIO_DEFINE_CVT_(i4, int32_t, NPIO_CVT_INT_TO_)
+NPIO_DEFINE_CVT_(i8, int64_t, NPIO_CVT_INT_TO_)
+NPIO_DEFINE_CVT_(u1, uint8_t, NPIO_CVT_INT_TO_)
+NPIO_DEFINE_CVT_(u2, uint16_t, NPIO_CVT_INT_TO_)
+NPIO_DEFINE_CVT_(u4, uint32_t, NPIO_CVT_INT_TO_)
+NPIO_DEFINE_CVT_(u8, uint64_t, NPIO_CVT_INT_TO_)
+NPIO_DEFINE_CVT_(f4, float, NPIO_CVT_SAT_TO_)
+NPIO_DEFINE_CVT_(f8, double, NPIO_CVT_SAT_TO_)
+
+#undef NPIO_DEFINE_CVT_
+#undef NPIO_CVT_SAT_TO_
+#undef NPIO_CVT_INT_TO_
+#undef NPIO_CVT_TO_
+
+
+/* Cast one block of host-endian elements. */
+static inline void npio_cvt_block_(int scode, const void* s, int dcode, void* d
+  , size_t n)
+{
+  switch (scode)
+  {
+    case npio_t_i1_: npio_cvt_i1_(s, d, n, dcode); break;
+    case npio_t_i2_: npio_cvt_i2_(s, d, n, dcode); break;
+    case npio_t_i4_: npio_cvt_i4_(s, d, n, dcode); break;
+    case npio_t_i8_: npio_cvt_i8_(s, d, n, dcode); break;
+    case npio_t_u1_: npio_cvt_u1_(s, d, n, dcode); break;
+    case npio_t_u2_: npio_cvt_u2_(s, d, n, dcode); break;
+    case npio_t_u4_: npio_cvt_u4_(s, d, n, dcode); break;
+    case npio_t_u8_: npio_cvt_u8_(s, d, n, dcode); break;
+    case npio_t_f4_: npio_cvt_f4_(s, d, n, dcode); break;
+    case npio_t_f8_: npio_cvt_f8_(s, d, n, dcode); break;
+  }
+}
+
+
+/*
+
+Convert n elements at src described by `from` into dst described by `to`.
+The destination must be suitably aligned for its element type and must not
+overlap the source.
+
+Return:
+  0 on success.
+  ENOTSUP  one of the types is not supported.
+
+*/
+static inline int npio_convert(const npio_Array* from, const void* src
+  , const npio_Array* to, void* dst, size_t n)
+{
+  static const int little_endian = (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+  int scode, dcode, code;
+  size_t i, m, sw, dw;
+  const char *s = (const char*) src;
+  char *d = (char*) dst;
+  const void *p;
+  uint64_t tmp[NPIO_CONVERT_BLOCK * 2];
+  float f32[NPIO_CONVERT_BLOCK];
+
+  if ((scode = npio_type_code_(from)) < 0 || (dcode = npio_type_code_(to)) < 0)
+    return ENOTSUP;
+  if ((scode >= npio_t_c8_) != (dcode >= npio_t_c8_))
+    return ENOTSUP;
+
+  /* Same type: at most a byte swap. */
+  if (scode == dcode)
+  {
+    if (from->little_endian == to->little_endian)
+    {
+      memcpy(dst, src, n * from->bit_width / 8);
+      return 0;
+    }
+    return npio_swap_elements_(from, n, src, dst);
+  }
+
+  sw = from->bit_width / 8;
+  dw = to->bit_width / 8;
+  for (i = 0; i < n; i += m)
+  {
+    m = n - i < NPIO_CONVERT_BLOCK ? n - i : NPIO_CONVERT_BLOCK;
+
+    /* Bring the block into host order in the scratch buffer, which also
+       takes care of any misalignment of the source. */
+    if (from->little_endian == little_endian)
+      memcpy(tmp, s, m * sw);
+    else
+      npio_swap_elements_(from, m, s, tmp);
+
+    if (scode >= npio_t_c8_)
+    {
+      /* Complex numbers convert as pairs of floats. */
+      npio_cvt_block_(scode - npio_t_c8_ + npio_t_f4_, tmp
+        , dcode - npio_t_c8_ + npio_t_f4_, d, 2 * m);
+    }
+    else
+    {
+      /* 16-bit floats go through float32 on either side. */
+      p = tmp;
+      code = scode;
+      if (code == npio_t_f2_ || code == npio_t_bf2_)
+      {
+        npio_half_to_f32_(code == npio_t_bf2_, m, tmp, f32);
+        p = f32;
+        code = npio_t_f4_;
+      }
+      if (dcode == npio_t_f2_ || dcode == npio_t_bf2_)
+      {
+        if (code != npio_t_f4_)
+        {
+          npio_cvt_block_(code, p, npio_t_f4_, f32, m);
+          p = f32;
+        }
+        npio_f32_to_half_(dcode == npio_t_bf2_, m, (const float*) p, d);
+      }
+      else
+        npio_cvt_block_(code, p, dcode, d, m);
+    }
 
-  /* Fill in the header_len field */
-  hdr_len = hdr - hdr_buf - 10;
-  hdr_buf[8] = hdr_len & 0xff;
-  hdr_buf[9] = hdr_len >> 8;
+    if (to->little_endian != little_endian)
+      npio_swap_elements_(to, m, d, d);
 
-  *out = hdr;
+    s += m * sw;
+    d += m * dw;
+  }
   return 0;
 }
 
 
+/* Same as above, with the target type given as a dtype string such as "<f4"
+   or "=i8". The source is the data of a previously loaded array. */
+static inline int npio_convert_data(const npio_Array* array, void* dst
+  , const char* dtype)
+{
+  int err;
+  npio_Array to;
+
+  npio_init_array(&to);
+  if ((err = npio_parse_dtype(dtype, &to)))
+    return err;
+  return npio_convert(array, array->data, &to, dst, array->size);
+}
+
+
 /*
-Save a numpy file.
+
+Structured arrays.
+
+The data of a structured array is a sequence of records, each holding the
+fields described by array->fields. npio_field_view describes one field as a
+strided view over the loaded data, with no copy: element k of the subarray of
+record i is at base + i * stride + k * bit_width / 8. npio_field_gather copies
+one field out into a contiguous buffer, converting it on the way like
+npio_convert, which suits column-oriented processing with SIMD.
+
+*/
+
+typedef struct
+{
+  const npio_Field* field;  /* The field, which gives the type */
+  char*  base;            /* The field in the first record */
+  size_t stride;          /* The distance between records in bytes */
+  size_t n;               /* The number of records */
+  int    little_endian;   /* The byte order of the elements */
+} npio_FieldView;
+
+
+/*
+Fill view with the field called name of a loaded structured array.
+
+Return:
+  0 on success.
+  EINVAL   the array is not a structured array, or has no data.
+  ENOENT   there is no such field.
+*/
+static inline int npio_field_view(const npio_Array* array, const char* name
+  , npio_FieldView* view)
+{
+  size_t i;
+
+  if (!array->nfields || !array->data)
+    return EINVAL;
+  for (i = 0; i < array->nfields; ++i)
+  {
+    if (strcmp(array->fields[i].name, name) == 0)
+    {
+      view->field = &array->fields[i];
+      view->base = (char*) array->data + array->fields[i].offset;
+      view->stride = array->bit_width / 8;
+      view->n = array->size;
+      view->little_endian = array->little_endian;
+      return 0;
+    }
+  }
+  return ENOENT;
+}
+
+
+/* Copy n values of size bytes, stride bytes apart, into the contiguous dst.
+   The common sizes get a loop of fixed size copies. */
+static inline void npio_gather_(const char* s, size_t stride, size_t size
+  , size_t n, char* d)
+{
+  size_t i;
+  switch (size)
+  {
+    case 4:
+      for (i = 0; i < n; ++i, s += stride, d += 4)
+        memcpy(d, s, 4);
+      break;
+
+    case 8:
+      for (i = 0; i < n; ++i, s += stride, d += 8)
+        memcpy(d, s, 8);
+      break;
+
+    default:
+      for (i = 0; i < n; ++i, s += stride, d += size)
+        memcpy(d, s, size);
+  }
+}
+
+
+/*
+Copy the field of every record in view into dst, converted to the type given
+by dtype (e.g. "=f8"), so that dst holds view->n * view->field->count
+contiguous elements of that type. When the types match, the values are
+copied straight into dst; otherwise they are gathered into a small buffer a
+block at a time and converted from there.
+
+Return:
+  0 on success.
+  ENOTSUP  the field cannot be converted to dtype.
+*/
+static inline int npio_field_gather(const npio_FieldView* view, void* dst
+  , const char* dtype)
+{
+  const npio_Field* f = view->field;
+  npio_Array from, to;
+  size_t i, m, per, fsz, dsz;
+  uint64_t buf[2048];
+  char *d = (char*) dst;
+  int err;
+
+  npio_init_array(&from);
+  npio_init_array(&to);
+  if ((err = npio_parse_dtype(dtype, &to)))
+    return err;
+  from.little_endian = view->little_endian;
+  from.floating_point = f->floating_point;
+  from.is_signed = f->is_signed;
+  from.is_complex = f->is_complex;
+  from.is_bfloat16 = f->is_bfloat16;
+  from.bit_width = f->bit_width;
+  if (npio_type_code_(&from) < 0 || npio_type_code_(&to) < 0)
+    return ENOTSUP;
+
+  fsz = f->count * (f->bit_width / 8);
+  dsz = f->count * (to.bit_width / 8);
+  if (npio_type_code_(&from) == npio_type_code_(&to)
+    && from.little_endian == to.little_endian)
+  {
+    npio_gather_(view->base, view->stride, fsz, view->n, d);
+    return 0;
+  }
+
+  per = sizeof(buf) / fsz;
+  for (i = 0; i < view->n; i += m)
+  {
+    if (per == 0)
+    {
+      /* A huge subarray converts in place, one record at a time. */
+      m = 1;
+      err = npio_convert(&from, view->base + i * view->stride, &to, d
+        , f->count);
+    }
+    else
+    {
+      m = view->n - i < per ? view->n - i : per;
+      npio_gather_(view->base + i * view->stride, view->stride, fsz, m
+        , (char*) buf);
+      err = npio_convert(&from, buf, &to, d, m * f->count);
+    }
+    if (err)
+      return err;
+    d += m * dsz;
+  }
+  return 0;
+}
+
+
+/*
+
+Load the array data directly into a caller-provided buffer, converting it to
+the type given by dtype (e.g. "<f4", or "=f8" for host order) in the same pass.
+The header must have been loaded previously via npio_load_header.
+
+Unlike npio_load_data, this never writes into the mapped or user-provided
+source buffer, so a private file mapping is not dirtied. When reading from a
+file descriptor, the data is read in blocks and converted as it arrives, so no
+buffer for the whole array is allocated. The type fields of the array still
+describe the file on return and array->data is not set.
 
 Arguments:
-  fd: file descriptor of file to be saved to.
-  array: array to be saved.
+  array: an array whose header was loaded with npio_load_header.
+  dst: destination with room for array->size elements of the target type,
+    suitably aligned for that type.
+  dtype: the target type.
 
 Return:
   0 on success.
-  ERANGE: the array has too many dimensions.
-  Other IO error from the OS.
+  EINVAL   the data is truncated or inconsistent with the header.
+  ENOTSUP  the source or target type is not supported.
+  ENOMEM   could not allocate the read buffer.
+  Other errno codes from read.
+
 */
-static inline int npio_save_fd(int fd, const npio_Array* array)
+static inline int npio_load_data_as(npio_Array* array, void* dst
+  , const char* dtype)
 {
-  /*
-  We save in version 1 for now, so no need for dynamic allocation.
-  hdr_buf should be no smaller than 128 and should be divisible by 16.
-  */
-  char hdr_buf[65536];
-  void *end;
-  char* hdr;
+  npio_Array to;
+  size_t data_offset, sw, dw, done, m, block;
+  char *buf, *d;
   int err;
-  ssize_t nw;
-  size_t sz;
 
-  if ((err = npio_save_header_mem(hdr_buf, sizeof(hdr_buf), array, &end)))
+  npio_init_array(&to);
+  if ((err = npio_parse_dtype(dtype, &to)))
     return err;
+  if (npio_type_code_(array) < 0)
+    return ENOTSUP;
 
-  hdr = (char*) end;
-  nw = write(fd, hdr_buf, hdr - hdr_buf);
-  if (nw < hdr - hdr_buf)
-    return errno;
+  if ((err = npio_data_offset_(array, &data_offset)))
+    return err;
 
-  /* Ok, now write out the data */
-  sz = npio_array_memsize(array);
-  if ((ssize_t) sz < 0)
-    return ERANGE;  /* We can break it up into multiple writes,
-                       but this is pretty damn large and will surely
-                       exceed filesystem limits! */
-  nw = write(fd, array->data, sz);
-  if (nw != (ssize_t) sz)
-    return errno;
+  if (array->_buf)
+  {
+    if (data_offset + npio_array_memsize(array) != array->_buf_size)
+      return EINVAL;
+    return npio_convert(array, (char*) array->_buf + data_offset, &to, dst
+      , array->size);
+  }
 
-  /* all done */
-  return 0;
+  /* Read and convert a whole number of elements at a time. */
+  sw = array->bit_width / 8;
+  dw = to.bit_width / 8;
+  block = NPIO_CONVERT_BLOCK * 16;
+  if ((buf = (char*) malloc(block * sw)) == 0)
+    return ENOMEM;
+
+  d = (char*) dst;
+  for (done = 0; done < array->size; done += m)
+  {
+    m = array->size - done < block ? array->size - done : block;
+    if ((err = npio_read_full_(array->_fd, buf, m * sw)))
+      break;
+    if ((err = npio_convert(array, buf, &to, d, m)))
+      break;
+    d += m * dw;
+  }
+
+  free(buf);
+  return err;
 }
 
 
 /*
-Save a numpy file.
+Load a numpy file.
 
 Arguments:
-  filename: name of the file to be saved to.
-  array: the array to be saved.
+  fd: file descriptor of a file in numpy format.
+  array: pointer to an Array struct that will be populated on success.
 
 Return:
   0 on success, error code otherwise.
 */
-static inline int npio_save(const char* filename, const npio_Array* array)
+static inline int npio_load_fd3(int fd, npio_Array* array, size_t max_dim)
+{
+  int err;
+
+  /* First load the header. */
+  if ((err = npio_load_header_fd3(fd, array, max_dim)))
+    return err;
+
+  return npio_load_data(array);
+}
+
+
+/* Same as above but with defaulted max_dim */
+static inline int npio_load_fd(int fd, npio_Array* array)
+{
+  return npio_load_fd3(fd, array, NPIO_DEFAULT_MAX_DIM);
+}
+
+
+/*
+Load a numpy file.
+
+Arguments:
+  filename: name of the file to be loaded.
+  array: an Array struct that will be populated on return.  You should not
+    have called npio_init_array on the array. On success, you can access
+    the header information and data in array.  When done with it, you must
+    call npio_free_array() on the array to cleanup.
+
+Return:
+  0 on success, error code otherwise.
+*/
+
+static inline int npio_load3(const char* filename, npio_Array* array
+  , size_t max_dim)
 {
   int fd, err;
-  fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  fd = open(filename, O_RDONLY);
   if (fd < 0)
     return errno;
-  err = npio_save_fd(fd, array);
+  err = npio_load_fd3(fd, array, max_dim);
   close(fd);
   return err;
 }
 
 
-#ifdef __cplusplus
-
-// Convenience wrappers for C++
+/* Same as above, but with a reasonable default for the max_hdr_size
+safety parameter. */
+static inline int npio_load(const char* filename, npio_Array* array)
+{
+  /* This covers all version-1 files and should not be in any danger
+  of bringing down the calling code. */
+  return npio_load3(filename, array, 65536);
+}
 
-// Enable additional convenience functions for C++11
-#define NPIO_CXX11 __cplusplus >= 201103L
 
-// You must define this macro if you want the C++ API to use exceptions instead
-// of return values.
-#ifdef NPIO_CXX_ENABLE_EXCEPTIONS
-  #include <typeinfo>
-  #include <system_error>
+/* Load an numpy array from a memory buffer.  The contents point to the
+   buffer and are not copied. */
+static inline int npio_load_mem4(void *p, size_t sz, npio_Array* array
+  , size_t max_dim)
+{
+  int err;
+  if ((err = npio_load_header_mem4(p, sz, array, max_dim)))
+    return err;
+  return npio_load_data(array);
+}
+
+
+/* Same as above, with a default for max_dim. */
+static inline int npio_load_mem(void *p, size_t sz, npio_Array* array)
+{
+  return npio_load_mem4(p, sz, array, NPIO_DEFAULT_MAX_DIM);
+}
+
+
+/*
+
+Header scans.
+
+npio_stat fills an npio_Info from just the start of a file, read with a single
+pread into a buffer on the stack, without mapping the file or allocating any
+memory. This is much cheaper than npio_load_header when only the metadata of
+many files is needed.
+
+*/
+
+/* The largest number of dimensions that npio_stat can report. */
+#ifndef NPIO_STAT_MAX_DIM
+  #define NPIO_STAT_MAX_DIM NPIO_DEFAULT_MAX_DIM
 #endif
 
-#if NPIO_CXX11
-  #include <initializer_list>
+/* The number of bytes that npio_stat reads. This is enough for any header of
+   up to NPIO_STAT_MAX_DIM dimensions. */
+#define NPIO_STAT_READ_SIZE_ (1024 + NPIO_STAT_MAX_DIM * 20 + 16)
+
+
+/* The metadata of an array, with the same meaning as in npio_Array. */
+typedef struct
+{
+  char   major_version;
+  char   minor_version;
+  size_t header_len;
+  char   dtype[16];
+  size_t dim;
+  size_t shape[NPIO_STAT_MAX_DIM];
+  size_t size;
+  int    fortran_order;
+  int    little_endian;
+  int    floating_point;
+  int    is_signed;
+  int    bit_width;
+  int    is_complex;
+  int    is_bfloat16;
+  uint64_t data_offset;  /* The offset of the data from the start of the file */
+  uint64_t file_size;    /* The file size, or 0 if it is not known */
+} npio_Info;
+
+
+/* An allocator over a small buffer, so that the header parser does not need
+   the heap. Nothing is ever freed. */
+typedef struct
+{
+  size_t buf[128];
+  size_t used;
+} npio_StackArena_;
+
+
+static inline void* npio_stack_alloc_(void* ctx, size_t size, size_t alignment)
+{
+  npio_StackArena_* a = (npio_StackArena_*) ctx;
+  size_t off = (a->used + alignment - 1) & ~(alignment - 1);
+  if (alignment > sizeof(size_t) || off + size > sizeof(a->buf))
+    return 0;
+  a->used = off + size;
+  return (char*) a->buf + off;
+}
+
+
+/*
+Fill info from a buffer of sz bytes that holds at least the whole header. The
+file_size field is left alone.
+
+Return:
+  0 on success.
+  EINVAL   the header is invalid or does not fit in the buffer.
+  ERANGE   the array has more than NPIO_STAT_MAX_DIM dimensions, or the dtype
+           is too long.
+  ENOTSUP  the dtype is not supported.
+*/
+static inline int npio_stat_mem(const void* p, size_t sz, npio_Info* info)
+{
+  npio_StackArena_ arena;
+  npio_Allocator alloc;
+  npio_Array array;
+  size_t offset;
+  int err;
+
+  arena.used = 0;
+  alloc.alloc = npio_stack_alloc_;
+  alloc.free = 0;
+  alloc.ctx = &arena;
+  npio_init_array2(&array, &alloc);
+
+  if ((err = npio_load_header_mem4((void*) p, sz, &array, NPIO_STAT_MAX_DIM)))
+    return (err == ENOMEM) ? ERANGE : err;
+  if ((err = npio_data_offset_(&array, &offset)))
+    return err;
+  if (offset > sz)
+    return EINVAL;
+  if (array.dim > NPIO_STAT_MAX_DIM || strlen(array.dtype) >= sizeof(info->dtype))
+    return ERANGE;
+
+  info->major_version = array.major_version;
+  info->minor_version = array.minor_version;
+  info->header_len = array.header_len;
+  strcpy(info->dtype, array.dtype);
+  info->dim = array.dim;
+  memcpy(info->shape, array.shape, array.dim * sizeof(size_t));
+  info->size = array.size;
+  info->fortran_order = array.fortran_order;
+  info->little_endian = array.little_endian;
+  info->floating_point = array.floating_point;
+  info->is_signed = array.is_signed;
+  info->bit_width = array.bit_width;
+  info->is_complex = array.is_complex;
+  info->is_bfloat16 = array.is_bfloat16;
+  info->data_offset = offset;
+  return 0;
+}
+
+
+/*
+Fill info from the header of the file open on fd, which must support pread.
+The file offset is not changed. The size of the file is not checked against
+the shape.
+
+Return:
+  0 on success, or any of the errors of npio_stat_mem.
+  Other errno codes from pread or fstat.
+*/
+static inline int npio_stat_fd(int fd, npio_Info* info)
+{
+  char buf[NPIO_STAT_READ_SIZE_];
+  struct stat st;
+  ssize_t nr;
+  int err;
+
+  do
+    nr = npio_pread_(fd, buf, sizeof(buf), 0);
+  while (nr < 0 && errno == EINTR);
+  if (nr < 0)
+    return errno;
+  if ((err = npio_stat_mem(buf, nr, info)))
+    return err;
+
+  if (fstat(fd, &st))
+    return errno;
+  info->file_size = S_ISREG(st.st_mode) ? (uint64_t) st.st_size : 0;
+  return 0;
+}
+
+
+/* Same as above, but opens the named file. */
+static inline int npio_stat(const char* filename, npio_Info* info)
+{
+  int fd, err;
+  if ((fd = open(filename, O_RDONLY)) < 0)
+    return errno;
+  err = npio_stat_fd(fd, info);
+  close(fd);
+  return err;
+}
+
+
+/*
+
+Metadata index.
+
+An index file records the npio_Info of many arrays by path, in a compact
+binary form that is mapped by npio_index_open and searched without parsing or
+allocating anything. The format is in host byte order and is only meant to be
+read back on the same kind of machine:
+
+  header   a npio_IndexHeader_
+  entries  n npio_IndexEntry_ records, sorted by path
+  shapes   uint64_t dimensions, shared by all entries
+  paths    null-terminated paths
+
+*/
+
+typedef struct
+{
+  char     magic[8];     /* "NPIOIDX" and 'L' or 'B' for the byte order */
+  uint64_t n;            /* The number of entries */
+  uint64_t shapes;       /* The offset of the shapes */
+  uint64_t paths;        /* The offset of the paths */
+  uint64_t size;         /* The size of the index */
+} npio_IndexHeader_;
+
+
+typedef struct
+{
+  uint64_t path;         /* The offset of the path in the paths */
+  uint64_t shape;        /* The index of the first dimension in the shapes */
+  uint64_t data_offset;
+  uint64_t file_size;
+  uint64_t header_len;
+  uint32_t dim;
+  uint8_t  major_version;
+  uint8_t  minor_version;
+  uint8_t  fortran_order;
+  uint8_t  pad_;
+  char     dtype[16];
+} npio_IndexEntry_;
+
+
+typedef struct
+{
+  size_t n;              /* The number of entries */
+
+  /* The following fields are private. */
+  void*  _buf;
+  size_t _buf_size;
+} npio_Index;
+
+
+#define NPIO_INDEX_MAGIC_ \
+  ((__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) ? "NPIOIDXL" : "NPIOIDXB")
+
+
+/* A path and its metadata, while an index is being built */
+typedef struct
+{
+  const char* path;
+  npio_Info info;
+} npio_IndexItem_;
+
+
+static inline int npio_index_item_cmp_(const void* a, const void* b)
+{
+  return strcmp(((const npio_IndexItem_*) a)->path
+    , ((const npio_IndexItem_*) b)->path);
+}
+
+
+/* Write the index of n items, which are sorted in place. */
+static inline int npio_index_write_(int fd, npio_IndexItem_* items, size_t n)
+{
+  npio_IndexHeader_ hdr;
+  npio_IndexEntry_ *entries;
+  uint64_t *shapes;
+  char *paths, *buf;
+  size_t i, nshapes = 0, paths_size = 0, size;
+  int err;
+
+  qsort(items, n, sizeof(*items), npio_index_item_cmp_);
+  for (i = 0; i < n; ++i)
+  {
+    nshapes += items[i].info.dim;
+    paths_size += strlen(items[i].path) + 1;
+  }
+
+  memcpy(hdr.magic, NPIO_INDEX_MAGIC_, 8);
+  hdr.n = n;
+  hdr.shapes = sizeof(hdr) + n * sizeof(*entries);
+  hdr.paths = hdr.shapes + nshapes * sizeof(*shapes);
+  hdr.size = size = hdr.paths + paths_size;
+
+  if ((buf = (char*) calloc(size, 1)) == 0)
+    return ENOMEM;
+  memcpy(buf, &hdr, sizeof(hdr));
+  entries = (npio_IndexEntry_*) (buf + sizeof(hdr));
+  shapes = (uint64_t*) (buf + hdr.shapes);
+  paths = buf + hdr.paths;
+
+  for (i = 0, nshapes = 0, paths_size = 0; i < n; ++i)
+  {
+    const npio_Info* info = &items[i].info;
+    npio_IndexEntry_* e = &entries[i];
+    size_t j, len = strlen(items[i].path) + 1;
+
+    e->path = paths_size;
+    e->shape = nshapes;
+    e->data_offset = info->data_offset;
+    e->file_size = info->file_size;
+    e->header_len = info->header_len;
+    e->dim = info->dim;
+    e->major_version = info->major_version;
+    e->minor_version = info->minor_version;
+    e->fortran_order = info->fortran_order;
+    memcpy(e->dtype, info->dtype, sizeof(e->dtype));
+    for (j = 0; j < info->dim; ++j)
+      shapes[nshapes++] = info->shape[j];
+    memcpy(paths + paths_size, items[i].path, len);
+    paths_size += len;
+  }
+
+  err = npio_write_full_(fd, buf, size);
+  free(buf);
+  return err;
+}
+
+
+/*
+Build an index of the n files named in paths, and save it as index_path.
+Files whose header cannot be read are left out of the index, and if errors is
+not null, errors[i] receives the result of npio_stat for paths[i]. The paths
+are recorded as given, so lookups must use the same spelling.
+
+Return:
+  0 on success, otherwise an errno code from writing the index.
+*/
+static inline int npio_index_build(const char* index_path, size_t n
+  , const char* const* paths, int* errors)
+{
+  npio_IndexItem_ *items;
+  size_t i, m = 0;
+  int fd, err;
+
+  if ((items = (npio_IndexItem_*) malloc(n ? n * sizeof(*items) : 1)) == 0)
+    return ENOMEM;
+  for (i = 0; i < n; ++i)
+  {
+    items[m].path = paths[i];
+    err = npio_stat(paths[i], &items[m].info);
+    if (errors)
+      errors[i] = err;
+    if (!err)
+      ++m;
+  }
+
+  if ((fd = open(index_path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+    err = errno;
+  else
+  {
+    err = npio_index_write_(fd, items, m);
+    if (close(fd) && !err)
+      err = errno;
+  }
+  free(items);
+  return err;
+}
+
+
+/* Open name for reading in the directory dir, open as d. Without openat, the
+   path is joined by hand. */
+static inline int npio_open_in_(DIR* d, const char* dir, const char* name)
+{
+#ifdef NPIO_HAVE_OPENAT_
+  (void) dir;
+  return openat(dirfd(d), name, O_RDONLY);
+#else
+  size_t len = strlen(dir), n = strlen(name);
+  char* path;
+  int fd, err;
+
+  (void) d;
+  if ((path = (char*) malloc(len + n + 2)) == 0)
+  {
+    errno = ENOMEM;
+    return -1;
+  }
+  memcpy(path, dir, len);
+  path[len] = '/';
+  memcpy(path + len + 1, name, n + 1);
+  fd = open(path, O_RDONLY);
+  err = errno;
+  free(path);
+  errno = err;
+  return fd;
 #endif
+}
+
+
+/*
+Build an index of all the files in the directory dir whose names end in .npy,
+and save it as index_path. Entries are recorded by their name within dir.
+Files whose header cannot be read are left out.
+
+Return:
+  0 on success, otherwise an errno code from reading the directory or writing
+  the index.
+*/
+static inline int npio_index_build_dir(const char* index_path, const char* dir)
+{
+  npio_IndexItem_ *items = 0, *tmp;
+  size_t n = 0, capacity = 0, len;
+  char *names = 0;  /* A list of names, chained through their first bytes */
+  char *name;
+  struct dirent *de;
+  DIR *d;
+  int fd, err = 0;
+
+  if ((d = opendir(dir)) == 0)
+    return errno;
+
+  while ((errno = 0, de = readdir(d)) != 0)
+  {
+    len = strlen(de->d_name);
+    if (len < 4 || strcmp(de->d_name + len - 4, ".npy") != 0)
+      continue;
+    if ((fd = npio_open_in_(d, dir, de->d_name)) < 0)
+      continue;
+    if (n == capacity)
+    {
+      capacity = capacity ? capacity * 2 : 64;
+      if ((tmp = (npio_IndexItem_*) realloc(items, capacity * sizeof(*items)))
+        == 0)
+      {
+        close(fd);
+        err = ENOMEM;
+        break;
+      }
+      items = tmp;
+    }
+    if (npio_stat_fd(fd, &items[n].info) == 0)
+    {
+      /* Keep the name, which readdir may overwrite. */
+      if ((name = (char*) malloc(sizeof(char*) + len + 1)) == 0)
+      {
+        close(fd);
+        err = ENOMEM;
+        break;
+      }
+      *(char**) name = names;
+      names = name;
+      memcpy(name + sizeof(char*), de->d_name, len + 1);
+      items[n++].path = name + sizeof(char*);
+    }
+    close(fd);
+  }
+  if (!err && errno)
+    err = errno;
+  closedir(d);
+
+  if (!err)
+  {
+    if ((fd = open(index_path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+      err = errno;
+    else
+    {
+      err = npio_index_write_(fd, items, n);
+      if (close(fd) && !err)
+        err = errno;
+    }
+  }
+
+  while ((name = names) != 0)
+  {
+    names = *(char**) name;
+    free(name);
+  }
+  free(items);
+  return err;
+}
+
+
+/*
+Map an index built by npio_index_build. You must call npio_index_close on the
+index afterwards, even if this fails.
+
+Return:
+  0 on success.
+  EINVAL   the file is not a valid index for this machine.
+  Other errno codes from open or mmap.
+*/
+static inline int npio_index_open(npio_Index* index, const char* path)
+{
+  const npio_IndexHeader_* hdr;
+  struct stat st;
+  void *p;
+  int fd, err = 0;
+
+  index->n = 0;
+  index->_buf = 0;
+  index->_buf_size = 0;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return errno;
+  if (fstat(fd, &st))
+    err = errno;
+  else if ((size_t) st.st_size < sizeof(npio_IndexHeader_))
+    err = EINVAL;
+  else if ((p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0))
+    == MAP_FAILED)
+    err = errno;
+  else
+  {
+    index->_buf = p;
+    index->_buf_size = st.st_size;
+  }
+  close(fd);
+  if (err)
+    return err;
+
+  /* Check the layout, so that lookups can trust the offsets. The paths end
+     with a null byte, so no path can run past the end. */
+  hdr = (const npio_IndexHeader_*) index->_buf;
+  if (memcmp(hdr->magic, NPIO_INDEX_MAGIC_, 8) != 0
+    || hdr->size != index->_buf_size
+    || hdr->n > (hdr->size - sizeof(*hdr)) / sizeof(npio_IndexEntry_)
+    || hdr->shapes != sizeof(*hdr) + hdr->n * sizeof(npio_IndexEntry_)
+    || hdr->paths < hdr->shapes || hdr->paths > hdr->size
+    || (hdr->paths - hdr->shapes) % sizeof(uint64_t)
+    || (hdr->n && (hdr->paths == hdr->size
+      || ((const char*) index->_buf)[hdr->size - 1] != 0)))
+    return EINVAL;
+
+  index->n = hdr->n;
+  return 0;
+}
+
+
+/*
+Get entry i of the index, in order of path, into info. Returns its path, or
+null if the entry is corrupt.
+*/
+static inline const char* npio_index_get(const npio_Index* index, size_t i
+  , npio_Info* info)
+{
+  const char* buf = (const char*) index->_buf;
+  const npio_IndexHeader_* hdr = (const npio_IndexHeader_*) buf;
+  const npio_IndexEntry_* e = (const npio_IndexEntry_*) (buf + sizeof(*hdr)) + i;
+  const uint64_t* shapes = (const uint64_t*) (buf + hdr->shapes);
+  uint64_t nshapes = (hdr->paths - hdr->shapes) / sizeof(uint64_t);
+  npio_Array array;
+  size_t j;
+
+  if (e->path >= hdr->size - hdr->paths || e->dim > NPIO_STAT_MAX_DIM
+    || e->shape > nshapes || e->dim > nshapes - e->shape
+    || memchr(e->dtype, 0, sizeof(e->dtype)) == 0
+    || npio_parse_dtype(e->dtype, &array))
+    return 0;
+
+  info->major_version = e->major_version;
+  info->minor_version = e->minor_version;
+  info->header_len = e->header_len;
+  memcpy(info->dtype, e->dtype, sizeof(info->dtype));
+  info->dim = e->dim;
+  info->size = 1;
+  for (j = 0; j < e->dim; ++j)
+    info->size *= (info->shape[j] = shapes[e->shape + j]);
+  info->fortran_order = e->fortran_order;
+  info->little_endian = array.little_endian;
+  info->floating_point = array.floating_point;
+  info->is_signed = array.is_signed;
+  info->bit_width = array.bit_width;
+  info->is_complex = array.is_complex;
+  info->is_bfloat16 = array.is_bfloat16;
+  info->data_offset = e->data_offset;
+  info->file_size = e->file_size;
+  return buf + hdr->paths + e->path;
+}
+
+
+/*
+Look up path in the index, as it was recorded, and fill in info.
+
+Return:
+  0 on success.
+  ENOENT   the path is not in the index.
+  EINVAL   the entry is corrupt.
+*/
+static inline int npio_index_find(const npio_Index* index, const char* path
+  , npio_Info* info)
+{
+  const char* buf = (const char*) index->_buf;
+  const npio_IndexHeader_* hdr = (const npio_IndexHeader_*) buf;
+  const npio_IndexEntry_* entries = (const npio_IndexEntry_*) (buf + sizeof(*hdr));
+  size_t lo = 0, hi = index->n, mid;
+  int c;
+
+  while (lo < hi)
+  {
+    mid = lo + (hi - lo) / 2;
+    if (entries[mid].path >= hdr->size - hdr->paths)
+      return EINVAL;
+    c = strcmp(path, buf + hdr->paths + entries[mid].path);
+    if (c == 0)
+      return npio_index_get(index, mid, info) ? 0 : EINVAL;
+    if (c < 0)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return ENOENT;
+}
+
+
+/* Unmap the index. */
+static inline void npio_index_close(npio_Index* index)
+{
+  if (index->_buf)
+    munmap(index->_buf, index->_buf_size);
+  index->_buf = 0;
+  index->_buf_size = 0;
+  index->n = 0;
+}
+
+
+/*
+
+Streaming reader.
+
+A reader hands out the data of an array in blocks of whole rows along axis 0,
+so arrays larger than memory can be processed from a pipe, socket or file with
+a fixed-size buffer. The header is parsed by npio_load_header_fd3 as usual. If
+the file was mapped, rows are copied out of the mapping, otherwise they are
+read from the descriptor as they are requested.
+
+Arrays in fortran order with more than one dimension cannot be read by rows
+and are rejected with ENOTSUP.
+
+*/
+typedef struct
+{
+  npio_Array array;   /* The header of the array being read. */
+  size_t rows;        /* The number of rows along axis 0. */
+  size_t row_size;    /* The size of each row in bytes. */
+  size_t row;         /* The number of rows handed out so far. */
+  int swap_bytes;     /* Whether to convert rows to host order (def: true). */
+
+  /* The following fields are private. */
+  size_t _offset;     /* Offset of the data in the mapped buffer */
+} npio_Reader;
+
+
+/* Finish opening a reader once the header has been loaded. */
+static inline int npio_reader_setup_(npio_Reader* reader)
+{
+  npio_Array* array = &reader->array;
+  size_t i, n;
+  int err;
+
+  if (array->fortran_order && array->dim > 1)
+    return ENOTSUP;
+
+  if ((err = npio_data_offset_(array, &reader->_offset)))
+    return err;
+  if (array->_buf
+    && reader->_offset + npio_array_memsize(array) != array->_buf_size)
+    return EINVAL;
+
+  /* A 0-d array is read as a single row. */
+  reader->rows = array->dim ? array->shape[0] : 1;
+  for (i = 1, n = 1; i < array->dim; ++i)
+    n *= array->shape[i];
+  reader->row_size = n * array->bit_width / 8;
+  reader->row = 0;
+  reader->swap_bytes = 1;
+  return 0;
+}
+
+
+/*
+Open a reader on a file descriptor. You must call npio_reader_close on the
+reader afterwards, even if this fails.
+
+Return:
+  0 on success, or any of the errors of npio_load_header_fd3.
+  ENOTSUP  the array is in fortran order and has more than one dimension.
+*/
+static inline int npio_reader_open_fd(npio_Reader* reader, int fd
+  , size_t max_dim)
+{
+  int err;
+  npio_init_array(&reader->array);
+  if ((err = npio_load_header_fd3(fd, &reader->array, max_dim)))
+    return err;
+  return npio_reader_setup_(reader);
+}
+
+
+/* Same as above, but opens the named file. */
+static inline int npio_reader_open(npio_Reader* reader, const char* filename
+  , size_t max_dim)
+{
+  int err;
+  npio_init_array(&reader->array);
+  if ((err = npio_load_header3(filename, &reader->array, max_dim)))
+    return err;
+  return npio_reader_setup_(reader);
+}
+
+
+/*
+Read up to max_rows of the remaining rows into buf, which must have room for
+max_rows * reader->row_size bytes. On return, rows_read holds the number of
+rows actually read, which is zero once all rows have been handed out. Rows are
+converted to host order unless reader->swap_bytes was cleared.
+
+Return:
+  0 on success.
+  EINVAL   the data is truncated.
+  Other errno codes from read.
+*/
+static inline int npio_reader_next(npio_Reader* reader, void* buf
+  , size_t max_rows, size_t* rows_read)
+{
+  static const int little_endian = (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+  npio_Array* array = &reader->array;
+  size_t n, sz, count;
+  int err, swap;
+
+  n = reader->rows - reader->row;
+  if (n > max_rows)
+    n = max_rows;
+  *rows_read = 0;
+  if (n == 0)
+    return 0;
+
+  sz = n * reader->row_size;
+  count = sz * 8 / array->bit_width;
+  swap = reader->swap_bytes && array->little_endian != little_endian;
+
+  if (array->_buf)
+  {
+    /* Swap on the way out of the mapping, so it is never written to. */
+    const char* src = (const char*) array->_buf + reader->_offset
+      + reader->row * reader->row_size;
+    if (swap)
+      npio_swap_elements_(array, count, src, buf);
+    else
+      memcpy(buf, src, sz);
+  }
+  else
+  {
+    if ((err = npio_read_full_(array->_fd, buf, sz)))
+      return err;
+    if (swap)
+      npio_swap_elements_(array, count, buf, buf);
+  }
+
+  reader->row += n;
+  *rows_read = n;
+  return 0;
+}
+
+
+/* Release all resources associated with the reader. */
+static inline void npio_reader_close(npio_Reader* reader)
+{
+  npio_free_array(&reader->array);
+}
+
+
+/* The header is padded so that the data starts at a multiple of this many
+   bytes from the start of the file, which must be a multiple of 16 as the
+   format requires. Mapped data is then aligned to it as well. */
+#ifndef NPIO_HEADER_ALIGNMENT
+  #define NPIO_HEADER_ALIGNMENT 64
+#endif
+#if NPIO_HEADER_ALIGNMENT % 16
+  #error NPIO_HEADER_ALIGNMENT must be a multiple of 16
+#endif
+
+
+/* A buffer size that is always sufficient for the header we write for an
+   array of the given dimension: the prelude and the dict without the shape
+   take less than 80 bytes, each entry of the shape at most 22, and the
+   padding less than NPIO_HEADER_ALIGNMENT. */
+#define NPIO_HDR_SIZE_(dim) (80 + NPIO_HEADER_ALIGNMENT + (dim) * 24)
+
+
+/* Same as above, for the header of array, including its fields. A field takes
+   less than 64 bytes besides its name and shape, and so does the padding
+   before it or at the end of a record. */
+static inline size_t npio_hdr_size_(const npio_Array* array)
+{
+  size_t i, size = NPIO_HDR_SIZE_(array->dim) + 64;
+  for (i = 0; i < array->nfields; ++i)
+    size += 128 + strlen(array->fields[i].name)
+      + array->fields[i].dim * 24;
+  return size;
+}
+
+
+/* Write the record descriptor of a structured array at p, which has room
+   for the npio_hdr_size_ of the array, with padding for any gaps between the
+   fields. Returns zero or an errno code, and sets *end past the ']'. */
+static inline int npio_save_record_(char* p, const npio_Array* array
+  , char** end)
+{
+  size_t i, j, offset = 0, size = array->bit_width / 8;
+  const npio_Field* f;
+
+  *p++ = '[';
+  for (i = 0; i < array->nfields; ++i)
+  {
+    f = &array->fields[i];
+    if (f->offset < offset || strchr(f->name, '\'') || strchr(f->name, '\\')
+      || f->dim > NPIO_FIELD_MAX_DIM)
+      return EINVAL;
+    if (f->is_bfloat16)
+      return ENOTSUP;
+    if (f->offset > offset)
+      p += sprintf(p, "('', '|V%lu'), ", (unsigned long) (f->offset - offset));
+
+    p += sprintf(p, "('%s', '%c%c%d'", f->name
+      , array->little_endian ? '<' : '>'
+      , f->is_complex ? 'c' : f->floating_point ? 'f' : f->is_signed ? 'i' : 'u'
+      , f->bit_width / 8);
+    if (f->dim)
+    {
+      p += sprintf(p, ", (");
+      for (j = 0; j < f->dim; ++j)
+        p += sprintf(p, "%lu, ", (unsigned long) f->shape[j]);
+      p += sprintf(p, ")");
+    }
+    p += sprintf(p, "), ");
+    offset = f->offset + f->count * (f->bit_width / 8);
+  }
+  if (offset > size)
+    return EINVAL;
+  if (offset < size)
+    p += sprintf(p, "('', '|V%lu'), ", (unsigned long) (size - offset));
+  *p++ = ']';
+  *end = p;
+  return 0;
+}
+
+
+/* Prepare a numpy header in the designated memory buffer. On success, zero is
+returned and out is set to 1 beyond the last written byte of the header. The
+header is padded with spaces to at least min_size bytes, which lets a header
+be rewritten later with a longer shape without moving the data.
+
+The header is written in the format version given by array->major_version,
+which may be 1, 2 or 3, or 0 for a structure filled in without
+npio_init_array, which is taken as 1. As numpy does, version 1 is upgraded to
+version 2 when the header is too long for its 16-bit length field. Since our
+headers are plain ASCII, versions 2 and 3 only differ in the version number. */
+static inline int npio_save_header_mem5(void* p, size_t sz
+  , const npio_Array* array, void **out, size_t min_size)
+{
+  size_t i, prelude, body_len, total;
+  int err;
+  char* hdr_buf = (char*) p;
+  char* hdr_end = hdr_buf + sz;
+  char* hdr;
+  int version = array->major_version ? array->major_version : 1;
+
+  if (version < 1 || version > 3)
+    return ENOTSUP;
+
+  /* This is the absolute minimum space for the header the way we write it. */
+  if (sz < 80)
+    return ERANGE;
+
+  /* Write the dict after room for the longer prelude of version 2, and move
+     it down later if it turns out to fit in version 1. */
+  hdr = hdr_buf + 12;
+  /* numpy itself cannot describe bfloat16 in a portable way */
+  if (array->is_bfloat16)
+    return ENOTSUP;
+
+  if (array->nfields)
+  {
+    /* Records may need more room than the shape alone */
+    if (sz < npio_hdr_size_(array))
+      return ERANGE;
+    hdr += sprintf(hdr, "{\"descr\": ");
+    if ((err = npio_save_record_(hdr, array, &hdr)))
+      return err;
+    hdr += sprintf(hdr, ", ");
+  }
+  else
+    hdr += sprintf(hdr, "{\"descr\": \"%c%c%d\", "
+      , array->little_endian ? '<' : '>'
+      , array->is_complex ? 'c'
+        : array->floating_point ? 'f' : array->is_signed ? 'i' : 'u'
+      , array->bit_width / 8);
+  /* There is no way hdr can overflow at this point! */
+
+  hdr += sprintf(hdr, "\"fortran_order\": %s, "
+    , array->fortran_order ? "True" : "False");
+  /* Again, no need to check for overflow here. */
+
+  hdr += sprintf(hdr, "\"shape\": (");
+  for (i = 0; i < array->dim; ++i)
+  {
+    hdr += snprintf(hdr, hdr_end - hdr, "%lu, "
+      , (unsigned long) array->shape[i]);
+    if (hdr >= hdr_end - 3)
+      return ERANGE;
+  }
+  hdr += sprintf(hdr, ")} ");  /* hence the -3 above. */
+  body_len = hdr - (hdr_buf + 12);
+
+  /* Pad the whole header to the alignment, and to min_size. The trailing
+     space written above guarantees room for the terminating \n. */
+  while (1)
+  {
+    prelude = version == 1 ? 10 : 12;
+    total = prelude + body_len;
+    if (total < min_size)
+      total = min_size;
+    total = (total + NPIO_HEADER_ALIGNMENT - 1)
+      & ~(size_t) (NPIO_HEADER_ALIGNMENT - 1);
+    if (version != 1 || total - prelude <= 0xffff)
+      break;
+    version = 2;
+  }
+  if (total > sz || total - prelude > 0xffffffff)
+    return ERANGE;
+
+  if (prelude == 10)
+    memmove(hdr_buf + 10, hdr_buf + 12, body_len);
+  memset(hdr_buf + prelude + body_len, ' ', total - prelude - body_len);
+
+  /* terminate with a \n.  The npy specification is vague on this. One
+  interpretation is that the \n can occur first and then be followed by
+  spaces, but that causes "IndentationError: unexpected indent" from the
+  python loader. */
+  hdr_buf[total - 1] = '\n';
+
+  /* Fill in the prelude, with the little-endian header_len */
+  memcpy(hdr_buf, "\x93NUMPY", 6);
+  hdr_buf[6] = version;
+  hdr_buf[7] = 0;
+  for (i = 0; i < prelude - 8; ++i)
+    hdr_buf[8 + i] = ((total - prelude) >> (8 * i)) & 0xff;
+
+  *out = hdr_buf + total;
+  return 0;
+}
+
+
+/* Same as above, without any extra padding. */
+static inline int npio_save_header_mem(void* p, size_t sz
+  , const npio_Array* array, void **out)
+{
+  return npio_save_header_mem5(p, sz, array, out, 0);
+}
+
+
+/* Whether the data of the array is exactly the contents of a file that we
+   still hold a descriptor for. Only a shared read-only mapping guarantees
+   that the data has not been modified, and only NPIO_KEEP_FD guarantees that
+   the descriptor still refers to the same file. */
+static inline int npio_is_file_backed_(const npio_Array* array)
+{
+  const int flags = NPIO_MAP_SHARED | NPIO_KEEP_FD;
+  return array->_mmapped && !array->_malloced && array->_fd >= 0
+    && (array->_flags & flags) == flags;
+}
+
+
+#ifdef __linux__
+/* Copy n bytes starting at offset of in_fd to out_fd with sendfile, which
+   works for any kind of output on Linux 2.6.33 and later. If sendfile is not
+   usable for this pair of descriptors, the remainder is written from the
+   mapped copy at p instead. */
+static inline int npio_sendfile_full_(int out_fd, int in_fd, off_t offset
+  , size_t n, const char* p)
+{
+  ssize_t nw;
+  size_t done = 0;
+  while (done < n)
+  {
+    nw = sendfile(out_fd, in_fd, &offset
+      , n - done < NPIO_IO_CHUNK_SIZE ? n - done : NPIO_IO_CHUNK_SIZE);
+    if (nw < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno == EINVAL || errno == ENOSYS)
+        return npio_write_full_(out_fd, p + done, n - done);
+      return errno;
+    }
+    if (nw == 0)
+      return EINVAL;  /* The file was truncated under us. */
+    done += nw;
+  }
+  return 0;
+}
+#endif
+
+
+/*
+Save a numpy file.
+
+Arguments:
+  fd: file descriptor of file to be saved to.
+  array: array to be saved.
+
+Return:
+  0 on success.
+  ERANGE: the array has too many dimensions.
+  Other IO error from the OS.
+*/
+static inline int npio_save_fd(int fd, const npio_Array* array)
+{
+  /* Most headers fit in a small buffer on the stack. */
+  char small_buf[256];
+  char *hdr_buf = small_buf;
+  size_t hdr_size = npio_hdr_size_(array);
+  struct iovec iov[2];
+  void *end;
+  int err;
+
+  if (hdr_size > sizeof(small_buf))
+  {
+    if ((hdr_buf = (char*) malloc(hdr_size)) == 0)
+      return ENOMEM;
+  }
+
+  if ((err = npio_save_header_mem(hdr_buf, hdr_size, array, &end)))
+    goto done;
+
+  iov[0].iov_base = hdr_buf;
+  iov[0].iov_len = (char*) end - hdr_buf;
+  iov[1].iov_base = array->data;
+  iov[1].iov_len = npio_array_memsize(array);
+
+#ifdef __linux__
+  /* If the data is an unmodified read-only mapping of a file we still have
+     the descriptor for, let the kernel copy it from the page cache. */
+  if (npio_is_file_backed_(array))
+  {
+    if (!(err = npio_writev_full_(fd, iov, 1)))
+      err = npio_sendfile_full_(fd, array->_fd
+        , (char*) array->data - (char*) array->_buf, iov[1].iov_len
+        , (const char*) array->data);
+    goto done;
+  }
+#endif
+
+  /* Header and data in a single call. */
+  err = npio_writev_full_(fd, iov, 2);
+
+done:
+  if (hdr_buf != small_buf)
+    free(hdr_buf);
+  return err;
+}
+
+
+/* Flags for npio_save4 and npio_save_fd4. */
+#define NPIO_SAVE_DIRECT 0x100  /* Write the data with O_DIRECT if possible */
+
+
+/* Set the size of the file, returning an error code. Without ftruncate, files
+   can only be extended, by writing their last byte, and shrinking a file
+   fails with ENOTSUP. */
+static inline int npio_ftruncate_(int fd, off_t size)
+{
+#ifdef NPIO_HAVE_FTRUNCATE_
+  return ftruncate(fd, size) ? errno : 0;
+#else
+  struct stat st;
+
+  if (fstat(fd, &st))
+    return errno;
+  if (st.st_size > size)
+    return ENOTSUP;
+  return st.st_size < size ? npio_pwrite_full_(fd, "", 1, size - 1) : 0;
+#endif
+}
+
+
+/* Extend the file to size bytes up front, so that threads writing disjoint
+   ranges of it never race to extend it, and its blocks are allocated in one
+   go where the file system supports it. The file is never shrunk. A file that
+   is only extended is sparse, and writing to a mapping of it fails with SIGBUS
+   rather than ENOSPC once the disk fills up, so blocks are reserved with
+   posix_fallocate where fallocate is not available. */
+static inline int npio_preallocate_(int fd, off_t size)
+{
+  struct stat st;
+
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+  if (fallocate(fd, 0, 0, size) == 0)
+    return 0;
+  if (errno != EOPNOTSUPP && errno != ENOSYS)
+    return errno;
+#elif defined(POSIX_FADV_NORMAL)
+  /* Declared alongside posix_fadvise. This returns the error. */
+  int err = posix_fallocate(fd, 0, size);
+  if (err == 0)
+    return 0;
+  if (err != EINVAL && err != EOPNOTSUPP && err != ENOSYS)
+    return err;
+#endif
+  if (fstat(fd, &st))
+    return errno;
+  return st.st_size < size ? npio_ftruncate_(fd, size) : 0;
+}
+
+
+/*
+Save an array to a seekable file descriptor with nthreads threads, including
+the calling thread. The header is written first and the file is extended to
+its final size, after which the threads write disjoint ranges of the data
+with pwrite. On return, the descriptor is positioned after the data as with
+npio_save_fd, which is used instead if the data is smaller than twice
+NPIO_PARALLEL_RANGE or the descriptor is not seekable.
+
+With NPIO_SAVE_DIRECT in flags, the header is padded to a whole
+NPIO_DIRECT_ALIGNMENT block and the data is written with O_DIRECT, bypassing
+the page cache. This needs the data to be aligned to NPIO_DIRECT_ALIGNMENT
+and the descriptor to be positioned at a multiple of it; otherwise, or if
+the file system refuses O_DIRECT, the data is written normally. The last
+partial block is always written normally. O_DIRECT is only available where
+the system headers define it, e.g. with _GNU_SOURCE on Linux.
+
+Return:
+  0 on success.
+  ERANGE: the array has too many dimensions.
+  Other IO error from the OS.
+*/
+static inline int npio_save_fd4(int fd, const npio_Array* array
+  , size_t nthreads, int flags)
+{
+  char small_buf[256];
+  char *hdr_buf = small_buf, *data = (char*) array->data;
+  size_t hdr_size = npio_hdr_size_(array), min_size = 0, hdr_len;
+  size_t sz = npio_array_memsize(array), direct_sz = 0;
+  off_t start = lseek(fd, 0, SEEK_CUR);
+  void *end;
+  int err;
+
+  if (nthreads <= 1 || sz < 2 * NPIO_PARALLEL_RANGE || start < 0
+    || !NPIO_PARALLEL_PREAD_)
+    return npio_save_fd(fd, array);
+
+#ifdef O_DIRECT
+  if ((flags & NPIO_SAVE_DIRECT) && start % NPIO_DIRECT_ALIGNMENT == 0
+    && (uintptr_t) data % NPIO_DIRECT_ALIGNMENT == 0)
+  {
+    min_size = NPIO_DIRECT_ALIGNMENT;
+    if (hdr_size < min_size)
+      hdr_size = min_size;
+  }
+#else
+  (void) flags;
+#endif
+
+  if (hdr_size > sizeof(small_buf))
+  {
+    if ((hdr_buf = (char*) malloc(hdr_size)) == 0)
+      return ENOMEM;
+  }
+
+  if ((err = npio_save_header_mem5(hdr_buf, hdr_size, array, &end, min_size)))
+    goto done;
+  hdr_len = (char*) end - hdr_buf;
+
+  if ((err = npio_preallocate_(fd, start + hdr_len + sz)))
+    goto done;
+  if ((err = npio_pwrite_full_(fd, hdr_buf, hdr_len, start)))
+    goto done;
+
+#ifdef O_DIRECT
+  /* Direct IO needs the memory, the file offset and the length of every
+     write to be aligned. */
+  if (min_size && hdr_len % NPIO_DIRECT_ALIGNMENT == 0)
+  {
+    int fl = fcntl(fd, F_GETFL);
+    if (fl >= 0 && fcntl(fd, F_SETFL, fl | O_DIRECT) == 0)
+    {
+      direct_sz = sz & ~(size_t) (NPIO_DIRECT_ALIGNMENT - 1);
+      err = npio_parallel_io_(fd, data, direct_sz, start + hdr_len, nthreads
+        , 0, 1);
+      fcntl(fd, F_SETFL, fl);
+
+      /* Refused by the file system after all, so start over normally. */
+      if (err == EINVAL)
+      {
+        direct_sz = 0;
+        err = 0;
+      }
+      if (err)
+        goto done;
+    }
+  }
+#endif
+
+  if ((err = npio_parallel_io_(fd, data + direct_sz, sz - direct_sz
+    , start + hdr_len + direct_sz, nthreads, 0, 1)))
+    goto done;
+
+  if (lseek(fd, start + hdr_len + sz, SEEK_SET) < 0)
+    err = errno;
+
+done:
+  if (hdr_buf != small_buf)
+    free(hdr_buf);
+  return err;
+}
+
+
+/*
+Save a numpy file.
+
+Arguments:
+  filename: name of the file to be saved to.
+  array: the array to be saved.
+
+Return:
+  0 on success, error code otherwise.
+*/
+static inline int npio_save(const char* filename, const npio_Array* array)
+{
+  int fd, err;
+  fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    return errno;
+  err = npio_save_fd(fd, array);
+  close(fd);
+  return err;
+}
+
+
+/* Same as above, but saves with nthreads threads as npio_save_fd4. */
+static inline int npio_save4(const char* filename, const npio_Array* array
+  , size_t nthreads, int flags)
+{
+  int fd, err;
+  fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    return errno;
+  err = npio_save_fd4(fd, array, nthreads, flags);
+  if (close(fd) && !err)
+    err = errno;
+  return err;
+}
+
+
+/*
+
+Mapped output.
+
+npio_create_mapped writes the header of a new file, sizes the file for its
+data and maps it shared and writable. The caller then fills array->data in
+place, from as many threads as it likes, instead of filling a buffer of its
+own that npio_save_fd copies into the file. npio_free_array unmaps the file;
+call npio_sync_mapped first if the data must be on disk by then.
+
+*/
+
+/*
+Create a numpy file on a descriptor opened for reading and writing, and map
+its data.
+
+Arguments:
+  fd: the descriptor, positioned anywhere. The file is truncated and written
+    from offset 0. The descriptor is not needed after the call.
+  desc: describes the array as for npio_save: the type, the byte order, the
+    shape and the order. Its data is ignored.
+  array: an array initialized with npio_init_array. On success it is set up
+    as if loaded from the new file, with data pointing into the mapping. You
+    must call npio_free_array on it, even on failure.
+
+Return:
+  0 on success.
+  ERANGE  the size of the data does not fit in memory.
+  ENOTSUP the file is not empty, and ftruncate is not available to empty it.
+  Other error codes from the header writer, ftruncate or mmap.
+*/
+static inline int npio_create_mapped_fd(int fd, const npio_Array* desc
+  , npio_Array* array)
+{
+  char small_buf[256];
+  char *hdr_buf = small_buf;
+  size_t hdr_size = npio_hdr_size_(desc);
+  size_t i, n = 1, w = desc->bit_width / 8, total;
+  void *end, *p;
+  int err;
+
+  /* The number of elements, guarding against overflow. */
+  for (i = 0; i < desc->dim; ++i)
+  {
+    if (desc->shape[i] && n > SIZE_MAX / desc->shape[i])
+      return ERANGE;
+    n *= desc->shape[i];
+  }
+
+  if (hdr_size > sizeof(small_buf))
+  {
+    if ((hdr_buf = (char*) malloc(hdr_size)) == 0)
+      return ENOMEM;
+  }
+  if ((err = npio_save_header_mem(hdr_buf, hdr_size, desc, &end)))
+    goto done;
+  hdr_size = (char*) end - hdr_buf;
+  if (w && n > (((size_t) -1 >> 1) - hdr_size) / w)
+  {
+    err = ERANGE;
+    goto done;
+  }
+  total = hdr_size + n * w;
+
+  /* Reserve the blocks, so that filling the mapping cannot fail. */
+  if ((err = npio_ftruncate_(fd, 0)))
+    goto done;
+  if ((err = npio_preallocate_(fd, total)))
+    goto done;
+  p = mmap(0, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+  {
+    err = errno;
+    goto done;
+  }
+  memcpy(p, hdr_buf, hdr_size);
+
+  /* Parse back what we wrote, to set up the array as any loaded one. */
+  array->_mmapped = 1;
+  array->_buf = p;
+  array->_buf_size = total;
+  array->_flags = NPIO_MAP_SHARED;
+  NPIO_STATS_(array->stats.path |= NPIO_PATH_MMAP;)
+  NPIO_STATS_(array->stats.bytes_mapped += total;)
+  if (!(err = npio_load_header_mem4(p, total, array, desc->dim)))
+    err = npio_load_data2(array, 0);
+
+done:
+  if (hdr_buf != small_buf)
+    free(hdr_buf);
+  return err;
+}
+
+
+/* Same as above, but creates or truncates the named file. */
+static inline int npio_create_mapped(const char* filename
+  , const npio_Array* desc, npio_Array* array)
+{
+  int fd, err;
+  fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    return errno;
+  err = npio_create_mapped_fd(fd, desc, array);
+  if (close(fd) && !err)
+    err = errno;
+  return err;
+}
+
+
+/* Write the data of an array from npio_create_mapped back to the file, and
+   wait for it to complete. Returns EINVAL if the array is not mapped. */
+static inline int npio_sync_mapped(const npio_Array* array)
+{
+  if (!array->_mmapped)
+    return EINVAL;
+  return msync(array->_buf, array->_buf_size, MS_SYNC) ? errno : 0;
+}
+
+
+/*
+
+Serialization for non-blocking transports.
+
+These let an event loop send and receive arrays without copying the data
+through an intermediate buffer, and without ever blocking. On the sending
+side, npio_serialize_iov describes the serialized array as a header, written
+into a small buffer, followed by the data where it already lives, ready for
+writev or sendmsg. On the receiving side, an npio_Parser says where the next
+bytes should go and exactly how many it needs, so that reads never go past the
+end of one array into the next, and the data is received straight into its
+final buffer.
+
+*/
+
+/* An upper bound for the size of the header of array, for the buffer given
+   to npio_serialize_iov. */
+static inline size_t npio_header_bound(const npio_Array* array)
+{
+  return npio_hdr_size_(array);
+}
+
+
+/*
+Describe the serialized form of an array, the contents of an npy file, as an
+iovec for its header and one for its data, without copying the data.
+
+Arguments:
+  array: the array, with type, shape and data set as for npio_save.
+  buf: where to write the header, which must outlive the iovecs.
+  buf_size: the size of buf. npio_header_bound always suffices.
+  iov: two iovecs to fill.
+  iovcnt: set to the number of iovecs used, 1 if there is no data.
+
+Return:
+  0 on success, ERANGE if buf is too small, or errors from the header writer.
+*/
+static inline int npio_serialize_iov(const npio_Array* array, void* buf
+  , size_t buf_size, struct iovec* iov, int* iovcnt)
+{
+  void *end;
+  int err;
+
+  if ((err = npio_save_header_mem(buf, buf_size, array, &end)))
+    return err;
+
+  iov[0].iov_base = buf;
+  iov[0].iov_len = (char*) end - (char*) buf;
+  iov[1].iov_base = array->data;
+  iov[1].iov_len = npio_array_memsize(array);
+  *iovcnt = iov[1].iov_len ? 2 : 1;
+  return 0;
+}
+
+
+/* Compute the exact number of bytes that the array serializes to. */
+static inline int npio_serialized_size(const npio_Array* array, size_t* size)
+{
+  char small_buf[256];
+  char *buf = small_buf;
+  size_t buf_size = npio_header_bound(array);
+  struct iovec iov[2];
+  int err, iovcnt;
+
+  if (buf_size > sizeof(small_buf))
+  {
+    if ((buf = (char*) malloc(buf_size)) == 0)
+      return ENOMEM;
+  }
+  else
+    buf_size = sizeof(small_buf);
+
+  if (!(err = npio_serialize_iov(array, buf, buf_size, iov, &iovcnt)))
+    *size = iov[0].iov_len + iov[1].iov_len;
+
+  if (buf != small_buf)
+    free(buf);
+  return err;
+}
+
+
+/* A resumable parser for arrays received in pieces. */
+typedef struct
+{
+  npio_Array array;  /* The array, complete once the parser returns 0 */
+
+  /* The following fields are private. */
+  int    _state;     /* Which part we are receiving, see below */
+  size_t _pos;       /* How much of that part we have */
+  size_t _max_dim;
+  char   _prelude[12];
+} npio_Parser;
+
+#define NPIO_PARSER_PRELUDE_ 0
+#define NPIO_PARSER_HEADER_  1
+#define NPIO_PARSER_DATA_    2
+#define NPIO_PARSER_DONE_    3
+
+
+/* Prepare a parser for an array of up to max_dim dimensions, whose buffers
+   come from alloc, or from malloc if it is null. */
+static inline void npio_parser_init3(npio_Parser* parser, size_t max_dim
+  , const npio_Allocator* alloc)
+{
+  npio_init_array2(&parser->array, alloc);
+  parser->_state = NPIO_PARSER_PRELUDE_;
+  parser->_pos = 0;
+  parser->_max_dim = max_dim;
+}
+
+
+/* Same as above, with malloc and a default max_dim. */
+static inline void npio_parser_init(npio_Parser* parser)
+{
+  npio_parser_init3(parser, NPIO_DEFAULT_MAX_DIM, 0);
+}
+
+
+/*
+Get the buffer that the next bytes of the stream go into, and how many bytes
+are still needed there. Receive up to *n bytes into *p, then report how many
+arrived with npio_parser_advance. *n is 0 once the array is complete.
+
+The prelude and the header go into buffers of the parser, and the data, once
+its size is known, straight into array.data.
+*/
+static inline void npio_parser_buffer(npio_Parser* parser, void** p
+  , size_t* n)
+{
+  npio_Array* array = &parser->array;
+
+  switch (parser->_state)
+  {
+    case NPIO_PARSER_PRELUDE_:
+      *p = parser->_prelude + parser->_pos;
+      *n = sizeof(parser->_prelude) - parser->_pos;
+      break;
+
+    case NPIO_PARSER_HEADER_:
+      *p = array->_hdr_buf + parser->_pos;
+      *n = array->_hdr_buf_size - parser->_pos;
+      break;
+
+    case NPIO_PARSER_DATA_:
+      *p = (char*) array->data + parser->_pos;
+      *n = array->_data_size - parser->_pos;
+      break;
+
+    default:
+      *p = 0;
+      *n = 0;
+  }
+}
+
+
+/* Allocate the data once the header is parsed. Completes the array if it has
+   no data. */
+static inline int npio_parser_start_data_(npio_Parser* parser)
+{
+  npio_Array* array = &parser->array;
+  size_t sz = npio_array_memsize(array);
+  int err;
+
+  parser->_pos = 0;
+  if (sz == 0)
+  {
+    parser->_state = NPIO_PARSER_DONE_;
+    return 0;
+  }
+  if ((err = npio_alloc_data_(array, sz)))
+    return err;
+  parser->_state = NPIO_PARSER_DATA_;
+  return EAGAIN;
+}
+
+
+/*
+Account for n bytes received into the buffer from npio_parser_buffer.
+
+Return:
+  0        the array is complete, and its data in host byte order.
+  EAGAIN   more bytes are needed.
+  EINVAL   n is more than npio_parser_buffer asked for.
+  Other error codes as for npio_load_header if the header is invalid. The
+  parser must then be freed.
+*/
+static inline int npio_parser_advance(npio_Parser* parser, size_t n)
+{
+  static const int little_endian = (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+  npio_Array* array = &parser->array;
+  void *buf;
+  char *end;
+  size_t prelude_size, want, offset;
+  int err;
+
+  /* More than was asked for would run past the buffer. */
+  npio_parser_buffer(parser, &buf, &want);
+  if (n > want)
+    return EINVAL;
+
+  parser->_pos += n;
+  switch (parser->_state)
+  {
+    case NPIO_PARSER_PRELUDE_:
+      if (parser->_pos < sizeof(parser->_prelude))
+        return EAGAIN;
+      if ((err = npio_load_header_prelude_(parser->_prelude, array, &end)))
+        return err;
+
+      /* As in npio_load_header_stream_, the header is padded to a multiple
+         of 16 bytes, so it extends beyond the prelude. */
+      prelude_size = end - parser->_prelude;
+      if ((err = npio_check_prelude_len_(array, parser->_max_dim)))
+        return err;
+      if (prelude_size + array->header_len < sizeof(parser->_prelude))
+        return EINVAL;
+
+      /* The loaders reject data that is not aligned, and so do we. */
+      if ((err = npio_data_offset_(array, &offset)))
+        return err;
+
+      array->_hdr_buf_size = prelude_size + array->header_len;
+      if ((array->_hdr_buf = (char*) npio_alloc_(array
+        , array->_hdr_buf_size, 1)) == 0)
+        return ENOMEM;
+      memcpy(array->_hdr_buf, parser->_prelude, sizeof(parser->_prelude));
+      parser->_state = NPIO_PARSER_HEADER_;
+      parser->_pos = sizeof(parser->_prelude);
+      return EAGAIN;
+
+    case NPIO_PARSER_HEADER_:
+      if (parser->_pos < array->_hdr_buf_size)
+        return EAGAIN;
+      prelude_size = array->_hdr_buf_size - array->header_len;
+      if ((err = npio_check_header_len_(array, array->_hdr_buf + prelude_size
+        , array->_hdr_buf + array->_hdr_buf_size, parser->_max_dim)))
+        return err;
+      if ((err = npio_ph_parse_dict_(array, array->_hdr_buf + prelude_size
+        , array->_hdr_buf + array->_hdr_buf_size, parser->_max_dim)))
+        return err;
+      return npio_parser_start_data_(parser);
+
+    case NPIO_PARSER_DATA_:
+      if (parser->_pos < array->_data_size)
+        return EAGAIN;
+      parser->_state = NPIO_PARSER_DONE_;
+      if (array->little_endian != little_endian)
+      {
+        array->little_endian = little_endian;
+        return npio_swap_elements_(array, array->size, array->data
+          , array->data);
+      }
+      return 0;
+
+    case NPIO_PARSER_DONE_:
+      return 0;
+
+    default:
+      return EINVAL;
+  }
+}
+
+
+/*
+Same as above, but copies the bytes from p, for data that has already been
+received into some other buffer. *consumed is set to the number of bytes used,
+which is less than n if the array ends before the end of p. The rest belongs
+to whatever comes next in the stream.
+*/
+static inline int npio_parser_feed(npio_Parser* parser, const void* p
+  , size_t n, size_t* consumed)
+{
+  const char* q = (const char*) p;
+  void* dst;
+  size_t want;
+  int err = EAGAIN;
+
+  *consumed = 0;
+  while (n)
+  {
+    npio_parser_buffer(parser, &dst, &want);
+    if (want == 0)
+      break;
+    if (want > n)
+      want = n;
+    memcpy(dst, q, want);
+    q += want;
+    n -= want;
+    *consumed += want;
+    if ((err = npio_parser_advance(parser, want)) != EAGAIN)
+      return err;
+  }
+  return parser->_state == NPIO_PARSER_DONE_ ? 0 : err;
+}
+
+
+/* Release the array of the parser, unless it was moved out with
+   npio_move_array. */
+static inline void npio_parser_free(npio_Parser* parser)
+{
+  npio_free_array(&parser->array);
+}
+
+
+/*
+
+Streaming writer.
+
+A writer saves an array whose length along axis 0 is not known up front. Rows
+are appended in batches of any size, and closing the writer rewrites the
+header with the final number of rows. The header written at open time is
+padded so that it is large enough for any row count, which means the rewrite
+never moves the data. The descriptor must be seekable.
+
+*/
+typedef struct
+{
+  npio_Array array;   /* Describes the array. shape[0] is the rows so far. */
+  size_t row_size;    /* The size of each row in bytes. */
+
+  /* The following fields are private. */
+  int    _fd;         /* The descriptor being written to */
+  int    _opened;     /* Whether we opened the descriptor */
+  off_t  _start;      /* The offset of the header in the file */
+  size_t _hdr_size;   /* The size of the header, fixed at open */
+  char*  _hdr_buf;    /* Space to format the header in */
+} npio_Writer;
+
+
+/* Copy the element type of from, including its fields if it has records. */
+static inline void npio_copy_type_(npio_Array* to, const npio_Array* from)
+{
+  to->nfields = from->nfields;
+  to->fields = from->fields;
+  to->little_endian = from->little_endian;
+  to->floating_point = from->floating_point;
+  to->is_signed = from->is_signed;
+  to->is_complex = from->is_complex;
+  to->is_bfloat16 = from->is_bfloat16;
+  to->bit_width = from->bit_width;
+}
+
+
+/*
+Open a writer on a seekable file descriptor that is open for writing. desc
+describes a single row: its dim and shape give the trailing dimensions of the
+array, and its type fields give the element type. desc->dim may be zero for a
+one-dimensional array. The header is written at the current file offset.
+You must call npio_writer_close on the writer, even if this fails.
+
+Return:
+  0 on success.
+  ENOMEM   allocation failed.
+  EINVAL   desc is in fortran order, which cannot be appended to by rows.
+  ENOTSUP  desc is bfloat16, which numpy cannot describe.
+  The fields of a structured desc must outlive the writer.
+  Other errno codes, in particular ESPIPE if fd is not seekable.
+*/
+static inline int npio_writer_open_fd(npio_Writer* writer, int fd
+  , const npio_Array* desc)
+{
+  npio_Array* array = &writer->array;
+  size_t i;
+  void *end;
+  int err;
+
+  npio_init_array(array);
+  writer->row_size = 0;
+  writer->_fd = fd;
+  writer->_opened = 0;
+  writer->_hdr_buf = 0;
+
+  if (desc->fortran_order && desc->dim > 0)
+    return EINVAL;
+  if (desc->is_bfloat16)
+    return ENOTSUP;
+  if ((writer->_start = lseek(fd, 0, SEEK_CUR)) < 0)
+    return errno;
+
+  array->major_version = desc->major_version;
+  npio_copy_type_(array, desc);
+  array->dim = desc->dim + 1;
+  if ((array->shape = (size_t*) malloc(sizeof(size_t) * array->dim)) == 0)
+    return ENOMEM;
+  writer->row_size = array->bit_width / 8;
+  for (i = 0; i < desc->dim; ++i)
+  {
+    array->shape[i + 1] = desc->shape[i];
+    writer->row_size *= desc->shape[i];
+  }
+
+  if ((writer->_hdr_buf = (char*) malloc(
+    npio_hdr_size_(array))) == 0)
+    return ENOMEM;
+
+  /* Size the header for the longest possible row count, then write it with
+     zero rows, padded to that size. */
+  array->shape[0] = (size_t) -1;
+  if ((err = npio_save_header_mem(writer->_hdr_buf
+    , npio_hdr_size_(array), array, &end)))
+    return err;
+  writer->_hdr_size = (char*) end - writer->_hdr_buf;
+
+  array->shape[0] = 0;
+  if ((err = npio_save_header_mem5(writer->_hdr_buf
+    , npio_hdr_size_(array), array, &end, writer->_hdr_size)))
+    return err;
+  return npio_write_full_(fd, writer->_hdr_buf, writer->_hdr_size);
+}
+
+
+/* Same as above, but creates or truncates the named file. */
+static inline int npio_writer_open(npio_Writer* writer, const char* filename
+  , const npio_Array* desc)
+{
+  int fd, err;
+  fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+  {
+    /* leave the writer in a state that npio_writer_close accepts */
+    npio_init_array(&writer->array);
+    writer->_fd = -1;
+    writer->_opened = 0;
+    writer->_hdr_buf = 0;
+    return errno;
+  }
+  err = npio_writer_open_fd(writer, fd, desc);
+  writer->_opened = 1;
+  return err;
+}
+
+
+/* Append rows to the array. data holds rows * writer->row_size bytes in the
+   byte order given at open time. */
+static inline int npio_writer_append(npio_Writer* writer, const void* data
+  , size_t rows)
+{
+  int err;
+  if ((err = npio_write_full_(writer->_fd, data, rows * writer->row_size)))
+    return err;
+  writer->array.shape[0] += rows;
+  return 0;
+}
+
+
+/*
+Rewrite the header with the final number of rows and release all resources
+associated with the writer. The descriptor is closed if the writer opened it.
+It is safe to call this more than once.
+
+Return:
+  0 on success, otherwise an errno code from updating the header.
+*/
+static inline int npio_writer_close(npio_Writer* writer)
+{
+  int err = 0;
+  void *end;
+
+  if (writer->_hdr_buf && writer->_fd >= 0)
+  {
+    err = npio_save_header_mem5(writer->_hdr_buf
+      , npio_hdr_size_(&writer->array), &writer->array, &end
+      , writer->_hdr_size);
+    if (!err)
+      err = npio_pwrite_full_(writer->_fd, writer->_hdr_buf, writer->_hdr_size
+        , writer->_start);
+  }
+
+  if (writer->_opened)
+  {
+    if (close(writer->_fd) && !err)
+      err = errno;
+    writer->_opened = 0;
+  }
+  writer->_fd = -1;
+
+  free(writer->_hdr_buf);
+  writer->_hdr_buf = 0;
+  free(writer->array.shape);
+  writer->array.shape = 0;
+  return err;
+}
+
+
+/*
+
+Npz archives.
+
+An npz file is a zip archive of npy files, as written by numpy.savez. The
+archive is mapped read-only once and its central directory is parsed into an
+index of members sorted by name. Members stored without compression are then
+loaded straight out of the mapping by npio_load_header_mem4, so their data is
+not copied unless its bytes have to be swapped. The archive itself is never
+written to.
+
+Arrays loaded from an archive point into its mapping, so they must be freed
+before the archive is closed. Note that numpy does not align the members of
+an archive, so their data may not be aligned to the element size.
+
+Archives that span several disks, or encrypted members, are not supported.
+
+*/
+
+/* A member of an archive. */
+typedef struct
+{
+  const char* name;          /* The member name, without any .npy suffix */
+  uint64_t offset;           /* Offset of the member data in the archive */
+  uint64_t compressed_size;  /* Size of the member data in the archive */
+  uint64_t size;             /* Size of the uncompressed npy file */
+  uint32_t crc32;            /* CRC-32 of the uncompressed npy file */
+  int      method;           /* The zip compression method, 0 if stored */
+} npio_NpzMember;
+
+
+typedef struct
+{
+  size_t n;                  /* The number of members */
+  npio_NpzMember* members;   /* The members, sorted by name */
+
+  /* The following fields are private. */
+  void*  _buf;       /* The contents of the archive */
+  size_t _buf_size;  /* The size of the archive */
+  int    _mmapped;   /* Whether _buf is mapped, rather than allocated */
+  char*  _names;     /* Storage for the member names */
+} npio_Npz;
+
+
+/* Little-endian fields of zip records. */
+static inline uint32_t npio_get16_(const unsigned char* p)
+{
+  return p[0] | (uint32_t) p[1] << 8;
+}
+
+
+static inline uint32_t npio_get32_(const unsigned char* p)
+{
+  return p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16
+    | (uint32_t) p[3] << 24;
+}
+
+
+static inline uint64_t npio_get64_(const unsigned char* p)
+{
+  return npio_get32_(p) | (uint64_t) npio_get32_(p + 4) << 32;
+}
+
+
+static inline unsigned char* npio_put16_(unsigned char* p, uint32_t v)
+{
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+  return p + 2;
+}
+
+
+static inline unsigned char* npio_put32_(unsigned char* p, uint32_t v)
+{
+  return npio_put16_(npio_put16_(p, v & 0xffff), v >> 16);
+}
+
+
+static inline unsigned char* npio_put64_(unsigned char* p, uint64_t v)
+{
+  return npio_put32_(npio_put32_(p, (uint32_t) v), (uint32_t) (v >> 32));
+}
+
+
+/* Tables for a slicing-by-8 CRC-32, built on first use. */
+static uint32_t npio_crc32_table_[8][256];
+static pthread_once_t npio_crc32_once_ = PTHREAD_ONCE_INIT;
+
+
+static inline void npio_crc32_init_(void)
+{
+  uint32_t c;
+  int i, j;
+
+  for (i = 0; i < 256; ++i)
+  {
+    c = i;
+    for (j = 0; j < 8; ++j)
+      c = (c >> 1) ^ (0xedb88320u & (0u - (c & 1)));
+    npio_crc32_table_[0][i] = c;
+  }
+  for (i = 0; i < 256; ++i)
+  {
+    c = npio_crc32_table_[0][i];
+    for (j = 1; j < 8; ++j)
+    {
+      c = (c >> 8) ^ npio_crc32_table_[0][c & 0xff];
+      npio_crc32_table_[j][i] = c;
+    }
+  }
+}
+
+
+/*
+Update the zip (ISO-HDLC) CRC-32 crc with n bytes at p. Start with a crc of 0.
+*/
+static inline uint32_t npio_crc32(uint32_t crc, const void* p_, size_t n)
+{
+  const unsigned char* p = (const unsigned char*) p_;
+  uint32_t (*t)[256] = npio_crc32_table_;
+  uint32_t a, b;
+
+  pthread_once(&npio_crc32_once_, npio_crc32_init_);
+  crc = ~crc;
+  for (; n >= 8; n -= 8, p += 8)
+  {
+    a = npio_get32_(p) ^ crc;
+    b = npio_get32_(p + 4);
+    crc = t[7][a & 0xff] ^ t[6][(a >> 8) & 0xff] ^ t[5][(a >> 16) & 0xff]
+      ^ t[4][a >> 24] ^ t[3][b & 0xff] ^ t[2][(b >> 8) & 0xff]
+      ^ t[1][(b >> 16) & 0xff] ^ t[0][b >> 24];
+  }
+  while (n--)
+    crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+
+/* Order members by name. */
+static inline int npio_npz_cmp_(const void* a, const void* b)
+{
+  return strcmp(((const npio_NpzMember*) a)->name
+    , ((const npio_NpzMember*) b)->name);
+}
+
+
+/* Pick the 64 bit values out of the zip64 extra field of a central directory
+   entry, for each of the 32 bit fields that are saturated. */
+static inline int npio_npz_zip64_(const unsigned char* p, size_t n
+  , uint64_t* size, uint64_t* compressed_size, uint64_t* offset)
+{
+  const unsigned char *end = p + n;
+  size_t len;
+
+  while (end - p >= 4)
+  {
+    len = npio_get16_(p + 2);
+    if ((size_t) (end - p - 4) < len)
+      return EINVAL;
+    if (npio_get16_(p) == 1)
+    {
+      end = p + 4 + len;
+      p += 4;
+      if (*size == 0xffffffffu)
+      {
+        if (end - p < 8)
+          return EINVAL;
+        *size = npio_get64_(p);
+        p += 8;
+      }
+      if (*compressed_size == 0xffffffffu)
+      {
+        if (end - p < 8)
+          return EINVAL;
+        *compressed_size = npio_get64_(p);
+        p += 8;
+      }
+      if (*offset == 0xffffffffu)
+      {
+        if (end - p < 8)
+          return EINVAL;
+        *offset = npio_get64_(p);
+      }
+      return 0;
+    }
+    p += 4 + len;
+  }
+  return 0;
+}
+
+
+/* Build the member index from the central directory of the archive. */
+static inline int npio_npz_parse_(npio_Npz* npz)
+{
+  const unsigned char *buf = (const unsigned char*) npz->_buf, *p, *q;
+  const unsigned char *end = buf + npz->_buf_size, *eocd = 0;
+  uint64_t size = npz->_buf_size, count, cd_size, cd_offset, local;
+  size_t i, name_len, extra_len, comment_len, len;
+  npio_NpzMember *m;
+  char *name;
+  int err;
+
+  if (size < 22)
+    return EINVAL;
+
+  /* Find the end of central directory record, which may be followed by a
+     comment of up to 64K. */
+  for (p = end - 22; ; --p)
+  {
+    if (npio_get32_(p) == 0x06054b50
+      && (size_t) (end - p) == 22 + npio_get16_(p + 20))
+    {
+      eocd = p;
+      break;
+    }
+    if (p == buf || end - p >= 22 + 0xffff)
+      return EINVAL;
+  }
+
+  count = npio_get16_(eocd + 10);
+  cd_size = npio_get32_(eocd + 12);
+  cd_offset = npio_get32_(eocd + 16);
+
+  if (count == 0xffff || cd_size == 0xffffffffu || cd_offset == 0xffffffffu)
+  {
+    /* The real values are in the zip64 record, found through the locator
+       that precedes the end record. */
+    if (eocd - buf < 20 || npio_get32_(eocd - 20) != 0x07064b50)
+      return EINVAL;
+    local = npio_get64_(eocd - 20 + 8);
+    if (size < 56 || local > size - 56 || npio_get32_(buf + local) != 0x06064b50)
+      return EINVAL;
+    p = buf + local;
+    if (npio_get32_(p + 16) != 0 || npio_get32_(p + 20) != 0)
+      return ENOTSUP;
+    count = npio_get64_(p + 32);
+    cd_size = npio_get64_(p + 40);
+    cd_offset = npio_get64_(p + 48);
+  }
+  else if (npio_get16_(eocd + 4) != 0 || npio_get16_(eocd + 6) != 0)
+    return ENOTSUP;
+
+  if (cd_offset > size || cd_size > size - cd_offset || count > cd_size / 46)
+    return EINVAL;
+
+  /* Every entry takes at least 46 bytes more than its name, so cd_size is
+     plenty for the names and their terminators. */
+  npz->members = (npio_NpzMember*) malloc(count ? count * sizeof(*m) : 1);
+  npz->_names = name = (char*) malloc(cd_size + 1);
+  if (npz->members == 0 || name == 0)
+    return ENOMEM;
+
+  p = buf + cd_offset;
+  q = p + cd_size;
+  for (i = 0; i < count; ++i)
+  {
+    m = &npz->members[i];
+    if (q - p < 46 || npio_get32_(p) != 0x02014b50)
+      return EINVAL;
+    name_len = npio_get16_(p + 28);
+    extra_len = npio_get16_(p + 30);
+    comment_len = npio_get16_(p + 32);
+    if ((size_t) (q - p) < 46 + name_len + extra_len + comment_len)
+      return EINVAL;
+
+    /* Encrypted */
+    if (npio_get16_(p + 8) & 1)
+      return ENOTSUP;
+
+    m->method = npio_get16_(p + 10);
+    m->crc32 = npio_get32_(p + 16);
+    m->compressed_size = npio_get32_(p + 20);
+    m->size = npio_get32_(p + 24);
+    local = npio_get32_(p + 42);
+    if ((err = npio_npz_zip64_(p + 46 + name_len, extra_len, &m->size
+      , &m->compressed_size, &local)))
+      return err;
+
+    /* The data follows the local header, whose extra field may differ from
+       the one in the central directory. */
+    if (local > size - 30 || npio_get32_(buf + local) != 0x04034b50)
+      return EINVAL;
+    m->offset = local + 30 + npio_get16_(buf + local + 26)
+      + npio_get16_(buf + local + 28);
+    if (m->offset > size || m->compressed_size > size - m->offset)
+      return EINVAL;
+
+    len = name_len;
+    if (len >= 4 && memcmp(p + 46 + len - 4, ".npy", 4) == 0)
+      len -= 4;
+    memcpy(name, p + 46, len);
+    name[len] = 0;
+    m->name = name;
+    name += len + 1;
+    npz->n = i + 1;
+
+    p += 46 + name_len + extra_len + comment_len;
+  }
+
+  qsort(npz->members, npz->n, sizeof(*m), npio_npz_cmp_);
+  return 0;
+}
+
+
+/* Read an archive that cannot be mapped, such as a pipe, into memory. */
+static inline int npio_npz_read_(npio_Npz* npz, int fd)
+{
+  size_t capacity = 65536;
+  char *p;
+  ssize_t nr;
+
+  if ((npz->_buf = malloc(capacity)) == 0)
+    return ENOMEM;
+
+  while (1)
+  {
+    if (npz->_buf_size == capacity)
+    {
+      if ((p = (char*) realloc(npz->_buf, capacity * 2)) == 0)
+        return ENOMEM;
+      npz->_buf = p;
+      capacity *= 2;
+    }
+    nr = read(fd, (char*) npz->_buf + npz->_buf_size
+      , capacity - npz->_buf_size);
+    if (nr < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    if (nr == 0)
+      break;
+    npz->_buf_size += nr;
+  }
+  return npio_npz_parse_(npz);
+}
+
+
+/*
+Open an archive on a file descriptor. The descriptor can be closed once this
+returns. You must call npio_npz_close on the archive afterwards, even if this
+fails.
+
+Return:
+  0 on success.
+  EINVAL   the file is not a valid zip archive.
+  ENOTSUP  the archive spans several disks, or has encrypted members.
+  ENOMEM   out of memory.
+  Other errno codes from mmap or read.
+*/
+static inline int npio_npz_open_fd(npio_Npz* npz, int fd)
+{
+  off_t file_size;
+  void *p;
+
+  npz->n = 0;
+  npz->members = 0;
+  npz->_buf = 0;
+  npz->_buf_size = 0;
+  npz->_mmapped = 0;
+  npz->_names = 0;
+
+  if ((file_size = lseek(fd, 0, SEEK_END)) < 0)
+    return npio_npz_read_(npz, fd);
+  if (file_size == 0)
+    return EINVAL;
+
+  p = mmap(0, file_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    return errno;
+  npz->_buf = p;
+  npz->_buf_size = file_size;
+  npz->_mmapped = 1;
+  return npio_npz_parse_(npz);
+}
+
+
+/* Same as above, but opens the named file. */
+static inline int npio_npz_open(npio_Npz* npz, const char* filename)
+{
+  int fd, err;
+
+  npz->n = 0;
+  npz->members = 0;
+  npz->_buf = 0;
+  npz->_mmapped = 0;
+  npz->_names = 0;
+
+  if ((fd = open(filename, O_RDONLY)) < 0)
+    return errno;
+  err = npio_npz_open_fd(npz, fd);
+  close(fd);
+  return err;
+}
+
+
+/* Release all resources of an archive. */
+static inline void npio_npz_close(npio_Npz* npz)
+{
+  if (npz->_mmapped)
+    munmap(npz->_buf, npz->_buf_size);
+  else
+    free(npz->_buf);
+  free(npz->members);
+  free(npz->_names);
+  npz->_buf = 0;
+  npz->members = 0;
+  npz->_names = 0;
+  npz->n = 0;
+  npz->_mmapped = 0;
+}
+
+
+/* Find a member by name, without the .npy suffix. Returns null if there is
+   no such member. */
+static inline const npio_NpzMember* npio_npz_find(const npio_Npz* npz
+  , const char* name)
+{
+  npio_NpzMember key;
+  key.name = name;
+  return (const npio_NpzMember*) bsearch(&key, npz->members, npz->n
+    , sizeof(key), npio_npz_cmp_);
+}
+
+
+#ifdef NPIO_ENABLE_ZLIB
+
+/* A raw inflate of a member straight out of the archive. */
+typedef struct
+{
+  z_stream z;
+  const unsigned char* in;   /* Input not yet handed to zlib */
+  uint64_t in_left;
+} npio_Inflate_;
+
+
+/* Inflate exactly n bytes into p. */
+static inline int npio_inflate_full_(void* ctx, void* p, size_t n)
+{
+  npio_Inflate_* s = (npio_Inflate_*) ctx;
+  size_t chunk;
+  int ret;
+
+  s->z.next_out = (Bytef*) p;
+  while (n)
+  {
+    if (s->z.avail_in == 0 && s->in_left)
+    {
+      chunk = s->in_left < NPIO_IO_CHUNK_SIZE ? s->in_left : NPIO_IO_CHUNK_SIZE;
+      s->z.next_in = (Bytef*) s->in;
+      s->z.avail_in = chunk;
+      s->in += chunk;
+      s->in_left -= chunk;
+    }
+    chunk = n < NPIO_IO_CHUNK_SIZE ? n : NPIO_IO_CHUNK_SIZE;
+    s->z.avail_out = chunk;
+    ret = inflate(&s->z, Z_NO_FLUSH);
+    n -= chunk - s->z.avail_out;
+    if (ret == Z_MEM_ERROR)
+      return ENOMEM;
+    if (ret == Z_STREAM_END)
+      return n ? EINVAL : 0;
+    if (ret != Z_OK)
+      return EINVAL;
+  }
+  return 0;
+}
+
+
+/* Inflate a deflated member. The header goes through _hdr_buf as for a
+   pipe, and the data is inflated straight into its final buffer. */
+static inline int npio_npz_inflate_member_(const npio_Npz* npz
+  , const npio_NpzMember* member, npio_Array* array, size_t max_dim)
+{
+  static const int little_endian = (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+  npio_Inflate_ s;
+  size_t sz;
+  uint32_t crc;
+  int err;
+
+  memset(&s.z, 0, sizeof(s.z));
+  s.in = (const unsigned char*) npz->_buf + member->offset;
+  s.in_left = member->compressed_size;
+  if (inflateInit2(&s.z, -MAX_WBITS) != Z_OK)
+    return ENOMEM;
+
+  if ((err = npio_load_header_stream_(array, max_dim, npio_inflate_full_, &s)))
+    goto done;
+
+  sz = array->size * array->bit_width / 8;
+  if ((ssize_t) sz < 0 || member->size < array->_hdr_buf_size
+    || member->size - array->_hdr_buf_size != sz)
+  {
+    err = EINVAL;
+    goto done;
+  }
+
+  if ((err = npio_alloc_data_(array, sz)))
+    goto done;
+  if ((err = npio_inflate_full_(&s, array->data, sz)))
+    goto done;
+
+  crc = npio_crc32(npio_crc32(0, array->_hdr_buf, array->_hdr_buf_size)
+    , array->data, sz);
+  if (crc != member->crc32)
+  {
+    err = EINVAL;
+    goto done;
+  }
+
+  if (little_endian != array->little_endian)
+  {
+    array->little_endian = little_endian;
+    err = npio_swap_elements_(array, array->size, array->data, array->data);
+  }
+
+done:
+  inflateEnd(&s.z);
+  return err;
+}
+
+#endif
+
+
+/*
+Load a member of an archive into an array, which must have been initialized
+with npio_init_array. The data of a stored member is not copied, unless its
+byte order has to be swapped. With NPIO_ENABLE_ZLIB, deflated members are
+inflated directly into the data buffer of the array, and checked against
+their CRC.
+
+Return:
+  0 on success, or any of the errors of npio_load_mem4.
+  ENOTSUP  the member is compressed, and the method is not supported.
+  EINVAL   a compressed member is corrupt.
+*/
+static inline int npio_npz_load_member4(const npio_Npz* npz
+  , const npio_NpzMember* member, npio_Array* array, size_t max_dim)
+{
+  int err;
+
+#ifdef NPIO_ENABLE_ZLIB
+  if (member->method == 8)
+    return npio_npz_inflate_member_(npz, member, array, max_dim);
+#endif
+  if (member->method != 0)
+    return ENOTSUP;
+  if (member->compressed_size != member->size)
+    return EINVAL;
+
+  if ((err = npio_load_header_mem4((char*) npz->_buf + member->offset
+    , member->size, array, max_dim)))
+    return err;
+
+  /* The archive is read-only, so any swap is made into a copy. */
+  array->_flags |= NPIO_MAP_SHARED;
+  return npio_load_data(array);
+}
+
+
+/*
+Load the named member, without the .npy suffix, into an array.
+
+Return:
+  0 on success, or any of the errors of npio_npz_load_member4.
+  ENOENT   there is no such member.
+*/
+static inline int npio_npz_load4(const npio_Npz* npz, const char* name
+  , npio_Array* array, size_t max_dim)
+{
+  const npio_NpzMember* member = npio_npz_find(npz, name);
+  if (member == 0)
+    return ENOENT;
+  return npio_npz_load_member4(npz, member, array, max_dim);
+}
+
+
+/* Same as above, with a default for max_dim. */
+static inline int npio_npz_load(const npio_Npz* npz, const char* name
+  , npio_Array* array)
+{
+  return npio_npz_load4(npz, name, array, NPIO_DEFAULT_MAX_DIM);
+}
+
+
+/* What the central directory needs to know about a saved member. */
+typedef struct
+{
+  uint64_t offset;
+  uint64_t size;
+  uint32_t crc32;
+} npio_NpzEntry_;
+
+
+/* Write the local header and npy file of one stored member at offset, which
+   is advanced past them. */
+static inline int npio_savez_member_(int fd, const char* name
+  , const npio_Array* array, uint64_t* offset, npio_NpzEntry_* entry)
+{
+  char small_buf[256];
+  char *hdr_buf = small_buf;
+  size_t hdr_size = npio_hdr_size_(array);
+  size_t name_len = strlen(name);
+  unsigned char *local = 0, *p;
+  struct iovec iov[3];
+  void *end;
+  int err, zip64;
+
+  if (name_len + 4 > 0xffff)
+    return ERANGE;
+
+  if (hdr_size > sizeof(small_buf))
+  {
+    if ((hdr_buf = (char*) malloc(hdr_size)) == 0)
+      return ENOMEM;
+  }
+  if ((err = npio_save_header_mem(hdr_buf, hdr_size, array, &end)))
+    goto done;
+
+  iov[1].iov_base = hdr_buf;
+  iov[1].iov_len = (char*) end - hdr_buf;
+  iov[2].iov_base = array->data;
+  iov[2].iov_len = npio_array_memsize(array);
+
+  entry->offset = *offset;
+  entry->size = iov[1].iov_len + iov[2].iov_len;
+  entry->crc32 = npio_crc32(npio_crc32(0, iov[1].iov_base, iov[1].iov_len)
+    , iov[2].iov_base, iov[2].iov_len);
+  zip64 = entry->size >= 0xffffffffu;
+
+  if ((local = (unsigned char*) malloc(30 + name_len + 4 + 20)) == 0)
+  {
+    err = ENOMEM;
+    goto done;
+  }
+
+  p = npio_put32_(local, 0x04034b50);
+  p = npio_put16_(p, zip64 ? 45 : 20);   /* version needed */
+  p = npio_put16_(p, 0);                 /* flags */
+  p = npio_put16_(p, 0);                 /* stored */
+  p = npio_put16_(p, 0);                 /* time */
+  p = npio_put16_(p, 0x21);              /* date, 1980-01-01 */
+  p = npio_put32_(p, entry->crc32);
+  p = npio_put32_(p, zip64 ? 0xffffffffu : (uint32_t) entry->size);
+  p = npio_put32_(p, zip64 ? 0xffffffffu : (uint32_t) entry->size);
+  p = npio_put16_(p, name_len + 4);
+  p = npio_put16_(p, zip64 ? 20 : 0);
+  memcpy(p, name, name_len);
+  memcpy(p + name_len, ".npy", 4);
+  p += name_len + 4;
+  if (zip64)
+  {
+    p = npio_put16_(p, 1);
+    p = npio_put16_(p, 16);
+    p = npio_put64_(p, entry->size);
+    p = npio_put64_(p, entry->size);
+  }
+
+  iov[0].iov_base = local;
+  iov[0].iov_len = p - local;
+  if (!(err = npio_writev_full_(fd, iov, 3)))
+    *offset += iov[0].iov_len + entry->size;
+
+done:
+  free(local);
+  if (hdr_buf != small_buf)
+    free(hdr_buf);
+  return err;
+}
+
+
+/*
+Save arrays into an npz archive, in the format of numpy.savez. Member i holds
+arrays[i] and is named names[i] with a .npy suffix. The members are stored
+without compression. The archive is written sequentially from the current
+position, so the descriptor does not have to be seekable.
+
+Return:
+  0 on success.
+  ERANGE   an array has too many dimensions, or a name is too long.
+  ENOMEM   out of memory.
+  Other IO error from the OS.
+*/
+static inline int npio_savez_fd(int fd, size_t n, const char* const* names
+  , const npio_Array* arrays)
+{
+  npio_NpzEntry_ *entries, *e;
+  unsigned char *cd = 0, *p;
+  uint64_t offset = 0, cd_len;
+  size_t i, name_len, cd_size = 56 + 20 + 22;  /* the end records */
+  int err = 0, big, far, extra;
+
+  if ((entries = (npio_NpzEntry_*) malloc(n ? n * sizeof(*e) : 1)) == 0)
+    return ENOMEM;
+
+  for (i = 0; i < n; ++i)
+  {
+    if ((err = npio_savez_member_(fd, names[i], &arrays[i], &offset
+      , &entries[i])))
+      goto done;
+    /* The central directory entry, with room for a zip64 extra field */
+    cd_size += 46 + strlen(names[i]) + 4 + 28;
+  }
+
+  if ((cd = (unsigned char*) malloc(cd_size)) == 0)
+  {
+    err = ENOMEM;
+    goto done;
+  }
+
+  for (i = 0, p = cd; i < n; ++i)
+  {
+    e = &entries[i];
+    name_len = strlen(names[i]);
+    big = e->size >= 0xffffffffu;
+    far = e->offset >= 0xffffffffu;
+    extra = (big ? 16 : 0) + (far ? 8 : 0);
+
+    p = npio_put32_(p, 0x02014b50);
+    p = npio_put16_(p, 0x0300 | (extra ? 45 : 20));  /* made by, on unix */
+    p = npio_put16_(p, extra ? 45 : 20);             /* version needed */
+    p = npio_put16_(p, 0);                           /* flags */
+    p = npio_put16_(p, 0);                           /* stored */
+    p = npio_put16_(p, 0);                           /* time */
+    p = npio_put16_(p, 0x21);                        /* date */
+    p = npio_put32_(p, e->crc32);
+    p = npio_put32_(p, big ? 0xffffffffu : (uint32_t) e->size);
+    p = npio_put32_(p, big ? 0xffffffffu : (uint32_t) e->size);
+    p = npio_put16_(p, name_len + 4);
+    p = npio_put16_(p, extra ? extra + 4 : 0);
+    p = npio_put16_(p, 0);                           /* comment length */
+    p = npio_put16_(p, 0);                           /* disk */
+    p = npio_put16_(p, 0);                           /* internal attributes */
+    p = npio_put32_(p, 0644u << 16);                 /* external attributes */
+    p = npio_put32_(p, far ? 0xffffffffu : (uint32_t) e->offset);
+    memcpy(p, names[i], name_len);
+    memcpy(p + name_len, ".npy", 4);
+    p += name_len + 4;
+    if (extra)
+    {
+      p = npio_put16_(p, 1);
+      p = npio_put16_(p, extra);
+      if (big)
+      {
+        p = npio_put64_(p, e->size);
+        p = npio_put64_(p, e->size);
+      }
+      if (far)
+        p = npio_put64_(p, e->offset);
+    }
+  }
+  cd_len = p - cd;
+
+  /* The zip64 end record and its locator, if the plain end record cannot
+     hold the values. */
+  if (n >= 0xffff || offset >= 0xffffffffu || cd_len >= 0xffffffffu)
+  {
+    p = npio_put32_(p, 0x06064b50);
+    p = npio_put64_(p, 44);
+    p = npio_put16_(p, 0x0300 | 45);
+    p = npio_put16_(p, 45);
+    p = npio_put32_(p, 0);
+    p = npio_put32_(p, 0);
+    p = npio_put64_(p, n);
+    p = npio_put64_(p, n);
+    p = npio_put64_(p, cd_len);
+    p = npio_put64_(p, offset);
+
+    p = npio_put32_(p, 0x07064b50);
+    p = npio_put32_(p, 0);
+    p = npio_put64_(p, offset + cd_len);
+    p = npio_put32_(p, 1);
+  }
+
+  p = npio_put32_(p, 0x06054b50);
+  p = npio_put16_(p, 0);
+  p = npio_put16_(p, 0);
+  p = npio_put16_(p, n >= 0xffff ? 0xffff : n);
+  p = npio_put16_(p, n >= 0xffff ? 0xffff : n);
+  p = npio_put32_(p, cd_len >= 0xffffffffu ? 0xffffffffu : (uint32_t) cd_len);
+  p = npio_put32_(p, offset >= 0xffffffffu ? 0xffffffffu : (uint32_t) offset);
+  p = npio_put16_(p, 0);
+
+  err = npio_write_full_(fd, cd, p - cd);
+
+done:
+  free(cd);
+  free(entries);
+  return err;
+}
+
+
+/* Same as above, but saves to the named file. */
+static inline int npio_savez(const char* filename, size_t n
+  , const char* const* names, const npio_Array* arrays)
+{
+  int fd, err;
+  fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    return errno;
+  err = npio_savez_fd(fd, n, names, arrays);
+  close(fd);
+  return err;
+}
+
+
+/*
+
+Batch loader.
+
+A batch loads many arrays concurrently on a pool of threads, which hides the
+syscall latency of loading lots of small files one after another. Loads are
+submitted by filename or descriptor and their completions are collected in
+whatever order they finish. As with every load, files of at most
+NPIO_MMAP_THRESHOLD bytes are read with a single pread instead of being mapped.
+
+For use with an event loop, npio_batch_fd returns a descriptor that is
+readable whenever there are completions waiting to be collected.
+
+The library is otherwise thread-agnostic, so none of this costs anything
+unless you use it.
+
+*/
+
+/* The result of a load submitted to a batch. */
+typedef struct
+{
+  npio_Array* array;  /* The array that was passed to submit. */
+  void* user_data;    /* The user_data that was passed to submit. */
+  int error;          /* The result of the load. */
+} npio_Completion;
+
+
+/* A queued or completed load. Private. */
+typedef struct npio_BatchJob_
+{
+  struct npio_BatchJob_* next;
+  npio_Completion completion;
+  int fd;             /* The descriptor to load from, or -1 */
+  const npio_Npz* npz;           /* Or the archive to load a member of */
+  const npio_NpzMember* member;
+  size_t max_dim;
+  char filename[1];   /* The filename to load from, allocated in place */
+} npio_BatchJob_;
+
+
+typedef struct
+{
+  /* All fields are private. */
+  pthread_mutex_t _lock;
+  pthread_cond_t _work;       /* Signalled when jobs are queued or on stop */
+  pthread_cond_t _done;       /* Signalled when jobs complete */
+  pthread_t* _threads;
+  size_t _nthreads;
+  npio_BatchJob_* _pending;   /* Queue of submitted jobs */
+  npio_BatchJob_** _pending_tail;
+  npio_BatchJob_* _completed; /* Queue of completed jobs */
+  npio_BatchJob_** _completed_tail;
+  size_t _outstanding;        /* Jobs submitted but not yet collected */
+  int _pipe[2];               /* Holds a byte while _completed is non-empty */
+  int _stop;
+} npio_Batch;
+
+
+/* Run one job. The descriptor is closed if we opened it. */
+static inline int npio_batch_run_(npio_BatchJob_* job)
+{
+  int fd = job->fd, err;
+  if (job->npz)
+    return npio_npz_load_member4(job->npz, job->member
+      , job->completion.array, job->max_dim);
+  if (fd < 0 && (fd = open(job->filename, O_RDONLY)) < 0)
+    return errno;
+  err = npio_load_fd3(fd, job->completion.array, job->max_dim);
+  if (job->fd < 0)
+  {
+    close(fd);
+    job->completion.array->_fd = -1;
+  }
+  return err;
+}
+
+
+static inline void* npio_batch_thread_(void* arg)
+{
+  npio_Batch* batch = (npio_Batch*) arg;
+  npio_BatchJob_* job;
+  char c = 0;
+  ssize_t nw;
+
+  pthread_mutex_lock(&batch->_lock);
+  while (1)
+  {
+    while (!batch->_pending && !batch->_stop)
+      pthread_cond_wait(&batch->_work, &batch->_lock);
+    if (!(job = batch->_pending))
+      break;
+    if (!(batch->_pending = job->next))
+      batch->_pending_tail = &batch->_pending;
+    pthread_mutex_unlock(&batch->_lock);
+
+    job->completion.error = npio_batch_run_(job);
+
+    pthread_mutex_lock(&batch->_lock);
+    job->next = 0;
+    if (!batch->_completed)
+    {
+      /* Non-empty now, so make the descriptor readable. The pipe never
+         holds more than this one byte, so the write cannot fail. */
+      nw = write(batch->_pipe[1], &c, 1);
+      (void) nw;
+    }
+    *batch->_completed_tail = job;
+    batch->_completed_tail = &job->next;
+    pthread_cond_broadcast(&batch->_done);
+  }
+  pthread_mutex_unlock(&batch->_lock);
+  return 0;
+}
+
+
+/* Release everything but the queues. */
+static inline void npio_batch_cleanup_(npio_Batch* batch)
+{
+  pthread_mutex_destroy(&batch->_lock);
+  pthread_cond_destroy(&batch->_work);
+  pthread_cond_destroy(&batch->_done);
+  close(batch->_pipe[0]);
+  close(batch->_pipe[1]);
+  free(batch->_threads);
+}
+
+
+/*
+Start a batch with nthreads worker threads (at least one).
+
+Return:
+  0 on success, otherwise an errno code. On failure, nothing needs to be
+  released.
+*/
+static inline int npio_batch_init(npio_Batch* batch, size_t nthreads)
+{
+  size_t i;
+  int err;
+
+  if (nthreads == 0)
+    nthreads = 1;
+
+  batch->_pending = batch->_completed = 0;
+  batch->_pending_tail = &batch->_pending;
+  batch->_completed_tail = &batch->_completed;
+  batch->_outstanding = 0;
+  batch->_stop = 0;
+  batch->_nthreads = 0;
+
+  if (pipe(batch->_pipe))
+    return errno;
+  fcntl(batch->_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(batch->_pipe[1], F_SETFL, O_NONBLOCK);
+  pthread_mutex_init(&batch->_lock, 0);
+  pthread_cond_init(&batch->_work, 0);
+  pthread_cond_init(&batch->_done, 0);
+
+  batch->_threads = (pthread_t*) malloc(sizeof(pthread_t) * nthreads);
+  if (!batch->_threads)
+  {
+    npio_batch_cleanup_(batch);
+    return ENOMEM;
+  }
+
+  for (i = 0; i < nthreads; ++i)
+  {
+    if ((err = pthread_create(&batch->_threads[i], 0, npio_batch_thread_
+      , batch)))
+    {
+      /* Stop the threads we did start. */
+      pthread_mutex_lock(&batch->_lock);
+      batch->_stop = 1;
+      pthread_cond_broadcast(&batch->_work);
+      pthread_mutex_unlock(&batch->_lock);
+      while (i--)
+        pthread_join(batch->_threads[i], 0);
+      npio_batch_cleanup_(batch);
+      return err;
+    }
+  }
+  batch->_nthreads = nthreads;
+  return 0;
+}
+
+
+/* Queue a job for the worker threads. */
+static inline int npio_batch_queue_(npio_Batch* batch, const char* filename
+  , int fd, const npio_Npz* npz, const npio_NpzMember* member
+  , npio_Array* array, size_t max_dim, void* user_data)
+{
+  size_t len = filename ? strlen(filename) : 0;
+  npio_BatchJob_* job = (npio_BatchJob_*) malloc(sizeof(npio_BatchJob_) + len);
+  if (!job)
+    return ENOMEM;
+  job->next = 0;
+  job->completion.array = array;
+  job->completion.user_data = user_data;
+  job->completion.error = 0;
+  job->fd = fd;
+  job->npz = npz;
+  job->member = member;
+  job->max_dim = max_dim;
+  memcpy(job->filename, filename ? filename : "", len + 1);
+
+  pthread_mutex_lock(&batch->_lock);
+  *batch->_pending_tail = job;
+  batch->_pending_tail = &job->next;
+  ++batch->_outstanding;
+  pthread_cond_signal(&batch->_work);
+  pthread_mutex_unlock(&batch->_lock);
+  return 0;
+}
+
+
+/*
+Submit a load of the named file into array, which must have been initialized
+with npio_init_array and must not be touched until its completion has been
+collected. You must call npio_free_array on it afterwards, whether or not the
+load succeeded. The filename is copied.
+*/
+static inline int npio_batch_submit(npio_Batch* batch, const char* filename
+  , npio_Array* array, void* user_data)
+{
+  return npio_batch_queue_(batch, filename, -1, 0, 0, array
+    , NPIO_DEFAULT_MAX_DIM, user_data);
+}
+
+
+/* Same as above, but loads from an open descriptor, which is not closed. */
+static inline int npio_batch_submit_fd(npio_Batch* batch, int fd
+  , npio_Array* array, void* user_data)
+{
+  return npio_batch_queue_(batch, 0, fd, 0, 0, array, NPIO_DEFAULT_MAX_DIM
+    , user_data);
+}
+
+
+/* Same as above, but loads a member of an archive with npio_npz_load_member4.
+   The archive must stay open until the completion has been collected. Members
+   of one archive decompress concurrently, each into its own array. */
+static inline int npio_batch_submit_npz(npio_Batch* batch, const npio_Npz* npz
+  , const npio_NpzMember* member, npio_Array* array, void* user_data)
+{
+  return npio_batch_queue_(batch, 0, -1, npz, member, array
+    , NPIO_DEFAULT_MAX_DIM, user_data);
+}
+
+
+/* A descriptor that polls readable while completions are waiting. Do not
+   read from or close it yourself. */
+static inline int npio_batch_fd(const npio_Batch* batch)
+{
+  return batch->_pipe[0];
+}
+
+
+/*
+Collect one completed load into completion. If block is non-zero, wait for a
+load to complete if none has yet.
+
+Return:
+  0        a completion was collected.
+  EAGAIN   block is zero and no load has completed yet.
+  ENOENT   there are no outstanding loads.
+*/
+static inline int npio_batch_wait(npio_Batch* batch, npio_Completion* completion
+  , int block)
+{
+  npio_BatchJob_* job;
+  char c;
+  ssize_t nr;
+
+  pthread_mutex_lock(&batch->_lock);
+  while (!batch->_completed)
+  {
+    if (!batch->_outstanding || !block)
+    {
+      pthread_mutex_unlock(&batch->_lock);
+      return batch->_outstanding ? EAGAIN : ENOENT;
+    }
+    pthread_cond_wait(&batch->_done, &batch->_lock);
+  }
+
+  job = batch->_completed;
+  if (!(batch->_completed = job->next))
+  {
+    batch->_completed_tail = &batch->_completed;
+    /* Empty now, so the descriptor is no longer readable. */
+    nr = read(batch->_pipe[0], &c, 1);
+    (void) nr;
+  }
+  --batch->_outstanding;
+  pthread_mutex_unlock(&batch->_lock);
+
+  *completion = job->completion;
+  free(job);
+  return 0;
+}
+
+
+/* Wait for all outstanding loads, then stop the threads and release the
+   batch. Completions that were not collected are discarded, but the arrays
+   they refer to still need to be freed with npio_free_array. */
+static inline void npio_batch_destroy(npio_Batch* batch)
+{
+  npio_Completion completion;
+  size_t i;
+
+  while (npio_batch_wait(batch, &completion, 1) == 0)
+    ;
+
+  pthread_mutex_lock(&batch->_lock);
+  batch->_stop = 1;
+  pthread_cond_broadcast(&batch->_work);
+  pthread_mutex_unlock(&batch->_lock);
+  for (i = 0; i < batch->_nthreads; ++i)
+    pthread_join(batch->_threads[i], 0);
+  npio_batch_cleanup_(batch);
+}
+
+
+/* Load n files, or the n members of npz, into arrays and wait for all of
+   them. */
+static inline int npio_batch_load_all_(size_t n, const char* const* filenames
+  , const npio_Npz* npz, npio_Array* arrays, int* errors, size_t nthreads)
+{
+  npio_Batch batch;
+  npio_Completion completion;
+  size_t i, first_i = n;
+  int err, first = 0;
+
+  if ((err = npio_batch_init(&batch, nthreads < n ? nthreads : n)))
+    return err;
+
+  for (i = 0; i < n; ++i)
+  {
+    if (npz)
+      err = npio_batch_submit_npz(&batch, npz, &npz->members[i], &arrays[i]
+        , (void*) i);
+    else
+      err = npio_batch_submit(&batch, filenames[i], &arrays[i], (void*) i);
+    if (err)
+    {
+      if (errors)
+        errors[i] = err;
+      if (i < first_i)
+      {
+        first_i = i;
+        first = err;
+      }
+    }
+  }
+
+  while (npio_batch_wait(&batch, &completion, 1) == 0)
+  {
+    i = (size_t) completion.user_data;
+    if (errors)
+      errors[i] = completion.error;
+    if (completion.error && i < first_i)
+    {
+      first_i = i;
+      first = completion.error;
+    }
+  }
+
+  npio_batch_destroy(&batch);
+  return first;
+}
+
+
+/*
+Load n files into arrays using nthreads threads, and wait for all of them.
+Each array must have been initialized with npio_init_array, and must be freed
+with npio_free_array afterwards. If errors is not null, it receives the
+result of each load.
+
+Return:
+  0 if all loads succeeded, otherwise the error of the first failed load, or
+  an error from starting the batch.
+*/
+static inline int npio_load_batch(size_t n, const char* const* filenames
+  , npio_Array* arrays, int* errors, size_t nthreads)
+{
+  return npio_batch_load_all_(n, filenames, 0, arrays, errors, nthreads);
+}
+
+
+/*
+Same as above, but loads every member of an archive, so that compressed
+members are inflated concurrently. arrays[i] receives npz->members[i].
+*/
+static inline int npio_npz_load_all(const npio_Npz* npz, npio_Array* arrays
+  , int* errors, size_t nthreads)
+{
+  return npio_batch_load_all_(npz->n, 0, npz, arrays, errors, nthreads);
+}
+
+
+#ifdef __cplusplus
+
+// Convenience wrappers for C++
+
+// Enable additional convenience functions for C++11
+#define NPIO_CXX11 __cplusplus >= 201103L
+
+// You must define this macro if you want the C++ API to use exceptions instead
+// of return values.
+#ifdef NPIO_CXX_ENABLE_EXCEPTIONS
+  #include <typeinfo>
+  #include <system_error>
+#endif
+
+#include <complex>
+
+#if NPIO_CXX11
+  #include <initializer_list>
+  #include <memory>
+  #include <utility>
+  #include <mutex>
+  #include <list>
+  #include <map>
+  #include <string>
+  #include <vector>
+#endif
+
+// With C++17, arrays can allocate from a std::pmr::memory_resource.
+#if __cplusplus >= 201703L && defined(__has_include)
+  #if __has_include(<memory_resource>)
+    #include <memory_resource>
+    #define NPIO_CXX_PMR 1
+  #endif
+#endif
+
+
+namespace npio
+{
+
+
+// Not relying on C++11 type_traits for compatibilty with legacy code-bases.
+
+
+// A 16-bit IEEE half precision float, stored as its bits. Conversions to and
+// from float round to nearest even; use npio_convert for whole arrays.
+struct float16
+{
+  uint16_t bits;
+
+  float16() {}
+  explicit float16(float f) : bits(npio_f32_to_f16_scalar_(f)) {}
+  operator float() const { return npio_f16_to_f32_scalar_(bits); }
+};
+
+
+// Same as above, for bfloat16.
+struct bfloat16
+{
+  uint16_t bits;
+
+  bfloat16() {}
+  explicit bfloat16(float f) : bits(npio_f32_to_bf16_scalar_(f)) {}
+  operator float() const { return npio_bf16_to_f32_scalar_(bits); }
+};
+
+
+// Lets the dtype strings below be used in constant expressions with C++11.
+#if NPIO_CXX11
+  #define NPIO_CONSTEXPR_ constexpr
+#else
+  #define NPIO_CONSTEXPR_
+#endif
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  #define NPIO_HOST_ORDER_ "<"
+#else
+  #define NPIO_HOST_ORDER_ ">"
+#endif
+
+// The numpy dtype string of elements of the given kind and width in host byte
+// order, such as "<f8", or null if there is none. This is a single expression,
+// as a C++11 constexpr function must be.
+inline NPIO_CONSTEXPR_ const char* descr_(char spec, size_t bit_width
+  , bool is_bfloat16)
+{
+  return is_bfloat16 ? (bit_width == 16 ? "bfloat16" : 0)
+    : spec == 'i' ? (bit_width == 8 ? "|i1"
+      : bit_width == 16 ? NPIO_HOST_ORDER_ "i2"
+      : bit_width == 32 ? NPIO_HOST_ORDER_ "i4"
+      : bit_width == 64 ? NPIO_HOST_ORDER_ "i8" : 0)
+    : spec == 'u' ? (bit_width == 8 ? "|u1"
+      : bit_width == 16 ? NPIO_HOST_ORDER_ "u2"
+      : bit_width == 32 ? NPIO_HOST_ORDER_ "u4"
+      : bit_width == 64 ? NPIO_HOST_ORDER_ "u8" : 0)
+    : spec == 'f' ? (bit_width == 16 ? NPIO_HOST_ORDER_ "f2"
+      : bit_width == 32 ? NPIO_HOST_ORDER_ "f4"
+      : bit_width == 64 ? NPIO_HOST_ORDER_ "f8" : 0)
+    : spec == 'c' ? (bit_width == 64 ? NPIO_HOST_ORDER_ "c8"
+      : bit_width == 128 ? NPIO_HOST_ORDER_ "c16" : 0)
+    : 0;
+}
+
+#undef NPIO_HOST_ORDER_
+
+
+//For integral types.
+template <class T>
+struct Traits
+{
+  static const bool is_signed = T(-1) < T(0);
+  static const bool floating_point = false;
+  static const bool is_complex = false;
+  static const bool is_bfloat16 = false;
+  static const bool little_endian = __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__;
+  static const size_t bit_width = sizeof(T) * 8;
+  static const char spec = is_signed ? 'i' : 'u';
+
+  // The numpy dtype string, in host byte order.
+  static NPIO_CONSTEXPR_ const char* descr()
+  {
+    return descr_(spec, bit_width, false);
+  }
+};
+
+
+// For the floating point types, including complex numbers.
+template <size_t Width, bool Complex = false, bool BFloat16 = false>
+struct FloatTraits_
+{
+  static const bool is_signed = true;
+  static const bool floating_point = true;
+  static const bool is_complex = Complex;
+  static const bool is_bfloat16 = BFloat16;
+  static const bool little_endian = __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__;
+  static const size_t bit_width = Width;
+  static const char spec = Complex ? 'c' : 'f';
+
+  static NPIO_CONSTEXPR_ const char* descr()
+  {
+    return descr_(spec, bit_width, BFloat16);
+  }
+};
+
+
+template <> struct Traits<float16> : FloatTraits_<16> {};
+template <> struct Traits<bfloat16> : FloatTraits_<16, false, true> {};
+template <> struct Traits<float> : FloatTraits_<32> {};
+template <> struct Traits<double> : FloatTraits_<64> {};
+template <> struct Traits<std::complex<float> > : FloatTraits_<64, true> {};
+template <> struct Traits<std::complex<double> > : FloatTraits_<128, true> {};
+
+
+// Describe elements of type T in the type fields of array.
+template <class T>
+void set_type_(npio_Array& array)
+{
+  array.floating_point = Traits<T>::floating_point;
+  array.is_signed = Traits<T>::is_signed;
+  array.is_complex = Traits<T>::is_complex;
+  array.is_bfloat16 = Traits<T>::is_bfloat16;
+  array.bit_width = Traits<T>::bit_width;
+}
+
+
+// Whether the type fields of array describe elements of type T.
+template <class T>
+bool is_type_(const npio_Array& array)
+{
+  return Traits<T>::floating_point == (bool) array.floating_point
+    && Traits<T>::is_signed == (bool) array.is_signed
+    && Traits<T>::is_complex == (bool) array.is_complex
+    && Traits<T>::is_bfloat16 == (bool) array.is_bfloat16
+    && Traits<T>::bit_width == (size_t) array.bit_width
+    && array.nfields == 0;
+}
+
+
+// Save the array specicied by nDim, shape and data to a file descriptor
+// opened for writing.
+template <class T>
+int save(int fd, size_t nDim, const size_t *shape, const T* data)
+{
+  npio_Array array;
+  npio_init_array(&array);
+  array.dim = nDim;
+  array.shape = (size_t*) shape;
+  set_type_<T>(array);
+  array.data = (char*) data;
+
+  return npio_save_fd(fd, &array);
+}
+
+
+#if NPIO_CXX11
+// Same as above, but with initializer_list for convenience
+template <class T>
+int save(int fd, std::initializer_list<size_t> shape, const T* data)
+{
+  return save(fd, shape.size(), shape.begin(), data);
+}
+#endif
+
+
+// Save the array specified by nDim, shape and data to the specified file.
+template <class T>
+int save(const char* fn, size_t nDim, const size_t *shape, const T* data)
+{
+  int fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    return errno;
+  int ret = save(fd, nDim, shape, data);
+  close(fd);
+  return ret;
+}
+
+
+#if NPIO_CXX11
+// Same as above, but with initializer_list
+template <class T>
+int save(const char* fn, std::initializer_list<size_t> shape, const T* data)
+{
+  return save(fn, shape.size(), shape.begin(), data);
+}
+#endif
+
+
+// Save with nthreads threads, as npio_save_fd4. flags may be NPIO_SAVE_DIRECT.
+template <class T>
+int save(int fd, size_t nDim, const size_t *shape, const T* data
+  , size_t nthreads, int flags = 0)
+{
+  npio_Array array;
+  npio_init_array(&array);
+  array.dim = nDim;
+  array.shape = (size_t*) shape;
+  set_type_<T>(array);
+  array.data = (char*) data;
+
+  return npio_save_fd4(fd, &array, nthreads, flags);
+}
+
+
+template <class T>
+int save(const char* fn, size_t nDim, const size_t *shape, const T* data
+  , size_t nthreads, int flags = 0)
+{
+  int fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    return errno;
+  int ret = save(fd, nDim, shape, data, nthreads, flags);
+  if (close(fd) && !ret)
+    ret = errno;
+  return ret;
+}
+
+
+#ifdef NPIO_CXX_PMR
+inline void* pmr_alloc_(void* ctx, size_t size, size_t alignment)
+{
+  #if defined(__cpp_exceptions) || defined(__EXCEPTIONS)
+    try
+    {
+      return static_cast<std::pmr::memory_resource*>(ctx)->allocate(size
+        , alignment);
+    }
+    catch (...)
+    {
+      return 0;
+    }
+  #else
+    return static_cast<std::pmr::memory_resource*>(ctx)->allocate(size
+      , alignment);
+  #endif
+}
+
+
+inline void pmr_free_(void* ctx, void* p, size_t size, size_t alignment)
+{
+  static_cast<std::pmr::memory_resource*>(ctx)->deallocate(p, size, alignment);
+}
+
+
+// An npio_Allocator that allocates from mr, which must outlive every array
+// that uses it.
+inline npio_Allocator pmr_allocator(std::pmr::memory_resource* mr)
+{
+  npio_Allocator alloc = { pmr_alloc_, pmr_free_, mr };
+  return alloc;
+}
+#endif
+
+
+template <class T, size_t N> class View;
+
+
+// What indexing a view along its first axis gives: a view of one dimension
+// less, or a reference to an element once a single dimension is left.
+template <class T, size_t N>
+struct ViewRow_
+{
+  typedef View<T, N - 1> type;
+  static type make(const View<T, N>& v, size_t i) { return v.row(i); }
+};
+
+
+template <class T>
+struct ViewRow_<T, 1>
+{
+  typedef T& type;
+  static type make(const View<T, 1>& v, size_t i)
+  {
+    return v.data()[i * v.stride(0)];
+  }
+};
+
+
+// A strided N-dimensional view over elements of type T that it does not own,
+// such as the data of an Array. Strides are counted in elements and may be
+// those of C or Fortran order, or of any slice of either. Slicing never
+// copies, so with a mapped file only the pages that are touched are read.
+template <class T, size_t N>
+class View
+{
+  private:
+    T* data_;
+    size_t shape_[N];
+    ptrdiff_t strides_[N];
+
+    template <class U, size_t M> friend class View;
+
+  public:
+    View() : data_(0)
+    {
+      for (size_t i = 0; i < N; ++i)
+      {
+        shape_[i] = 0;
+        strides_[i] = 0;
+      }
+    }
+
+
+    View(T* data, const size_t* shape, const ptrdiff_t* strides)
+      : data_(data)
+    {
+      for (size_t i = 0; i < N; ++i)
+      {
+        shape_[i] = shape[i];
+        strides_[i] = strides[i];
+      }
+    }
+
+
+    // A view of contiguous data in C order, or Fortran order if fortran_order.
+    View(T* data, const size_t* shape, bool fortran_order = false)
+      : data_(data)
+    {
+      ptrdiff_t s = 1;
+      for (size_t k = 0; k < N; ++k)
+      {
+        size_t i = fortran_order ? k : N - 1 - k;
+        shape_[i] = shape[i];
+        strides_[i] = s;
+        s *= shape[i];
+      }
+    }
+
+
+    T* data() const { return data_; }
+    size_t shape(size_t i) const { return shape_[i]; }
+    ptrdiff_t stride(size_t i) const { return strides_[i]; }
+    bool empty() const { return size() == 0; }
+
+
+    // The number of elements.
+    size_t size() const
+    {
+      size_t n = 1;
+      for (size_t i = 0; i < N; ++i)
+        n *= shape_[i];
+      return n;
+    }
+
+
+    // Whether the elements are contiguous in C order, so that they can be
+    // walked with a pointer.
+    bool contiguous() const
+    {
+      ptrdiff_t s = 1;
+      for (size_t i = N; i-- > 0;)
+      {
+        if (shape_[i] != 1 && strides_[i] != s)
+          return false;
+        s *= shape_[i];
+      }
+      return true;
+    }
+
+
+    // The element at the given N indices.
+    T& at(const size_t* idx) const
+    {
+      T* p = data_;
+      for (size_t i = 0; i < N; ++i)
+        p += idx[i] * strides_[i];
+      return *p;
+    }
+
+
+    #if NPIO_CXX11
+    template <class... I>
+    T& operator()(I... idx) const
+    {
+      static_assert(sizeof...(I) == N, "wrong number of indices");
+      const size_t i[] = {static_cast<size_t>(idx)...};
+      return at(i);
+    }
+    #endif
+
+
+    // Row i along the first axis: a view of one dimension less, or the
+    // element itself for a one-dimensional view.
+    typename ViewRow_<T, N>::type operator[](size_t i) const
+    {
+      return ViewRow_<T, N>::make(*this, i);
+    }
+
+
+    // Same as above, but always a view. Only for N > 1.
+    View<T, N - 1> row(size_t i) const
+    {
+      View<T, N - 1> v;
+      v.data_ = data_ + i * strides_[0];
+      for (size_t k = 1; k < N; ++k)
+      {
+        v.shape_[k - 1] = shape_[k];
+        v.strides_[k - 1] = strides_[k];
+      }
+      return v;
+    }
+
+
+    // The elements begin, begin + step, ... before end along axis. A step of
+    // 0 is taken as 1.
+    View slice(size_t axis, size_t begin, size_t end, size_t step = 1) const
+    {
+      View v(*this);
+      if (step == 0)
+        step = 1;
+      if (end > shape_[axis])
+        end = shape_[axis];
+      v.data_ += begin * strides_[axis];
+      v.shape_[axis] = begin < end ? (end - begin + step - 1) / step : 0;
+      v.strides_[axis] *= step;
+      return v;
+    }
+
+
+    // The block from begin (inclusive) to end (exclusive) on every axis.
+    View subarray(const size_t* begin, const size_t* end) const
+    {
+      View v(*this);
+      for (size_t i = 0; i < N; ++i)
+        v = v.slice(i, begin[i], end[i]);
+      return v;
+    }
+
+
+    // Visits the elements in C order, walking a pointer when the view is
+    // contiguous and carrying indices otherwise.
+    class iterator
+    {
+      private:
+        const View* v_;
+        T* p_;
+        size_t pos_;
+        size_t idx_[N];
+        bool contiguous_;
+
+      public:
+        iterator(const View* v, size_t pos)
+          : v_(v), p_(v->data_), pos_(pos), contiguous_(v->contiguous())
+        {
+          for (size_t i = 0; i < N; ++i)
+            idx_[i] = 0;
+        }
+
+        T& operator*() const { return *p_; }
+        T* operator->() const { return p_; }
+        bool operator==(const iterator& o) const { return pos_ == o.pos_; }
+        bool operator!=(const iterator& o) const { return pos_ != o.pos_; }
+
+        iterator& operator++()
+        {
+          ++pos_;
+          if (contiguous_)
+          {
+            ++p_;
+            return *this;
+          }
+          for (size_t i = N; i-- > 0;)
+          {
+            p_ += v_->strides_[i];
+            if (++idx_[i] < v_->shape_[i])
+              break;
+            p_ -= v_->strides_[i] * (ptrdiff_t) v_->shape_[i];
+            idx_[i] = 0;
+          }
+          return *this;
+        }
+    };
+
+    iterator begin() const { return iterator(this, 0); }
+    iterator end() const { return iterator(this, size()); }
+};
+
+
+// Simple untyped class wrapper for npio_load*
+class Array
+{
+  private:
+    // This is mutable so that lazily loaded data can be filled in by const
+    // accessors.
+    mutable npio_Array array;
+
+    #ifndef NPIO_CXX_ENABLE_EXCEPTIONS
+      int err;
+    #endif
+
+    // Whether the data has been loaded: 0 not yet, 1 being loaded by some
+    // thread, 2 loaded, with any error from loading it in data_err_.
+    mutable int data_state_;
+    mutable int data_err_;
+
+    // Load the header with the given flags, then the data unless it is lazy.
+    int load_(const char* filename, size_t max_dim, int flags)
+    {
+      int e = npio_load_header4(filename, &array, max_dim, flags);
+      return e || (flags & NPIO_LAZY) ? e : npio_load_data(&array);
+    }
+
+    int load_(int fd, size_t max_dim, int flags)
+    {
+      int e = npio_load_header_fd4(fd, &array, max_dim, flags);
+      return e || (flags & NPIO_LAZY) ? e : npio_load_data(&array);
+    }
+
+    // Load the data of a lazy array, once, whichever threads get here.
+    int load_data_() const
+    {
+      int expected = 0;
+      if (__atomic_load_n(&data_state_, __ATOMIC_ACQUIRE) == 2)
+        return data_err_;
+      if (__atomic_compare_exchange_n(&data_state_, &expected, 1, 0
+        , __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+      {
+        data_err_ = npio_load_data(&array);
+        __atomic_store_n(&data_state_, 2, __ATOMIC_RELEASE);
+      }
+      else
+      {
+        while (__atomic_load_n(&data_state_, __ATOMIC_ACQUIRE) != 2)
+          sched_yield();
+      }
+      return data_err_;
+    }
+
+    // The data pointer if the data loads, otherwise throws if exceptions are
+    // enabled, and returns null if not.
+    void* loaded_data_() const
+    {
+      if (int e = load_data_())
+      {
+        #ifdef NPIO_CXX_ENABLE_EXCEPTIONS
+          throw std::system_error(e, std::system_category());
+        #else
+          (void) e;
+          return 0;
+        #endif
+      }
+      return array.data;
+    }
+
+    // Initialize with the allocator and load from a filename or fd.
+    template <class S>
+    void construct_(S src, const npio_Allocator* alloc, size_t max_dim
+      , int flags)
+    {
+      npio_init_array2(&array, alloc);
+      data_err_ = 0;
+      #ifdef NPIO_CXX_ENABLE_EXCEPTIONS
+        if (int err = load_(src, max_dim, flags))
+        {
+          npio_free_array(&array);
+          throw std::system_error(err, std::system_category());
+        }
+      #else
+        err = load_(src, max_dim, flags);
+      #endif
+      data_state_ = (flags & NPIO_LAZY) ? 0 : 2;
+    }
+
+    #if NPIO_CXX11
+      // Copies would munmap and free twice, so arrays are only moved.
+      Array(const Array&) = delete;
+      Array& operator=(const Array&) = delete;
+    #else
+      Array(const Array&);
+      Array& operator=(const Array&);
+    #endif
+
+
+  public:
+    // An empty array that owns nothing, to be assigned or swapped into later.
+    Array()
+      : data_state_(2)
+      , data_err_(0)
+    {
+      npio_init_array(&array);
+      #ifndef NPIO_CXX_ENABLE_EXCEPTIONS
+        err = 0;
+      #endif
+    }
+
+
+    // flags is a combination of the NPIO_MAP_* and NPIO_MADV_* flags. With
+    // NPIO_LAZY only the header is loaded here, and the data by the first
+    // call that needs it, or by load_data(). A descriptor must then stay
+    // open, and at the same position, until the data is loaded.
+    Array(const char* filename, size_t max_dim = NPIO_DEFAULT_MAX_DIM
+      , int flags = 0)
+    {
+      construct_(filename, 0, max_dim, flags);
+    }
+
+
+    Array(int fd, size_t max_dim = NPIO_DEFAULT_MAX_DIM, int flags = 0)
+    {
+      construct_(fd, 0, max_dim, flags);
+    }
+
+
+    // Same as above, but all buffers come from alloc.
+    Array(const char* filename, const npio_Allocator& alloc
+      , size_t max_dim = NPIO_DEFAULT_MAX_DIM, int flags = 0)
+    {
+      construct_(filename, &alloc, max_dim, flags);
+    }
+
+
+    Array(int fd, const npio_Allocator& alloc
+      , size_t max_dim = NPIO_DEFAULT_MAX_DIM, int flags = 0)
+    {
+      construct_(fd, &alloc, max_dim, flags);
+    }
+
+
+    #ifdef NPIO_CXX_PMR
+    // Same as above, but all buffers come from the memory resource mr.
+    Array(const char* filename, std::pmr::memory_resource& mr
+      , size_t max_dim = NPIO_DEFAULT_MAX_DIM, int flags = 0)
+    {
+      npio_Allocator alloc = pmr_allocator(&mr);
+      construct_(filename, &alloc, max_dim, flags);
+    }
+
+
+    Array(int fd, std::pmr::memory_resource& mr
+      , size_t max_dim = NPIO_DEFAULT_MAX_DIM, int flags = 0)
+    {
+      npio_Allocator alloc = pmr_allocator(&mr);
+      construct_(fd, &alloc, max_dim, flags);
+    }
+    #endif
+
+
+    Array(void *p, size_t sz, size_t max_dim = NPIO_DEFAULT_MAX_DIM)
+      : data_state_(2)
+      , data_err_(0)
+    {
+      npio_init_array(&array);
+      #ifdef NPIO_CXX_ENABLE_EXCEPTIONS
+        if (int err = npio_load_mem4(p, sz, &array, max_dim))
+          throw std::system_error(err, std::system_category());
+      #else
+        err = npio_load_mem4(p, sz, &array, max_dim);
+      #endif
+    }
+
+
+    #if NPIO_CXX11
+    // Take over the mapping or buffers of other, which is left empty.
+    Array(Array&& other) noexcept
+      : data_state_(other.data_state_)
+      , data_err_(other.data_err_)
+    {
+      npio_move_array(&array, &other.array);
+      other.data_state_ = 2;
+      other.data_err_ = 0;
+      #ifndef NPIO_CXX_ENABLE_EXCEPTIONS
+        err = other.err;
+        other.err = 0;
+      #endif
+    }
+
+
+    Array& operator=(Array&& other) noexcept
+    {
+      if (this != &other)
+      {
+        npio_free_array(&array);
+        npio_move_array(&array, &other.array);
+        data_state_ = other.data_state_;
+        data_err_ = other.data_err_;
+        other.data_state_ = 2;
+        other.data_err_ = 0;
+        #ifndef NPIO_CXX_ENABLE_EXCEPTIONS
+          err = other.err;
+          other.err = 0;
+        #endif
+      }
+      return *this;
+    }
+
+
+    // Move this array into a reference counted handle. Copies of the handle
+    // share one mapping, which is released with the last of them.
+    std::shared_ptr<const Array> share()
+    {
+      return std::make_shared<const Array>(std::move(*this));
+    }
+
+
+    // Create filename for an array of T with the given shape and map it, for
+    // the caller to fill in through get<T>(). See npio_create_mapped.
+    template <class T>
+    static Array create_mapped(const char* filename, size_t dim
+      , const size_t* shape, bool fortran_order = false)
+    {
+      npio_Array desc;
+      npio_init_array(&desc);
+      set_type_<T>(desc);
+      desc.dim = dim;
+      desc.shape = (size_t*) shape;
+      desc.fortran_order = fortran_order;
+
+      Array a;
+      int e = npio_create_mapped(filename, &desc, &a.array);
+      #ifdef NPIO_CXX_ENABLE_EXCEPTIONS
+        if (e)
+          throw std::system_error(e, std::system_category());
+      #else
+        a.err = e;
+      #endif
+      return a;
+    }
+
+
+    template <class T>
+    static Array create_mapped(const char* filename
+      , std::initializer_list<size_t> shape, bool fortran_order = false)
+    {
+      return create_mapped<T>(filename, shape.size(), shape.begin()
+        , fortran_order);
+    }
+    #endif
+
+
+    // Write the data of a mapped array back to its file and wait for it.
+    int sync() const
+    {
+      return npio_sync_mapped(&array);
+    }
+
+
+    // Exchange the contents of two arrays.
+    void swap(Array& other)
+    {
+      npio_Array tmp;
+      npio_move_array(&tmp, &array);
+      npio_move_array(&array, &other.array);
+      npio_move_array(&other.array, &tmp);
+      int t = data_state_;
+      data_state_ = other.data_state_;
+      other.data_state_ = t;
+      t = data_err_;
+      data_err_ = other.data_err_;
+      other.data_err_ = t;
+      #ifndef NPIO_CXX_ENABLE_EXCEPTIONS
+        t = err;
+        err = other.err;
+        other.err = t;
+      #endif
+    }
+
+
+    // Read-only accessors
+
+    // Whether no array has been loaded into this object.
+    bool empty() const { return array.dtype == 0; }
+
+    #ifndef NPIO_CXX_ENABLE_EXCEPTIONS
+      // Get any error that occurred during construction.  You must check this
+      // if you are not using exceptions. For a lazy array, this includes any
+      // error from loading the data.
+      int error() const { return err ? err : data_err_; }
+    #endif
+
+    // Get the total number of elements
+    size_t size() const { return array.size; }
+
+    // Get the dimensionality of the array
+    size_t dim() const { return array.dim; }
+
+    // Whether the array is in fortran order
+    bool fortran_order() const { return array.fortran_order; }
+
+    // Whether the array is in little endian order
+    bool little_endian() const { return array.little_endian; }
+
+    // Whether the data type is a float type.
+    bool floating_point() const { return array.floating_point; }
+
+    // Whether the data is signed.
+    bool is_signed() const { return array.is_signed; }
+    bool is_complex() const { return array.is_complex; }
+    bool is_bfloat16() const { return array.is_bfloat16; }
+
+    // Number of bits per element.
+    size_t bit_width() const { return array.bit_width; }
+
+    // The number of fields of records, or 0.
+    size_t nfields() const { return array.nfields; }
+
+    // The size along each dimension.
+    const size_t* shape() const { return array.shape; }
+
+    // The raw data pointer, or null if the data could not be loaded.
+    const void* data() const { return loaded_data_(); }
+
+    // The major and minor version of the loaded file's format.
+    char major_version() const { return array.major_version; }
+    char minor_version() const { return array.minor_version; }
+
+    #ifdef NPIO_ENABLE_STATS
+    // How the array was loaded.
+    const npio_Stats& stats() const { return array.stats; }
+    #endif
+
+
+    // Some convenience functions
+
+
+    // Get the size along ith dimension.  Implicitly all dimensions are 1
+    // beyond the dimensionality of the array.
+    size_t shape(size_t i)
+    {
+      if (i < array.dim)
+        return array.shape[i];
+      else
+        return 1;
+    }
+
+
+    // Returns whether the underlying data is of the specified type T.
+    template <class T>
+    bool isType() const
+    {
+      return is_type_<T>(array);
+    }
+
+
+    // Get a typed pointer to the data.  If the type does not match the
+    // underlying data, throws a bad_cast if exceptions are enabled.
+    template <class T>
+    T* get() const
+    {
+      if (!isType<T>())
+      {
+        #ifdef NPIO_CXX_ENABLE_EXCEPTIONS
+          throw std::bad_cast();
+        #else
+          return 0;
+        #endif
+      }
+      return (T*) loaded_data_();
+    }
+
+
+    #if NPIO_CXX11
+      template <class T>
+      class ValueRange
+      {
+        T* _begin;
+        T* _end;
+
+        ValueRange(T* begin, T* end)
+          : _begin(begin)
+          , _end(end)
+        {}
+
+        friend class Array;
+
+        public:
+          ~ValueRange() = default;
+          T* begin() const { return _begin; }
+          T* end() const { return _end; }
+      };
+
+      // For C++11 range-based for loops
+      template <class T>
+      ValueRange<T> values() const
+      {
+        if (isType<T>())
+        {
+          T* p = (T*) loaded_data_();
+          return p ? ValueRange<T>(p, p + array.size) : ValueRange<T>(0, 0);
+        }
+        else
+        {
+          #ifdef NPIO_CXX_ENABLE_EXCEPTIONS
+            throw std::bad_cast();
+          #else
+            return ValueRange<T>(0, 0);
+          #endif
+        }
+      }
+
+    #endif
+
+
+    // A view of the data with N dimensions, with the strides of C or Fortran
+    // order as given by the header. If T is not the type of the data or N is
+    // not its dimension, throws a bad_cast if exceptions are enabled and
+    // returns an empty view otherwise.
+    template <class T, size_t N>
+    View<T, N> view() const
+    {
+      if (!isType<T>() || array.dim != N)
+      {
+        #ifdef NPIO_CXX_ENABLE_EXCEPTIONS
+          throw std::bad_cast();
+        #else
+          return View<T, N>();
+        #endif
+      }
+      T* p = (T*) loaded_data_();
+      return p ? View<T, N>(p, array.shape, array.fortran_order)
+        : View<T, N>();
+    }
+
+
+    // Copy the data into out, converting it to type T on the way. out must
+    // have room for size() elements. Returns an error code, or throws if
+    // exceptions are enabled.
+    template <class T>
+    int copy_to(T* out) const
+    {
+      npio_Array to;
+      npio_init_array(&to);
+      set_type_<T>(to);
+      int err = load_data_();
+      if (!err)
+        err = npio_convert(&array, array.data, &to, out, array.size);
+      #ifdef NPIO_CXX_ENABLE_EXCEPTIONS
+        if (err)
+          throw std::system_error(err, std::system_category());
+      #endif
+      return err;
+    }
+
+
+    // Save the array back to file
+    int save(const char* filename)
+    {
+      int e = load_data_();
+      return e ? e : npio_save(filename, &array);
+    }
+
+
+    // Save the array back to fd
+    int save(int fd)
+    {
+      int e = load_data_();
+      return e ? e : npio_save_fd(fd, &array);
+    }
+
+
+    // Load the data of a lazy array now, if not done yet. Returns an error
+    // code, and never throws.
+    int load_data() const
+    {
+      return load_data_();
+    }
+
+
+    // Start reading ahead rows begin to end along axis 0, for an access that
+    // is coming soon. See npio_prefetch.
+    int prefetch(size_t begin, size_t end) const
+    {
+      return npio_prefetch(&array, begin, end);
+    }
+
+
+    ~Array()
+    {
+      npio_free_array(&array);
+    }
+};
+
+
+#if NPIO_CXX11
+  // A shared, read-only handle to a loaded array. Copying it only bumps a
+  // reference count, so it can be handed to many consumers and threads.
+  typedef std::shared_ptr<const Array> SharedArray;
+
+
+// An array whose element type T and dimension N are checked once, when it is
+// constructed, rather than by every access. After that, data() and element
+// access are plain pointer arithmetic. If the type or dimension does not
+// match, throws a bad_cast if exceptions are enabled, and is otherwise empty,
+// with the array still available through array().
+template <class T, size_t N>
+class TypedArray
+{
+  private:
+    Array array_;
+    View<T, N> view_;
+
+    void check_()
+    {
+      if (array_.isType<T>() && array_.dim() == N)
+        view_ = array_.view<T, N>();
+      #ifdef NPIO_CXX_ENABLE_EXCEPTIONS
+        else
+          throw std::bad_cast();
+      #endif
+    }
+
+  public:
+    typedef T value_type;
+    typedef Traits<T> traits;
+    static const size_t rank = N;
+
+    TypedArray() {}
+
+    explicit TypedArray(Array&& array)
+      : array_(std::move(array))
+    {
+      check_();
+    }
+
+    TypedArray(TypedArray&& other)
+      : array_(std::move(other.array_))
+      , view_(other.view_)
+    {
+      other.view_ = View<T, N>();
+    }
+
+    TypedArray& operator=(TypedArray&& other)
+    {
+      array_ = std::move(other.array_);
+      view_ = other.view_;
+      other.view_ = View<T, N>();
+      return *this;
+    }
+
+    // Load filename, with the flags of Array.
+    explicit TypedArray(const char* filename, int flags = 0)
+      : array_(filename, N > NPIO_DEFAULT_MAX_DIM ? N : NPIO_DEFAULT_MAX_DIM
+        , flags)
+    {
+      check_();
+    }
+
+    // Whether the type and dimension did not match, or nothing was loaded.
+    bool empty() const { return view_.data() == 0; }
+
+    const Array& array() const { return array_; }
+    T* data() const { return view_.data(); }
+    size_t size() const { return view_.size(); }
+    size_t shape(size_t i) const { return view_.shape(i); }
+    const View<T, N>& view() const { return view_; }
+
+    // The elements in memory order.
+    T* begin() const { return view_.data(); }
+    T* end() const { return view_.data() + view_.size(); }
+
+    // Element access in C or Fortran order, as given by the file.
+    template <class... I>
+    T& operator()(I... i) const { return view_(i...); }
+    typename ViewRow_<T, N>::type operator[](size_t i) const
+    {
+      return view_[i];
+    }
+};
+
+
+// Call f once with a pointer to the data of array, typed as its elements:
+// one of the fixed width integers, float16, bfloat16, float, double or their
+// complex types. f is typically a generic lambda, so that its body is compiled
+// for each type, with no checks left inside it; all calls must return the
+// same type. Records are not visited. If the data is not one of these types,
+// or cannot be loaded, throws a bad_cast if exceptions are enabled, and
+// otherwise returns a value-initialized result without calling f.
+template <class F>
+auto visit(const Array& array, F&& f) -> decltype(f((double*) 0))
+{
+  #define NPIO_VISIT_(T) \
+    if (array.isType<T>()) \
+      if (T* p = array.get<T>()) \
+        return f(p);
+
+  if (!array.empty())
+  {
+    if (!array.floating_point())
+    {
+      if (array.is_signed())
+      {
+        switch (array.bit_width())
+        {
+          case 8: NPIO_VISIT_(int8_t) break;
+          case 16: NPIO_VISIT_(int16_t) break;
+          case 32: NPIO_VISIT_(int32_t) break;
+          case 64: NPIO_VISIT_(int64_t) break;
+        }
+      }
+      else
+      {
+        switch (array.bit_width())
+        {
+          case 8: NPIO_VISIT_(uint8_t) break;
+          case 16: NPIO_VISIT_(uint16_t) break;
+          case 32: NPIO_VISIT_(uint32_t) break;
+          case 64: NPIO_VISIT_(uint64_t) break;
+        }
+      }
+    }
+    else if (array.is_complex())
+    {
+      switch (array.bit_width())
+      {
+        case 64: NPIO_VISIT_(std::complex<float>) break;
+        case 128: NPIO_VISIT_(std::complex<double>) break;
+      }
+    }
+    else
+    {
+      switch (array.bit_width())
+      {
+        case 16:
+          NPIO_VISIT_(float16)
+          NPIO_VISIT_(bfloat16)
+          break;
+        case 32: NPIO_VISIT_(float) break;
+        case 64: NPIO_VISIT_(double) break;
+      }
+    }
+  }
+  #undef NPIO_VISIT_
+
+  #ifdef NPIO_CXX_ENABLE_EXCEPTIONS
+    throw std::bad_cast();
+  #else
+    return decltype(f((double*) 0))();
+  #endif
+}
+
+
+// A thread-safe cache of loaded arrays, keyed by the identity of the file:
+// its device, inode, size and modification time. get() returns the cached
+// array while the file is unchanged, and otherwise loads it. The least
+// recently used arrays are dropped once their files add up to more than the
+// byte budget. Dropping only releases the cache's reference, so arrays still
+// held elsewhere stay valid.
+//
+// Files are mapped, so replace them by renaming a new file over them rather
+// than rewriting them in place, which would change or truncate the data of
+// arrays already handed out.
+class MappingCache
+{
+  private:
+    struct Key
+    {
+      dev_t dev;
+      ino_t ino;
+      off_t size;
+      time_t mtime;
+      long mtime_nsec;
+
+      explicit Key(const struct stat& st)
+        : dev(st.st_dev), ino(st.st_ino), size(st.st_size)
+        , mtime(st.st_mtim.tv_sec), mtime_nsec(st.st_mtim.tv_nsec)
+      {}
+
+      bool operator<(const Key& k) const
+      {
+        if (dev != k.dev) return dev < k.dev;
+        if (ino != k.ino) return ino < k.ino;
+        if (size != k.size) return size < k.size;
+        if (mtime != k.mtime) return mtime < k.mtime;
+        return mtime_nsec < k.mtime_nsec;
+      }
+    };
+
+    struct Entry
+    {
+      Key key;
+      SharedArray array;
+      std::string filename;  // As given to get()
+    };
+
+    typedef std::list<Entry> List;
+
+    mutable std::mutex mutex_;
+    List lru_;  // Most recently used first
+    std::map<Key, List::iterator> index_;
+    size_t budget_;
+    size_t bytes_;
+    size_t hits_;
+    size_t misses_;
+
+    MappingCache(const MappingCache&) = delete;
+    MappingCache& operator=(const MappingCache&) = delete;
+
+    // Drop the least recently used entries until we are within budget.
+    // The caller holds the lock.
+    void evict_()
+    {
+      while (bytes_ > budget_ && !lru_.empty())
+        erase_(--lru_.end());
+    }
+
+    void erase_(List::iterator i)
+    {
+      bytes_ -= i->key.size;
+      index_.erase(i->key);
+      lru_.erase(i);
+    }
+
+    // Return the cached array for key, if any, and mark it as recently used.
+    // The caller holds the lock.
+    SharedArray find_(const Key& key)
+    {
+      std::map<Key, List::iterator>::iterator i = index_.find(key);
+      if (i == index_.end())
+        return SharedArray();
+      lru_.splice(lru_.begin(), lru_, i->second);
+      return i->second->array;
+    }
+
+    static SharedArray fail_(int err)
+    {
+      #ifdef NPIO_CXX_ENABLE_EXCEPTIONS
+        throw std::system_error(err, std::system_category());
+      #else
+        errno = err;
+        return SharedArray();
+      #endif
+    }
+
+
+  public:
+    // budget is the total size of the files to keep, in bytes.
+    explicit MappingCache(size_t budget)
+      : budget_(budget), bytes_(0), hits_(0), misses_(0)
+    {}
+
+
+    // Get the array in filename, loaded with the NPIO_MAP_* and NPIO_MADV_*
+    // flags. A hit costs a stat, and a miss loads the file without holding
+    // the lock. On failure, throws if exceptions are enabled, and otherwise
+    // returns a null handle and sets errno.
+    SharedArray get(const char* filename, int flags = NPIO_MAP_SHARED
+      , size_t max_dim = NPIO_DEFAULT_MAX_DIM)
+    {
+      struct stat st;
+      SharedArray array;
+
+      if (stat(filename, &st))
+        return fail_(errno);
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if ((array = find_(Key(st))))
+        {
+          ++hits_;
+          return array;
+        }
+        ++misses_;
+      }
+
+      // Key on what we actually opened, in case the file was just replaced.
+      int fd = open(filename, O_RDONLY);
+      if (fd < 0)
+        return fail_(errno);
+      if (fstat(fd, &st))
+      {
+        int err = errno;
+        close(fd);
+        return fail_(err);
+      }
+
+      #ifdef NPIO_CXX_ENABLE_EXCEPTIONS
+        try
+        {
+          array = std::make_shared<const Array>(fd, max_dim
+            , flags & ~(NPIO_KEEP_FD | NPIO_LAZY));
+        }
+        catch (...)
+        {
+          close(fd);
+          throw;
+        }
+        close(fd);
+      #else
+        std::shared_ptr<Array> loaded = std::make_shared<Array>(fd, max_dim
+          , flags & ~(NPIO_KEEP_FD | NPIO_LAZY));
+        close(fd);
+        if (int err = loaded->error())
+          return fail_(err);
+        array = loaded;
+      #endif
+
+      // Another thread may have loaded the same file in the meantime.
+      std::lock_guard<std::mutex> lock(mutex_);
+      Key key(st);
+      if (SharedArray cached = find_(key))
+        return cached;
+      Entry entry = {key, array, filename};
+      lru_.push_front(entry);
+      index_[key] = lru_.begin();
+      bytes_ += key.size;
+      evict_();
+      return array;
+    }
+
+
+    // Drop every cached version of filename: whatever was loaded under that
+    // name, even if the file has since been deleted or replaced, and anything
+    // loaded under another name for the file it names now.
+    void invalidate(const char* filename)
+    {
+      struct stat st;
+      bool exists = stat(filename, &st) == 0;
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (List::iterator i = lru_.begin(); i != lru_.end(); )
+      {
+        List::iterator next = i;
+        ++next;
+        if (i->filename == filename || (exists && i->key.dev == st.st_dev
+          && i->key.ino == st.st_ino))
+          erase_(i);
+        i = next;
+      }
+    }
+
+
+    // Drop everything.
+    void clear()
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      lru_.clear();
+      index_.clear();
+      bytes_ = 0;
+    }
+
+
+    // Change the budget, evicting as needed.
+    void set_budget(size_t budget)
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      budget_ = budget;
+      evict_();
+    }
+
+
+    // The number of cached arrays, and the total size of their files.
+    size_t size() const
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return lru_.size();
+    }
+
+    size_t bytes() const
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return bytes_;
+    }
+
+    // The number of calls to get() that found, or did not find, the file.
+    size_t hits() const
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return hits_;
+    }
+
+    size_t misses() const
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return misses_;
+    }
+};
+
+
+// An array made of many npy files, the shards, concatenated along axis 0, as
+// datasets written in parts often are. The shards must share the element type
+// and the shape past axis 0, and be in C order. Records are not supported.
+// Constructing it only reads their headers with npio_stat, or nothing at all
+// when they are looked up in an index built by npio_index_build. Shards are
+// then loaded when first accessed, and at most max_open of them are kept
+// loaded. Beyond that, the least recently used are released, which only drops
+// our reference, so chunks and handles held elsewhere stay valid. All members
+// are thread-safe.
+//
+// If the shards do not match, or a header cannot be read, the constructor
+// throws if exceptions are enabled, and otherwise sets error(). Later
+// failures to load a shard throw, or make the call fail with the error code.
+class ShardedArray
+{
+  private:
+    struct Shard
+    {
+      std::string path;
+      size_t row;   // The first row in the whole array
+      size_t rows;  // The number of rows in this shard
+    };
+
+    std::vector<Shard> shards_;
+    npio_Info info_;  // The first header, with the shape of the whole array
+    size_t row_size_;  // The number of bytes in a row
+    size_t max_open_;
+    int flags_;
+
+    mutable std::mutex mutex_;
+    mutable std::vector<SharedArray> loaded_;
+    mutable std::list<size_t> open_;  // Loaded shards, most recent first
+    mutable std::vector<std::list<size_t>::iterator> open_pos_;
+
+    #ifndef NPIO_CXX_ENABLE_EXCEPTIONS
+      int err_;
+    #endif
+
+    ShardedArray(const ShardedArray&) = delete;
+    ShardedArray& operator=(const ShardedArray&) = delete;
+
+    // Whether a shard can follow the first one.
+    bool matches_(const npio_Info& info) const
+    {
+      if (info.dim != info_.dim || info.floating_point != info_.floating_point
+        || info.is_signed != info_.is_signed
+        || info.bit_width != info_.bit_width
+        || info.is_complex != info_.is_complex
+        || info.is_bfloat16 != info_.is_bfloat16)
+        return false;
+      for (size_t i = 1; i < info.dim; ++i)
+        if (info.shape[i] != info_.shape[i])
+          return false;
+      return true;
+    }
+
+    int scan_(const std::vector<std::string>& paths, const npio_Index* index)
+    {
+      npio_Info info;
+      size_t rows = 0;
+
+      if (paths.empty())
+        return EINVAL;
+      shards_.reserve(paths.size());
+      for (size_t i = 0; i < paths.size(); ++i)
+      {
+        const char* path = paths[i].c_str();
+        if (int err = index ? npio_index_find(index, path, &info)
+          : npio_stat(path, &info))
+          return err;
+        if (info.dim == 0 || (info.fortran_order && info.dim > 1))
+          return EINVAL;
+        if (info.dtype[0] == '[')
+          return ENOTSUP;
+        if (i == 0)
+          info_ = info;
+        else if (!matches_(info))
+          return EINVAL;
+
+        Shard shard = {paths[i], rows, info.shape[0]};
+        shards_.push_back(shard);
+        rows += info.shape[0];
+      }
+
+      row_size_ = info_.bit_width / 8;
+      for (size_t i = 1; i < info_.dim; ++i)
+        row_size_ *= info_.shape[i];
+      info_.shape[0] = rows;
+      info_.size = rows * (row_size_ / (info_.bit_width / 8));
+      info_.data_offset = 0;
+      info_.file_size = 0;
+      loaded_.resize(shards_.size());
+      open_pos_.resize(shards_.size());
+      return 0;
+    }
+
+    void construct_(const std::vector<std::string>& paths
+      , const npio_Index* index)
+    {
+      int err = scan_(paths, index);
+      if (err)
+        shards_.clear();
+      #ifdef NPIO_CXX_ENABLE_EXCEPTIONS
+        if (err)
+          throw std::system_error(err, std::system_category());
+      #else
+        err_ = err;
+      #endif
+    }
+
+    static SharedArray fail_(int err)
+    {
+      #ifdef NPIO_CXX_ENABLE_EXCEPTIONS
+        throw std::system_error(err, std::system_category());
+      #else
+        errno = err;
+        return SharedArray();
+      #endif
+    }
+
+    // Mark shard i as recently used. The caller holds the lock.
+    void touch_(size_t i) const
+    {
+      open_.splice(open_.begin(), open_, open_pos_[i]);
+    }
+
+
+  public:
+    // The largest number of shards kept loaded by default.
+    static const size_t default_max_open = 64;
+
+    // Open the shards in paths, in that order, with the NPIO_MAP_* and
+    // NPIO_MADV_* flags for loading them.
+    explicit ShardedArray(const std::vector<std::string>& paths
+      , size_t max_open = default_max_open, int flags = NPIO_MAP_SHARED)
+      : row_size_(0), max_open_(max_open), flags_(flags)
+    {
+      construct_(paths, 0);
+    }
+
+    // Same as above, taking the headers from index instead of the files.
+    ShardedArray(const std::vector<std::string>& paths, const npio_Index& index
+      , size_t max_open = default_max_open, int flags = NPIO_MAP_SHARED)
+      : row_size_(0), max_open_(max_open), flags_(flags)
+    {
+      construct_(paths, &index);
+    }
+
+    #ifndef NPIO_CXX_ENABLE_EXCEPTIONS
+      // Get any error that occurred during construction.
+      int error() const { return err_; }
+    #endif
+
+    // The type and shape of the whole array, as one header would give them.
+    const npio_Info& info() const { return info_; }
+    size_t dim() const { return info_.dim; }
+    const size_t* shape() const { return info_.shape; }
+    size_t shape(size_t i) const { return i < info_.dim ? info_.shape[i] : 1; }
+    size_t size() const { return info_.size; }
+    size_t rows() const { return info_.shape[0]; }
+    size_t row_size() const { return row_size_; }
+
+    template <class T>
+    bool isType() const
+    {
+      return Traits<T>::floating_point == (bool) info_.floating_point
+        && Traits<T>::is_signed == (bool) info_.is_signed
+        && Traits<T>::is_complex == (bool) info_.is_complex
+        && Traits<T>::is_bfloat16 == (bool) info_.is_bfloat16
+        && Traits<T>::bit_width == (size_t) info_.bit_width;
+    }
+
+    // The shards, and where they are in the whole array.
+    size_t nshards() const { return shards_.size(); }
+    const char* path(size_t i) const { return shards_[i].path.c_str(); }
+    size_t shard_row(size_t i) const { return shards_[i].row; }
+    size_t shard_rows(size_t i) const { return shards_[i].rows; }
+
+    // The shard that holds row, which must be below rows().
+    size_t find(size_t row) const
+    {
+      size_t lo = 0, hi = shards_.size(), mid;
+
+      // The last shard that starts at or before row, skipping empty ones.
+      while (hi - lo > 1)
+      {
+        mid = lo + (hi - lo) / 2;
+        if (shards_[mid].row <= row)
+          lo = mid;
+        else
+          hi = mid;
+      }
+      return lo;
+    }
+
+    // The number of shards currently loaded.
+    size_t open_shards() const
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return open_.size();
+    }
+
+    // Change the number of shards kept loaded, releasing some as needed.
+    void set_max_open(size_t max_open)
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      max_open_ = max_open;
+      while (open_.size() > max_open_)
+      {
+        loaded_[open_.back()].reset();
+        open_.pop_back();
+      }
+    }
 
 
-namespace npio
-{
+    // Get shard i, loading it if needed. The load happens without holding
+    // the lock, so threads can load different shards at once. On failure,
+    // throws if exceptions are enabled, and otherwise returns a null handle
+    // and sets errno.
+    SharedArray shard(size_t i) const
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (loaded_[i])
+        {
+          touch_(i);
+          return loaded_[i];
+        }
+      }
 
+      std::shared_ptr<Array> loaded = std::make_shared<Array>(path(i)
+        , info_.dim, flags_ & ~(NPIO_KEEP_FD | NPIO_LAZY));
+      #ifndef NPIO_CXX_ENABLE_EXCEPTIONS
+        if (int err = loaded->error())
+          return fail_(err);
+      #endif
 
-// Not relying on C++11 type_traits for compatibilty with legacy code-bases.
+      // The file may have been replaced since its header was read.
+      npio_Info info;
+      memset(&info, 0, sizeof(info));
+      info.dim = loaded->dim();
+      memcpy(info.shape, loaded->shape(), info.dim * sizeof(size_t));
+      info.floating_point = loaded->floating_point();
+      info.is_signed = loaded->is_signed();
+      info.bit_width = loaded->bit_width();
+      info.is_complex = loaded->is_complex();
+      info.is_bfloat16 = loaded->is_bfloat16();
+      if (!matches_(info) || info.shape[0] != shards_[i].rows
+        || (loaded->fortran_order() && info.dim > 1) || loaded->nfields())
+        return fail_(EINVAL);
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (loaded_[i])
+      {
+        touch_(i);
+        return loaded_[i];
+      }
+      loaded_[i] = loaded;
+      open_.push_front(i);
+      open_pos_[i] = open_.begin();
+      while (open_.size() > max_open_ && open_.size() > 1)
+      {
+        loaded_[open_.back()].reset();
+        open_.pop_back();
+      }
+      return loaded_[i];
+    }
 
 
-//For integral types.
-template <class T>
-struct Traits
-{
-  static const bool is_signed = T(-1) < T(0);
-  static const bool floating_point = false;
-  static const size_t bit_width = sizeof(T) * 8;
-  static const char spec = is_signed ? 'i' : 'u';
-};
+    // Copy rows [begin, end) into out, which must have room for
+    // (end - begin) * row_size() bytes, loading the shards they come from.
+    // Returns an error code, or throws if exceptions are enabled.
+    int read_rows(size_t begin, size_t end, void* out) const
+    {
+      char* p = (char*) out;
 
+      if (begin > end || end > rows())
+      {
+        #ifdef NPIO_CXX_ENABLE_EXCEPTIONS
+          throw std::system_error(ERANGE, std::system_category());
+        #else
+          return ERANGE;
+        #endif
+      }
+      while (begin < end)
+      {
+        size_t i = find(begin);
+        SharedArray array = shard(i);
+        const char* data = array ? (const char*) array->data() : 0;
+        #ifndef NPIO_CXX_ENABLE_EXCEPTIONS
+          if (!data)
+            return array ? array->error() : errno;
+        #endif
 
-template <>
-struct Traits<float>
-{
-  static const bool is_signed = true;
-  static const bool floating_point = true;
-  static const size_t bit_width = 32;
-  static const char spec = 'f';
-};
+        size_t first = begin - shards_[i].row;
+        size_t n = shards_[i].rows - first;
+        if (n > end - begin)
+          n = end - begin;
+        memcpy(p, data + first * row_size_, n * row_size_);
+        p += n * row_size_;
+        begin += n;
+      }
+      return 0;
+    }
 
 
-template <>
-struct Traits<double>
-{
-  static const bool is_signed = true;
-  static const bool floating_point = true;
-  static const size_t bit_width = 64;
-  static const char spec = 'f';
-};
+    // A run of rows within one shard, pointing into its data. The handle
+    // keeps the shard loaded for as long as the chunk is held.
+    template <class T>
+    struct Chunk
+    {
+      const T* data;      // The rows, in the shard's data.
+      size_t rows;        // The number of rows in this chunk.
+      size_t row;         // The index of the first row in the whole array.
+      SharedArray shard;
+    };
 
+    template <class T>
+    class ChunkIterator
+    {
+      const ShardedArray* _array;
+      size_t _end;
+      int* _err;  // Where to report a shard that fails to load
+      Chunk<T> _chunk;
+
+      ChunkIterator(const ShardedArray* array, size_t begin, size_t end
+        , int* err)
+        : _array(array)
+        , _end(end)
+        , _err(err)
+      {
+        _chunk.row = begin;
+        _chunk.rows = 0;
+        load_();
+      }
 
-// Save the array specicied by nDim, shape and data to a file descriptor
-// opened for writing.
-template <class T>
-int save(int fd, size_t nDim, const size_t *shape, const T* data)
-{
-  npio_Array array;
-  npio_init_array(&array);
-  array.dim = nDim;
-  array.shape = (size_t*) shape;
-  array.floating_point = Traits<T>::floating_point;
-  array.is_signed = Traits<T>::is_signed;
-  array.bit_width = Traits<T>::bit_width;
-  array.data = (char*) data;
+      // Point the chunk at the rows from _chunk.row on, or stop at _end if
+      // there are none left or the shard cannot be loaded, in which case the
+      // error is kept in *_err.
+      void load_()
+      {
+        _chunk.data = 0;
+        _chunk.rows = 0;
+        _chunk.shard.reset();
+        if (_chunk.row >= _end)
+        {
+          _chunk.row = _end;
+          return;
+        }
 
-  return npio_save_fd(fd, &array);
-}
+        size_t i = _array->find(_chunk.row);
+        SharedArray shard = _array->shard(i);
+        const T* data = shard ? (const T*) shard->data() : 0;
+        if (!data)
+        {
+          #ifndef NPIO_CXX_ENABLE_EXCEPTIONS
+            if (_err)
+              *_err = shard ? shard->error() : errno;
+          #endif
+          _chunk.row = _end;
+          return;
+        }
 
+        size_t first = _chunk.row - _array->shard_row(i);
+        size_t n = _array->shard_rows(i) - first;
+        _chunk.data = (const T*) ((const char*) data
+          + first * _array->row_size());
+        _chunk.rows = n < _end - _chunk.row ? n : _end - _chunk.row;
+        _chunk.shard = shard;
+      }
 
-#if NPIO_CXX11
-// Same as above, but with initializer_list for convenience
-template <class T>
-int save(int fd, std::initializer_list<size_t> shape, const T* data)
-{
-  return save(fd, shape.size(), shape.begin(), data);
-}
-#endif
+      friend class ShardedArray;
 
+      public:
+        const Chunk<T>& operator*() const { return _chunk; }
+        const Chunk<T>* operator->() const { return &_chunk; }
 
-// Save the array specified by nDim, shape and data to the specified file.
-template <class T>
-int save(const char* fn, size_t nDim, const size_t *shape, const T* data)
-{
-  int fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-  if (fd < 0)
-    return errno;
-  int ret = save(fd, nDim, shape, data);
-  close(fd);
-  return ret;
-}
+        ChunkIterator& operator++()
+        {
+          _chunk.row += _chunk.rows;
+          load_();
+          return *this;
+        }
 
+        bool operator==(const ChunkIterator& o) const { return _chunk.row == o._chunk.row; }
+        bool operator!=(const ChunkIterator& o) const { return _chunk.row != o._chunk.row; }
+    };
 
-#if NPIO_CXX11
-// Same as above, but with initializer_list
-template <class T>
-int save(const char* fn, std::initializer_list<size_t> shape, const T* data)
-{
-  return save(fn, shape.size(), shape.begin(), data);
-}
+    template <class T>
+    class ChunkRange
+    {
+      const ShardedArray* _array;
+      size_t _begin;
+      size_t _end;
+      mutable int _err;
+
+      ChunkRange(const ShardedArray* array, size_t begin, size_t end, int err)
+        : _array(array)
+        , _begin(begin)
+        , _end(end)
+        , _err(err)
+      {}
+
+      friend class ShardedArray;
+
+      public:
+        ChunkIterator<T> begin() const { return ChunkIterator<T>(_array, _begin, _end, &_err); }
+        ChunkIterator<T> end() const { return ChunkIterator<T>(_array, _end, _end, 0); }
+
+        // Without exceptions, the error that ended the iteration early, if
+        // any: EINVAL if T is not the element type, or the error from
+        // loading a shard.
+        int error() const { return _err; }
+    };
+
+    // For range-based for loops over rows [begin, end), one chunk per shard
+    // that they span, without copying.
+    //
+    //   for (auto& chunk : sharded.chunks<float>(0, sharded.rows()))
+    //     process(chunk.data, chunk.rows);
+    //
+    // If T is not the element type, throws a bad_cast if exceptions are
+    // enabled, and is otherwise empty. A shard that fails to load throws, or
+    // ends the iteration with the range's error() set.
+    //
+    //   auto range = sharded.chunks<float>(0, sharded.rows());
+    //   for (auto& chunk : range)
+    //     process(chunk.data, chunk.rows);
+    //   if (range.error())
+    //     ...
+    template <class T>
+    ChunkRange<T> chunks(size_t begin, size_t end) const
+    {
+      int err = 0;
+      if (end > rows())
+        end = rows();
+      if (begin > end)
+        begin = end;
+      if (!isType<T>())
+      {
+        #ifdef NPIO_CXX_ENABLE_EXCEPTIONS
+          throw std::bad_cast();
+        #else
+          begin = end;
+          err = EINVAL;
+        #endif
+      }
+      return ChunkRange<T>(this, begin, end, err);
+    }
+};
 #endif
 
 
-// Simple untyped class wrapper for npio_load*
-class Array
+
+// Streaming writer that appends rows of type T along axis 0.
+template <class T>
+class Writer
 {
   private:
-    npio_Array array;
+    npio_Writer writer;
 
     #ifndef NPIO_CXX_ENABLE_EXCEPTIONS
       int err;
     #endif
 
+    // Not copyable
+    Writer(const Writer&);
+    Writer& operator=(const Writer&);
 
-  public:
-    Array(const char* filename, size_t max_dim = NPIO_DEFAULT_MAX_DIM)
+    int check_(int e)
     {
-      npio_init_array(&array);
       #ifdef NPIO_CXX_ENABLE_EXCEPTIONS
-        if (int err = npio_load3(filename, &array, max_dim))
-          throw std::system_error(err, std::system_category());
+        if (e)
+          throw std::system_error(e, std::system_category());
       #else
-        err = npio_load3(filename, &array, max_dim);
+        err = e;
       #endif
+      return e;
     }
 
+    static npio_Array describe_(size_t nDim, const size_t* row_shape)
+    {
+      npio_Array desc;
+      npio_init_array(&desc);
+      desc.dim = nDim;
+      desc.shape = (size_t*) row_shape;
+      set_type_<T>(desc);
+      return desc;
+    }
 
-    Array(int fd, size_t max_dim = NPIO_DEFAULT_MAX_DIM)
+
+  public:
+    // row_shape gives the trailing dimensions, i.e. the shape of one row.
+    Writer(const char* filename, size_t nDim, const size_t* row_shape)
     {
-      npio_init_array(&array);
-      #ifdef NPIO_CXX_ENABLE_EXCEPTIONS
-        if (int err = npio_load_fd3(fd, &array, max_dim))
-          throw std::system_error(err, std::system_category());
-      #else
-        err = npio_load_fd3(fd, &array, max_dim);
-      #endif
+      npio_Array desc = describe_(nDim, row_shape);
+      check_(npio_writer_open(&writer, filename, &desc));
     }
 
 
-    Array(void *p, size_t sz, size_t max_dim = NPIO_DEFAULT_MAX_DIM)
+    Writer(int fd, size_t nDim, const size_t* row_shape)
     {
-      npio_init_array(&array);
-      #ifdef NPIO_CXX_ENABLE_EXCEPTIONS
-        if (int err = npio_load_mem4(p, sz, &array, max_dim))
-          throw std::system_error(err, std::system_category());
-      #else
-        err = npio_load_mem4(p, sz, &array, max_dim);
-      #endif
+      npio_Array desc = describe_(nDim, row_shape);
+      check_(npio_writer_open_fd(&writer, fd, &desc));
     }
 
 
-    // Read-only accessors
+    #if NPIO_CXX11
+      Writer(const char* filename, std::initializer_list<size_t> row_shape)
+      {
+        npio_Array desc = describe_(row_shape.size(), row_shape.begin());
+        check_(npio_writer_open(&writer, filename, &desc));
+      }
+
+
+      Writer(int fd, std::initializer_list<size_t> row_shape)
+      {
+        npio_Array desc = describe_(row_shape.size(), row_shape.begin());
+        check_(npio_writer_open_fd(&writer, fd, &desc));
+      }
+    #endif
+
 
     #ifndef NPIO_CXX_ENABLE_EXCEPTIONS
-      // Get any error that occurred during construction.  You must check this
-      // if you are not using exceptions.
+      // Get the last error that occurred.  You must check this if you are not
+      // using exceptions.
       int error() const { return err; }
     #endif
 
-    // Get the total number of elements
-    size_t size() const { return array.size; }
+    // The number of rows written so far.
+    size_t rows() const { return writer.array.shape ? writer.array.shape[0] : 0; }
 
-    // Get the dimensionality of the array
-    size_t dim() const { return array.dim; }
 
-    // Whether the array is in fortran order
-    bool fortran_order() const { return array.fortran_order; }
+    // Append rows, each holding one row's worth of elements.
+    int append(const T* data, size_t rows)
+    {
+      return check_(npio_writer_append(&writer, data, rows));
+    }
 
-    // Whether the array is in little endian order
-    bool little_endian() const { return array.little_endian; }
 
-    // Whether the data type is a float type.
-    bool floating_point() const { return array.floating_point; }
+    // Finalize the header and close. This also happens on destruction, but
+    // errors can only be seen if you call it explicitly.
+    int close()
+    {
+      return check_(npio_writer_close(&writer));
+    }
 
-    // Whether the data is signed.
-    bool is_signed() const { return array.is_signed; }
 
-    // Number of bits per element.
-    size_t bit_width() const { return array.bit_width; }
+    ~Writer()
+    {
+      npio_writer_close(&writer);
+    }
+};
 
-    // The size along each dimension.
-    const size_t* shape() const { return array.shape; }
 
-    // The raw data pointer.
-    const void* data() const { return array.data; }
+// Streaming reader over the rows of an array along axis 0.
+class Reader
+{
+  private:
+    npio_Reader reader;
 
-    // The major and minor version of the loaded file's format.
-    char major_version() const { return array.major_version; }
-    char minor_version() const { return array.minor_version; }
+    #ifndef NPIO_CXX_ENABLE_EXCEPTIONS
+      int err;
+    #endif
 
+    // Not copyable
+    Reader(const Reader&);
+    Reader& operator=(const Reader&);
 
-    // Some convenience functions
+    int check_(int e)
+    {
+      #ifdef NPIO_CXX_ENABLE_EXCEPTIONS
+        if (e)
+          throw std::system_error(e, std::system_category());
+      #else
+        err = e;
+      #endif
+      return e;
+    }
 
 
-    // Get the size along ith dimension.  Implicitly all dimensions are 1
-    // beyond the dimensionality of the array.
-    size_t shape(size_t i)
+  public:
+    Reader(const char* filename, size_t max_dim = NPIO_DEFAULT_MAX_DIM)
     {
-      if (i < array.dim)
-        return array.shape[i];
-      else
-        return 1;
+      check_(npio_reader_open(&reader, filename, max_dim));
+    }
+
+
+    Reader(int fd, size_t max_dim = NPIO_DEFAULT_MAX_DIM)
+    {
+      check_(npio_reader_open_fd(&reader, fd, max_dim));
     }
 
 
+    #ifndef NPIO_CXX_ENABLE_EXCEPTIONS
+      // Get the last error that occurred.  You must check this if you are not
+      // using exceptions.
+      int error() const { return err; }
+    #endif
+
+    // The header of the array being read.
+    size_t dim() const { return reader.array.dim; }
+    const size_t* shape() const { return reader.array.shape; }
+    size_t size() const { return reader.array.size; }
+
+    // The number of rows, the size of a row in elements, and the number of
+    // rows read so far.
+    size_t rows() const { return reader.rows; }
+    size_t row_size() const { return reader.row_size * 8 / reader.array.bit_width; }
+    size_t row() const { return reader.row; }
+
+
     // Returns whether the underlying data is of the specified type T.
     template <class T>
     bool isType() const
     {
-      return Traits<T>::floating_point == array.floating_point
-        && Traits<T>::is_signed == array.is_signed
-        && Traits<T>::bit_width == array.bit_width;
+      return is_type_<T>(reader.array);
     }
 
 
-    // Get a typed pointer to the data.  If the type does not match the
-    // underlying data, throws a bad_cast if exceptions are enabled.
+    // Read up to max_rows rows into buf, which must have room for
+    // max_rows * row_size() elements. Returns the number of rows read, which
+    // is zero at the end or on error.
     template <class T>
-    T* get() const
+    size_t next(T* buf, size_t max_rows)
     {
+      size_t n = 0;
       if (!isType<T>())
       {
         #ifdef NPIO_CXX_ENABLE_EXCEPTIONS
           throw std::bad_cast();
         #else
+          err = EINVAL;
           return 0;
         #endif
       }
-      return (T*) array.data;
+      check_(npio_reader_next(&reader, buf, max_rows, &n));
+      return n;
     }
 
 
     #if NPIO_CXX11
+      // A block of rows handed out by the chunk iterator below.
       template <class T>
-      class ValueRange
+      struct Chunk
       {
-        T* _begin;
-        T* _end;
-
-        ValueRange(T* begin, T* end)
-          : _begin(begin)
-          , _end(end)
-        {}
-
-        friend class Array;
-
-        public:
-          ~ValueRange() = default;
-          T* begin() const { return _begin; }
-          T* end() const { return _end; }
+        T* data;      // The rows, in the caller's buffer.
+        size_t rows;  // The number of rows in this chunk.
+        size_t row;   // The index of the first row in the array.
       };
 
-      // For C++11 range-based for loops
       template <class T>
-      ValueRange<T> values() const
+      class ChunkIterator
       {
-        if (isType<T>())
-          return ValueRange<T>((T*) array.data, (T*) array.data + array.size);
-        else
+        Reader* _reader;
+        T* _buf;
+        size_t _max_rows;
+        Chunk<T> _chunk;
+
+        ChunkIterator(Reader* reader, T* buf, size_t max_rows)
+          : _reader(reader)
+          , _buf(buf)
+          , _max_rows(max_rows)
         {
-          #ifdef NPIO_CXX_ENABLE_EXCEPTIONS
-            throw std::bad_cast();
-          #else
-            return ValueRange<T>(0, 0);
-          #endif
+          _chunk.data = buf;
+          _chunk.rows = 0;
+          _chunk.row = 0;
+          if (_reader)
+            ++*this;
         }
-      }
 
-    #endif
+        friend class Reader;
 
+        public:
+          const Chunk<T>& operator*() const { return _chunk; }
+          const Chunk<T>* operator->() const { return &_chunk; }
+
+          ChunkIterator& operator++()
+          {
+            _chunk.row = _reader->row();
+            if ((_chunk.rows = _reader->next(_buf, _max_rows)) == 0)
+              _reader = 0;
+            return *this;
+          }
+
+          bool operator==(const ChunkIterator& o) const { return _reader == o._reader; }
+          bool operator!=(const ChunkIterator& o) const { return _reader != o._reader; }
+      };
 
-    // Save the array back to file
-    int save(const char* filename)
-    {
-      return npio_save(filename, &array);
-    }
+      template <class T>
+      class ChunkRange
+      {
+        Reader* _reader;
+        T* _buf;
+        size_t _max_rows;
+
+        ChunkRange(Reader* reader, T* buf, size_t max_rows)
+          : _reader(reader)
+          , _buf(buf)
+          , _max_rows(max_rows)
+        {}
 
+        friend class Reader;
 
-    // Save the array back to fd
-    int save(int fd)
-    {
-      return npio_save_fd(fd, &array);
-    }
+        public:
+          ChunkIterator<T> begin() const { return ChunkIterator<T>(_reader, _buf, _max_rows); }
+          ChunkIterator<T> end() const { return ChunkIterator<T>(0, _buf, _max_rows); }
+      };
 
+      // For C++11 range-based for loops over blocks of up to max_rows rows,
+      // each read into buf.
+      //
+      //   for (auto& chunk : reader.chunks(buf, 1024))
+      //     process(chunk.data, chunk.rows);
+      template <class T>
+      ChunkRange<T> chunks(T* buf, size_t max_rows)
+      {
+        return ChunkRange<T>(this, buf, max_rows);
+      }
+    #endif
 
-    ~Array()
+
+    ~Reader()
     {
-      npio_free_array(&array);
+      npio_reader_close(&reader);
     }
 };
 
 
-
 }  // namespace npio
 #endif
 
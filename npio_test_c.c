@@ -5,6 +5,8 @@
 #include <assert.h>
 #include <math.h>
 #include <unistd.h>
+#include <sys/wait.h>
+#include <poll.h>
 #include "npio.h"
 
 
@@ -211,6 +213,1758 @@ void test5()
 }
 
 
+/* byte-swap kernels against a naive reversal, then a big-endian round trip */
+void test6()
+{
+  static const size_t widths[] = {16, 32, 64, 128};
+  static const size_t counts[] = {0, 1, 3, 17, 100, 1001};
+  size_t w, c, i, j, nb, bytes;
+  unsigned char *src, *dst, *ref;
+  double v[100], *loaded;
+  size_t shape[] = {100};
+  npio_Array array;
+  int err;
+
+  src = (unsigned char*) malloc(1001 * 16);
+  dst = (unsigned char*) malloc(1001 * 16 + 1);
+  ref = (unsigned char*) malloc(1001 * 16);
+
+  for (w = 0; w < sizeof(widths) / sizeof(widths[0]); ++w)
+  {
+    /* 128-bit elements are swapped as two 64-bit halves */
+    nb = widths[w] == 128 ? 8 : widths[w] / 8;
+    for (c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c)
+    {
+      bytes = counts[c] * widths[w] / 8;
+      for (i = 0; i < bytes; ++i)
+        src[i] = (unsigned char) (i * 7 + w);
+      for (i = 0; i < bytes; i += nb)
+        for (j = 0; j < nb; ++j)
+          ref[i + j] = src[i + nb - 1 - j];
+
+      /* out-of-place, into a deliberately misaligned buffer */
+      assert(npio_swap_bytes4(counts[c], widths[w], src, dst + 1) == 0);
+      assert(memcmp(dst + 1, ref, bytes) == 0);
+
+      /* in-place */
+      assert(npio_swap_bytes(counts[c], widths[w], src) == 0);
+      assert(memcmp(src, ref, bytes) == 0);
+    }
+  }
+  assert(npio_swap_bytes(1, 24, src) == ENOTSUP);
+
+  free(src);
+  free(dst);
+  free(ref);
+
+  /* save as big-endian and check that loading converts back to host */
+  for (i = 0; i < 100; ++i)
+    v[i] = i * 0.5;
+  npio_swap_bytes(100, 64, v);
+  npio_init_array(&array);
+  array.dim = 1;
+  array.shape = shape;
+  array.bit_width = 64;
+  array.little_endian = !(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+  array.data = v;
+  err = npio_save("test6-out.npy", &array);
+  assert(err == 0);
+
+  npio_init_array(&array);
+  if ((err = npio_load("test6-out.npy", &array)))
+  {
+    fprintf(stderr, "npio_load: %s\n", strerror(err));
+    exit(1);
+  }
+  assert(array.little_endian == (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__));
+  loaded = (double*) array.data;
+  for (i = 0; i < 100; ++i)
+    assert(loaded[i] == i * 0.5);
+  npio_free_array(&array);
+  printf("test6 passed\n");
+}
+
+
+/* convert-on-load from both the mapped and the read paths */
+void test7()
+{
+  int err;
+  size_t i;
+  float f[100];
+  int16_t s[100];
+  int32_t w[100];
+  FILE *p;
+  npio_Array array;
+
+  /* <i8 to host float, from a mapped file */
+  npio_init_array(&array);
+  if ((err = npio_load_header("test1.npy", &array)))
+  {
+    fprintf(stderr, "npio_load_header: %s\n", strerror(err));
+    exit(1);
+  }
+  assert(npio_load_data_as(&array, f, "=f4") == 0);
+  for (i = 0; i < 100; ++i)
+    assert(f[i] == (float) i);
+  assert(npio_load_data_as(&array, f, "<c8") == ENOTSUP);
+  npio_free_array(&array);
+
+  /* <i8 to <i2, from a pipe */
+  p = popen("cat test1.npy", "r");
+  npio_init_array(&array);
+  assert(npio_load_header_fd(fileno(p), &array) == 0);
+  assert(npio_load_data_as(&array, s, "<i2") == 0);
+  for (i = 0; i < 100; ++i)
+    assert(s[i] == (int16_t) i);
+  pclose(p);
+  npio_free_array(&array);
+
+  /* the big-endian doubles from test6 to host int32 */
+  npio_init_array(&array);
+  assert(npio_load_header("test6-out.npy", &array) == 0);
+  assert(npio_load_data_as(&array, w, "=i4") == 0);
+  for (i = 0; i < 100; ++i)
+    assert(w[i] == (int32_t) (i * 0.5));
+  npio_free_array(&array);
+
+  /* floats that no integer can hold saturate, and NaN becomes 0 */
+  {
+    double v[6] = {0, 1e300, -1e300, 300.7, -3.5, 9.3e18};
+    int8_t i1[6];
+    uint8_t u1[6];
+    int64_t i8[6];
+    uint64_t u8[6];
+    npio_Array from, to;
+
+    v[0] = NAN;
+    npio_init_array(&from);
+    npio_init_array(&to);
+    assert(npio_parse_dtype("=f8", &from) == 0);
+    assert(npio_parse_dtype("=i1", &to) == 0);
+    assert(npio_convert(&from, v, &to, i1, 6) == 0);
+    assert(i1[0] == 0 && i1[1] == 127 && i1[2] == -128);
+    assert(i1[3] == 127 && i1[4] == -3 && i1[5] == 127);
+    assert(npio_parse_dtype("=u1", &to) == 0);
+    assert(npio_convert(&from, v, &to, u1, 6) == 0);
+    assert(u1[0] == 0 && u1[1] == 255 && u1[2] == 0);
+    assert(u1[3] == 255 && u1[4] == 0 && u1[5] == 255);
+    assert(npio_parse_dtype("=i8", &to) == 0);
+    assert(npio_convert(&from, v, &to, i8, 6) == 0);
+    assert(i8[0] == 0 && i8[1] == INT64_MAX && i8[2] == INT64_MIN);
+    assert(i8[3] == 300 && i8[4] == -3 && i8[5] == INT64_MAX);
+    assert(npio_parse_dtype("=u8", &to) == 0);
+    assert(npio_convert(&from, v, &to, u8, 6) == 0);
+    assert(u8[0] == 0 && u8[1] == UINT64_MAX && u8[2] == 0);
+    assert(u8[3] == 300 && u8[5] == 9300000000000000000u);
+  }
+
+  printf("test7 passed\n");
+}
+
+
+/* read-only shared mappings, with and without a byte swap */
+void test8()
+{
+  int err;
+  size_t i;
+  float *data, total;
+  double *loaded;
+  const unsigned char *raw;
+  npio_Array array;
+  const int flags = NPIO_MAP_SHARED | NPIO_MAP_POPULATE | NPIO_MADV_WILLNEED
+    | NPIO_MADV_SEQUENTIAL | NPIO_MADV_HUGEPAGE;
+
+  npio_init_array(&array);
+  if ((err = npio_load_header4("test2.npy", &array, NPIO_DEFAULT_MAX_DIM
+    , flags)) || (err = npio_load_data(&array)))
+  {
+    fprintf(stderr, "npio_load_header4: %s\n", strerror(err));
+    exit(1);
+  }
+  /* no swap needed, so data points straight into the mapping */
+  assert((char*) array.data > (char*) array._buf);
+  assert((char*) array.data < (char*) array._buf + array._buf_size);
+  data = (float*) array.data;
+  total = 0;
+  for (i = 0; i < array.size; ++i)
+    total += data[i];
+  assert(fabs(total / 5005.37f - 1.0f) < 1e-6f);
+  npio_free_array(&array);
+
+  /* the big-endian file from test6 is swapped into a copy */
+  npio_init_array(&array);
+  assert(npio_load_header4("test6-out.npy", &array, NPIO_DEFAULT_MAX_DIM
+    , NPIO_MAP_SHARED) == 0);
+  assert(npio_load_data(&array) == 0);
+  assert(array._malloced);
+  loaded = (double*) array.data;
+  for (i = 0; i < 100; ++i)
+    assert(loaded[i] == i * 0.5);
+
+  /* and the mapping still holds the original big-endian bytes */
+  raw = (const unsigned char*) array._buf + array._buf_size - 8;
+  assert(raw[0] == 0x40 && raw[7] == 0);
+  npio_free_array(&array);
+
+  printf("test8 passed\n");
+}
+
+
+/* trickle a file through a pipe a few bytes at a time, and save to a pipe */
+void test9()
+{
+  int fds[2], err, status;
+  size_t i;
+  pid_t pid;
+  double v[20000], *data;
+  size_t shape[] = {200, 100};
+  npio_Array array;
+
+  assert(pipe(fds) == 0);
+  if ((pid = fork()) == 0)
+  {
+    char buf[7];
+    size_t n;
+    FILE *f = fopen("test2.npy", "r");
+    close(fds[0]);
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+      if (write(fds[1], buf, n) != (ssize_t) n)
+        _exit(1);
+    _exit(0);
+  }
+  close(fds[1]);
+  npio_init_array(&array);
+  if ((err = npio_load_fd(fds[0], &array)))
+  {
+    fprintf(stderr, "npio_load_fd: %s\n", strerror(err));
+    exit(1);
+  }
+  assert(array.size == 10000);
+  npio_free_array(&array);
+  close(fds[0]);
+  waitpid(pid, &status, 0);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  /* larger than the pipe buffer, so the reader sees many short reads */
+  assert(pipe(fds) == 0);
+  if ((pid = fork()) == 0)
+  {
+    close(fds[1]);
+    npio_init_array(&array);
+    if (npio_load_fd(fds[0], &array) || array.size != 20000)
+      _exit(1);
+    data = (double*) array.data;
+    for (i = 0; i < array.size; ++i)
+      if (data[i] != i)
+        _exit(1);
+    _exit(0);
+  }
+  close(fds[0]);
+  for (i = 0; i < 20000; ++i)
+    v[i] = i;
+  npio_init_array(&array);
+  array.dim = 2;
+  array.shape = shape;
+  array.bit_width = 64;
+  array.data = v;
+  assert(npio_save_fd(fds[1], &array) == 0);
+  close(fds[1]);
+  waitpid(pid, &status, 0);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  printf("test9 passed\n");
+}
+
+
+/* stream rows from a pipe and from a mapped big-endian file */
+void test10()
+{
+  int err;
+  size_t i, n, rows;
+  float buf[7 * 100], total;
+  double dbuf[16];
+  FILE *p;
+  npio_Reader reader;
+
+  p = popen("cat test2.npy", "r");
+  if ((err = npio_reader_open_fd(&reader, fileno(p), NPIO_DEFAULT_MAX_DIM)))
+  {
+    fprintf(stderr, "npio_reader_open_fd: %s\n", strerror(err));
+    exit(1);
+  }
+  assert(reader.rows == 100 && reader.row_size == 100 * sizeof(float));
+  total = 0;
+  rows = 0;
+  while (1)
+  {
+    assert(npio_reader_next(&reader, buf, 7, &n) == 0);
+    if (n == 0)
+      break;
+    for (i = 0; i < n * 100; ++i)
+      total += buf[i];
+    rows += n;
+  }
+  assert(rows == 100);
+  assert(fabs(total / 5005.37f - 1.0f) < 1e-6f);
+  npio_reader_close(&reader);
+  pclose(p);
+
+  assert(npio_reader_open(&reader, "test6-out.npy", NPIO_DEFAULT_MAX_DIM) == 0);
+  rows = 0;
+  while (npio_reader_next(&reader, dbuf, 16, &n) == 0 && n)
+  {
+    for (i = 0; i < n; ++i)
+      assert(dbuf[i] == (rows + i) * 0.5);
+    rows += n;
+  }
+  assert(rows == 100);
+  npio_reader_close(&reader);
+
+  printf("test10 passed\n");
+}
+
+
+/* append rows in batches and check that the header is patched on close */
+void test11()
+{
+  int err;
+  size_t i, j;
+  float rows[3][4], *data;
+  size_t row_shape[] = {4};
+  npio_Writer writer;
+  npio_Array desc, array;
+
+  npio_init_array(&desc);
+  desc.dim = 1;
+  desc.shape = row_shape;
+  if ((err = npio_writer_open(&writer, "test11-out.npy", &desc)))
+  {
+    fprintf(stderr, "npio_writer_open: %s\n", strerror(err));
+    exit(1);
+  }
+  for (i = 0; i < 10; ++i)
+  {
+    for (j = 0; j < 12; ++j)
+      rows[j / 4][j % 4] = i * 12 + j;
+    assert(npio_writer_append(&writer, rows, 3) == 0);
+  }
+  assert(npio_writer_close(&writer) == 0);
+  assert(npio_writer_close(&writer) == 0);
+
+  npio_init_array(&array);
+  assert(npio_load("test11-out.npy", &array) == 0);
+  assert(array.dim == 2 && array.shape[0] == 30 && array.shape[1] == 4);
+  data = (float*) array.data;
+  for (i = 0; i < array.size; ++i)
+    assert(data[i] == i);
+  npio_free_array(&array);
+
+  /* no rows at all is still a valid file */
+  assert(npio_writer_open(&writer, "test11-out.npy", &desc) == 0);
+  assert(npio_writer_close(&writer) == 0);
+  npio_init_array(&array);
+  assert(npio_load("test11-out.npy", &array) == 0);
+  assert(array.dim == 2 && array.shape[0] == 0 && array.size == 0);
+  npio_free_array(&array);
+
+  /* a pipe cannot be patched */
+  {
+    int fds[2];
+    assert(pipe(fds) == 0);
+    assert(npio_writer_open_fd(&writer, fds[1], &desc) == ESPIPE);
+    npio_writer_close(&writer);
+    close(fds[0]);
+    close(fds[1]);
+  }
+
+  /* complex rows keep their type, and bfloat16 is refused as by npio_save */
+  desc.floating_point = 1;
+  desc.is_complex = 1;
+  desc.bit_width = 64;
+  assert(npio_writer_open(&writer, "test11-out.npy", &desc) == 0);
+  assert(npio_writer_append(&writer, rows, 1) == 0);
+  assert(npio_writer_close(&writer) == 0);
+  npio_init_array(&array);
+  assert(npio_load("test11-out.npy", &array) == 0);
+  assert(array.is_complex && array.floating_point && array.bit_width == 64);
+  assert(array.dim == 2 && array.shape[0] == 1 && array.shape[1] == 4);
+  assert(memcmp(array.data, rows, 32) == 0);
+  npio_free_array(&array);
+
+  desc.is_complex = 0;
+  desc.is_bfloat16 = 1;
+  desc.bit_width = 16;
+  assert(npio_writer_open(&writer, "test11-out.npy", &desc) == ENOTSUP);
+  npio_writer_close(&writer);
+
+  printf("test11 passed\n");
+}
+
+
+/* save a file-backed array to a file and to a pipe, and a high-dim array */
+void test12()
+{
+  int err, fds[2], status;
+  size_t i;
+  pid_t pid;
+  float *data, total;
+  size_t shape[40];
+  double v = 42;
+  npio_Array array, copy;
+
+  npio_init_array(&array);
+  if ((err = npio_load_header4("test2.npy", &array, NPIO_DEFAULT_MAX_DIM
+    , NPIO_MAP_SHARED | NPIO_KEEP_FD)) || (err = npio_load_data(&array)))
+  {
+    fprintf(stderr, "npio_load_header4: %s\n", strerror(err));
+    exit(1);
+  }
+  assert(array._fd >= 0);
+  assert(npio_save("test12-out.npy", &array) == 0);
+
+  assert(pipe(fds) == 0);
+  if ((pid = fork()) == 0)
+  {
+    close(fds[1]);
+    npio_init_array(&copy);
+    _exit(npio_load_fd(fds[0], &copy) || copy.size != 10000);
+  }
+  close(fds[0]);
+  assert(npio_save_fd(fds[1], &array) == 0);
+  close(fds[1]);
+  waitpid(pid, &status, 0);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  npio_free_array(&array);
+
+  npio_init_array(&copy);
+  assert(npio_load("test12-out.npy", &copy) == 0);
+  assert(copy.dim == 3 && copy.size == 10000);
+  data = (float*) copy.data;
+  total = 0;
+  for (i = 0; i < copy.size; ++i)
+    total += data[i];
+  assert(fabs(total / 5005.37f - 1.0f) < 1e-6f);
+  npio_free_array(&copy);
+
+  /* a header larger than the small stack buffer */
+  for (i = 0; i < 40; ++i)
+    shape[i] = 1;
+  npio_init_array(&array);
+  array.dim = 40;
+  array.shape = shape;
+  array.bit_width = 64;
+  array.data = &v;
+  assert(npio_save("test12-out.npy", &array) == 0);
+  npio_init_array(&copy);
+  assert(npio_load3("test12-out.npy", &copy, 40) == 0);
+  assert(copy.dim == 40 && *(double*) copy.data == 42);
+  npio_free_array(&copy);
+
+  printf("test12 passed\n");
+}
+
+
+/* load many files concurrently, collecting completions through poll */
+void test13()
+{
+  enum { n = 40 };
+  npio_Array arrays[n];
+  const char* names[n];
+  int errors[n];
+  size_t i, got = 0;
+  npio_Batch batch;
+  npio_Completion c;
+  struct pollfd pfd;
+  int err;
+
+  assert(npio_batch_init(&batch, 3) == 0);
+  for (i = 0; i < n; ++i)
+  {
+    npio_init_array(&arrays[i]);
+    names[i] = i == 7 ? "does-not-exist.npy" : i % 2 ? "test1.npy" : "test2.npy";
+    assert(npio_batch_submit(&batch, names[i], &arrays[i], (void*) i) == 0);
+  }
+
+  pfd.fd = npio_batch_fd(&batch);
+  pfd.events = POLLIN;
+  while (got < n)
+  {
+    assert(poll(&pfd, 1, 5000) == 1);
+    while ((err = npio_batch_wait(&batch, &c, 0)) == 0)
+    {
+      i = (size_t) c.user_data;
+      assert(c.array == &arrays[i]);
+      if (i == 7)
+        assert(c.error == ENOENT);
+      else
+        assert(c.error == 0 && c.array->size == (i % 2 ? 100 : 10000));
+      ++got;
+    }
+    assert(err == EAGAIN || (err == ENOENT && got == n));
+  }
+  /* nothing left, so the descriptor is quiet again */
+  assert(poll(&pfd, 1, 0) == 0);
+  assert(npio_batch_wait(&batch, &c, 1) == ENOENT);
+  npio_batch_destroy(&batch);
+
+  for (i = 0; i < n; ++i)
+    npio_free_array(&arrays[i]);
+
+  /* the synchronous wrapper */
+  for (i = 0; i < n; ++i)
+    npio_init_array(&arrays[i]);
+  assert(npio_load_batch(n, names, arrays, errors, 4) == ENOENT);
+  for (i = 0; i < n; ++i)
+  {
+    assert(errors[i] == (i == 7 ? ENOENT : 0));
+    if (i % 2 && i != 7)
+      assert(((int64_t*) arrays[i].data)[99] == 99);
+    npio_free_array(&arrays[i]);
+  }
+
+  printf("test13 passed\n");
+}
+
+
+/* small files are read with pread, large ones are mapped */
+void test14()
+{
+  float *v;
+  size_t i, shape[] = {NPIO_MMAP_THRESHOLD / 4 + 1};
+  npio_Array array;
+
+  npio_init_array(&array);
+  assert(npio_load("test1.npy", &array) == 0);
+  assert(array._buf_malloced && !array._mmapped);
+  assert(((int64_t*) array.data)[99] == 99);
+  npio_free_array(&array);
+
+  /* one element past the threshold */
+  v = (float*) malloc(shape[0] * sizeof(float));
+  for (i = 0; i < shape[0]; ++i)
+    v[i] = i;
+  npio_init_array(&array);
+  array.dim = 1;
+  array.shape = shape;
+  array.data = v;
+  assert(npio_save("test14-out.npy", &array) == 0);
+  free(v);
+
+  npio_init_array(&array);
+  assert(npio_load("test14-out.npy", &array) == 0);
+  assert(array._mmapped && !array._buf_malloced);
+  assert(((float*) array.data)[shape[0] - 1] == shape[0] - 1);
+  npio_free_array(&array);
+
+  printf("test14 passed\n");
+}
+
+
+/* A bump allocator over a fixed buffer that keeps count of what is live. */
+typedef struct
+{
+  char buf[1 << 16];
+  size_t used, live, bytes;
+} Arena;
+
+
+void* arena_alloc(void* ctx, size_t size, size_t alignment)
+{
+  Arena* a = (Arena*) ctx;
+  uintptr_t base = (uintptr_t) a->buf;
+  size_t off = ((base + a->used + alignment - 1) & ~(alignment - 1)) - base;
+  if (off + size > sizeof(a->buf))
+    return 0;
+  a->used = off + size;
+  a->live++;
+  a->bytes += size;
+  return a->buf + off;
+}
+
+
+void arena_free(void* ctx, void* p, size_t size, size_t alignment)
+{
+  Arena* a = (Arena*) ctx;
+  assert((char*) p >= a->buf && (char*) p + size <= a->buf + sizeof(a->buf));
+  assert((uintptr_t) p % alignment == 0);
+  a->live--;
+  a->bytes -= size;
+}
+
+
+void test15()
+{
+  static Arena arena;
+  npio_Allocator alloc = { arena_alloc, arena_free, &arena };
+  npio_Array array;
+  int64_t *data;
+  FILE *p;
+  size_t i;
+
+  /* small file, read whole into the arena */
+  npio_init_array2(&array, &alloc);
+  assert(npio_load("test1.npy", &array) == 0);
+  assert(array._buf_malloced && arena.live == 1);
+  assert((char*) array.data > arena.buf
+    && (char*) array.data < arena.buf + sizeof(arena.buf));
+  data = (int64_t*) array.data;
+  for (i = 0; i < 100; ++i)
+    assert(data[i] == i);
+  npio_free_array(&array);
+  assert(arena.live == 0 && arena.bytes == 0);
+
+  /* from a pipe, the header and data are separate allocations */
+  p = popen("cat test1.npy", "r");
+  npio_init_array2(&array, &alloc);
+  assert(npio_load_fd(fileno(p), &array) == 0);
+  pclose(p);
+  assert(array._malloced && arena.live == 2);
+  assert((uintptr_t) array.data % NPIO_DATA_ALIGNMENT == 0);
+  data = (int64_t*) array.data;
+  for (i = 0; i < 100; ++i)
+    assert(data[i] == i);
+  npio_free_array(&array);
+  assert(arena.live == 0 && arena.bytes == 0);
+
+  /* a shape that outgrows its first allocation */
+  npio_init_array2(&array, &alloc);
+  assert(npio_load3("test12-out.npy", &array, 40) == 0);
+  assert(array.dim == 40);
+  npio_free_array(&array);
+  assert(arena.live == 0 && arena.bytes == 0);
+
+  /* allocation failure is reported */
+  arena.used = sizeof(arena.buf);
+  npio_init_array2(&array, &alloc);
+  assert(npio_load("test1.npy", &array) == ENOMEM);
+  npio_free_array(&array);
+  assert(arena.live == 0);
+
+  printf("test15 passed\n");
+}
+
+
+void test16()
+{
+  npio_Npz npz;
+  npio_Array array, arrays[2];
+  const npio_NpzMember* m;
+  const char* names[] = {"weights", "bias"};
+  size_t shape0[] = {2, 3}, shape1[] = {3}, i;
+  float w[] = {1, 2, 3, 4, 5, 6};
+  int16_t b[] = {-1, 0, 1};
+  int64_t v;
+  double *d;
+  FILE *p;
+  int k;
+
+  /* written by python's zipfile the same way numpy.savez does */
+  assert(npio_npz_open(&npz, "test1.npz") == 0);
+  assert(npz.n == 2);
+  assert(strcmp(npz.members[0].name, "a") == 0);
+  assert(strcmp(npz.members[1].name, "b") == 0);
+  assert(npio_npz_find(&npz, "c") == 0);
+
+  npio_init_array(&array);
+  assert(npio_npz_load(&npz, "a", &array) == 0);
+  assert(array.size == 100 && array.bit_width == 64);
+  m = npio_npz_find(&npz, "a");
+  assert((char*) array.data > (char*) npz._buf + m->offset);
+  /* numpy does not align members, so the data may be misaligned */
+  for (i = 0; i < 100; ++i)
+  {
+    memcpy(&v, (char*) array.data + i * sizeof(v), sizeof(v));
+    assert(v == i);
+  }
+  npio_free_array(&array);
+
+  /* big-endian, swapped into a copy, so loading it again works */
+  for (k = 0; k < 2; ++k)
+  {
+    npio_init_array(&array);
+    assert(npio_npz_load(&npz, "b", &array) == 0);
+    assert(array._malloced);
+    d = (double*) array.data;
+    assert(d[0] == 1.5 && d[1] == 2.5 && d[2] == 3.5);
+    npio_free_array(&array);
+  }
+
+  npio_init_array(&array);
+  assert(npio_npz_load(&npz, "c", &array) == ENOENT);
+  npio_free_array(&array);
+  npio_npz_close(&npz);
+
+  /* round trip */
+  npio_init_array(&arrays[0]);
+  arrays[0].dim = 2;
+  arrays[0].shape = shape0;
+  arrays[0].data = w;
+  npio_init_array(&arrays[1]);
+  arrays[1].dim = 1;
+  arrays[1].shape = shape1;
+  arrays[1].bit_width = 16;
+  arrays[1].floating_point = 0;
+  arrays[1].data = b;
+  assert(npio_savez("test16-out.npz", 2, names, arrays) == 0);
+
+  /* through a pipe, which is read into memory */
+  p = popen("cat test16-out.npz", "r");
+  assert(npio_npz_open_fd(&npz, fileno(p)) == 0);
+  pclose(p);
+  assert(npz.n == 2 && !npz._mmapped);
+  for (i = 0; i < npz.n; ++i)
+  {
+    m = &npz.members[i];
+    assert(npio_crc32(0, (char*) npz._buf + m->offset, m->size) == m->crc32);
+  }
+
+  npio_init_array(&array);
+  assert(npio_npz_load(&npz, "weights", &array) == 0);
+  assert(array.dim == 2 && array.shape[1] == 3);
+  assert(memcmp(array.data, w, sizeof(w)) == 0);
+  npio_free_array(&array);
+
+  npio_init_array(&array);
+  assert(npio_npz_load(&npz, "bias", &array) == 0);
+  assert(strcmp(array.dtype, "<i2") == 0 || strcmp(array.dtype, ">i2") == 0);
+  assert(memcmp(array.data, b, sizeof(b)) == 0);
+  npio_free_array(&array);
+  npio_npz_close(&npz);
+
+  /* not an archive */
+  assert(npio_npz_open(&npz, "test1.npy") == EINVAL);
+  npio_npz_close(&npz);
+
+  printf("test16 passed\n");
+}
+
+
+void test17()
+{
+  npio_Npz npz;
+  npio_Array arrays[3];
+#ifdef NPIO_ENABLE_ZLIB
+  npio_Array array;
+#endif
+  int errors[3];
+  size_t i;
+
+  /* deflated, as written by numpy.savez_compressed */
+  assert(npio_npz_open(&npz, "test2.npz") == 0);
+  assert(npz.n == 3);
+  for (i = 0; i < npz.n; ++i)
+  {
+    assert(npz.members[i].method == 8);
+    npio_init_array(&arrays[i]);
+  }
+
+#ifdef NPIO_ENABLE_ZLIB
+  assert(npio_npz_load_all(&npz, arrays, errors, 3) == 0);
+  assert(errors[0] == 0 && errors[1] == 0 && errors[2] == 0);
+  for (i = 0; i < 100; ++i)
+    assert(((int64_t*) arrays[0].data)[i] == i);
+  assert((uintptr_t) arrays[1].data % NPIO_DATA_ALIGNMENT == 0);
+  npio_init_array(&array);
+  assert(npio_load("test2.npy", &array) == 0);
+  assert(arrays[1].size == array.size);
+  assert(memcmp(arrays[1].data, array.data, npio_array_memsize(&array)) == 0);
+  npio_free_array(&array);
+  assert(((int32_t*) arrays[2].data)[0] == -2);
+  assert(((int32_t*) arrays[2].data)[3] == 1);
+  for (i = 0; i < npz.n; ++i)
+    npio_free_array(&arrays[i]);
+
+  /* a bad checksum is caught */
+  npz.members[0].crc32 ^= 1;
+  npio_init_array(&array);
+  assert(npio_npz_load(&npz, "a", &array) == EINVAL);
+  npio_free_array(&array);
+#else
+  assert(npio_npz_load_all(&npz, arrays, errors, 3) == ENOTSUP);
+  for (i = 0; i < npz.n; ++i)
+  {
+    assert(errors[i] == ENOTSUP);
+    npio_free_array(&arrays[i]);
+  }
+#endif
+
+  npio_npz_close(&npz);
+  printf("test17 passed\n");
+}
+
+
+void test18()
+{
+  npio_Array array;
+  uint32_t *v;
+  size_t i, shape[] = {3 << 20};
+  int fd;
+
+  /* big-endian, so each range is swapped as it is read */
+  v = (uint32_t*) malloc(shape[0] * sizeof(uint32_t));
+  for (i = 0; i < shape[0]; ++i)
+    v[i] = i;
+  npio_swap_bytes(shape[0], 32, v);
+  npio_init_array(&array);
+  array.dim = 1;
+  array.shape = shape;
+  array.floating_point = 0;
+  array.is_signed = 0;
+  array.little_endian = !array.little_endian;
+  array.data = v;
+  assert(npio_save("test18-out.npy", &array) == 0);
+  free(v);
+
+  npio_init_array(&array);
+  assert(npio_load_header4("test18-out.npy", &array, 32, NPIO_NO_MMAP) == 0);
+  assert(!array._mmapped && !array._buf);
+  assert(npio_load_data3(&array, 1, 3) == 0);
+  assert(array._malloced);
+  assert(array.little_endian == (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__));
+  v = (uint32_t*) array.data;
+  for (i = 0; i < shape[0]; ++i)
+    assert(v[i] == i);
+  assert(lseek(array._fd, 0, SEEK_CUR) == lseek(array._fd, 0, SEEK_END));
+  npio_free_array(&array);
+
+  /* without swapping, and from our own descriptor */
+  fd = open("test18-out.npy", O_RDONLY);
+  npio_init_array(&array);
+  assert(npio_load_header_fd4(fd, &array, 32, NPIO_NO_MMAP) == 0);
+  assert(npio_load_data3(&array, 0, 4) == 0);
+  v = (uint32_t*) array.data;
+  assert(!array.little_endian);
+  for (i = 0; i < shape[0]; i += 4099)
+    assert(v[i] == (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      ? npio_bswap32_((uint32_t) i) : i));
+  npio_free_array(&array);
+  close(fd);
+
+  printf("test18 passed\n");
+}
+
+
+void test19()
+{
+  npio_Array array;
+  float *v;
+  size_t i, shape[] = {3, 1 << 20};
+  struct stat st;
+
+  /* page aligned, so that O_DIRECT is used where it is declared, as in the
+     npio_test_zlib build */
+  assert(posix_memalign((void**) &v, NPIO_DIRECT_ALIGNMENT
+    , shape[0] * shape[1] * sizeof(float)) == 0);
+  for (i = 0; i < shape[0] * shape[1]; ++i)
+    v[i] = i;
+  npio_init_array(&array);
+  array.dim = 2;
+  array.shape = shape;
+  array.data = v;
+  assert(npio_save4("test19-out.npy", &array, 3, NPIO_SAVE_DIRECT) == 0);
+  free(v);
+
+  assert(stat("test19-out.npy", &st) == 0);
+  npio_init_array(&array);
+  assert(npio_load("test19-out.npy", &array) == 0);
+  assert((size_t) st.st_size == array.header_len + 10 + npio_array_memsize(&array));
+  assert(array.shape[0] == 3 && array.shape[1] == 1 << 20);
+#ifdef O_DIRECT
+  assert(array.header_len + 10 == NPIO_DIRECT_ALIGNMENT);
+#endif
+  v = (float*) array.data;
+  for (i = 0; i < shape[0] * shape[1]; ++i)
+    assert(v[i] == i);
+  npio_free_array(&array);
+
+  printf("test19 passed\n");
+}
+
+
+void test20()
+{
+  npio_Info info;
+  npio_Index index;
+  const char* paths[] = {"test2.npy", "test1.npy", "nonexistent.npy"
+    , "test1.npz"};
+  const char* path;
+  int errors[4];
+  size_t i;
+
+  assert(npio_stat("test1.npy", &info) == 0);
+  assert(strcmp(info.dtype, "<i8") == 0 && info.bit_width == 64);
+  assert(info.dim == 1 && info.shape[0] == 100 && info.size == 100);
+  assert(info.data_offset == info.header_len + 10);
+  assert(info.file_size == info.data_offset + 800);
+  assert(npio_stat("test12-out.npy", &info) == ERANGE);
+  assert(npio_stat("test1.npz", &info) == EINVAL);
+
+  assert(npio_index_build("test20-out.idx", 4, paths, errors) == 0);
+  assert(errors[0] == 0 && errors[1] == 0);
+  assert(errors[2] == ENOENT && errors[3] == EINVAL);
+
+  assert(npio_index_open(&index, "test20-out.idx") == 0);
+  assert(index.n == 2);
+  assert(strcmp(npio_index_get(&index, 0, &info), "test1.npy") == 0);
+  assert(npio_index_find(&index, "test2.npy", &info) == 0);
+  assert(info.dim == 3 && info.shape[0] == 100 && info.shape[2] == 10);
+  assert(info.size == 10000 && info.floating_point && info.bit_width == 32);
+  assert(npio_index_find(&index, "test3.npy", &info) == ENOENT);
+  npio_index_close(&index);
+
+  /* a whole directory */
+  assert(npio_index_build_dir("test20-out.idx", ".") == 0);
+  assert(npio_index_open(&index, "test20-out.idx") == 0);
+  assert(index.n >= 2);
+  for (i = 1; i < index.n; ++i)
+  {
+    path = npio_index_get(&index, i - 1, &info);
+    assert(strcmp(path, npio_index_get(&index, i, &info)) < 0);
+  }
+  assert(npio_index_find(&index, "test1.npy", &info) == 0);
+  assert(info.shape[0] == 100);
+  npio_index_close(&index);
+
+  assert(npio_index_open(&index, "test1.npy") == EINVAL);
+  npio_index_close(&index);
+
+  printf("test20 passed\n");
+}
+
+
+/* Wrap a header dict into a version 1 prelude and parse it from memory. */
+int parse_header(const char* dict, npio_Array* array, size_t max_dim)
+{
+  static char buf[1024];
+  size_t len = strlen(dict);
+
+  memcpy(buf, "\x93NUMPY\x01\x00", 8);
+  buf[8] = len & 0xff;
+  buf[9] = len >> 8;
+  memcpy(buf + 10, dict, len);
+  memset(buf + 10 + len, ' ', 16);
+  return npio_load_header_mem4(buf, len + 26, array, max_dim);
+}
+
+
+void test21()
+{
+  static Arena arena;
+  npio_Allocator alloc = { arena_alloc, arena_free, &arena };
+  npio_Array array;
+
+  /* key order, quoting, spacing and trailing commas all vary in the wild */
+  npio_init_array2(&array, &alloc);
+  assert(parse_header("{\"shape\": (3L,  4,), \"fortran_order\": True"
+    ", \"descr\": \"<f8\",}\n", &array, 2) == 0);
+  assert(array.dim == 2 && array.shape[0] == 3 && array.shape[1] == 4);
+  assert(array.fortran_order && array.floating_point && array.bit_width == 64);
+  assert(strcmp(array.dtype, "<f8") == 0);
+  assert(array.shape == array._shape_buf && array.dtype == array._dtype_buf);
+  assert(arena.live == 0);
+  npio_free_array(&array);
+
+  /* a scalar */
+  npio_init_array2(&array, &alloc);
+  assert(parse_header("{ 'descr' : '|u1' , 'shape' : ( ) }", &array, 2) == 0);
+  assert(array.dim == 0 && array.size == 1 && !array.fortran_order);
+  assert(array.bit_width == 8 && !array.is_signed && arena.live == 0);
+  npio_free_array(&array);
+
+  /* more dimensions than fit inline */
+  npio_init_array2(&array, &alloc);
+  assert(parse_header("{'descr': '<i2', 'shape': (1, 1, 1, 1, 1, 1, 1, 1, 1"
+    ", 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1"
+    ", 2)}", &array, 40) == 0);
+  assert(array.dim == 34 && array.size == 2 && arena.live == 1);
+  npio_free_array(&array);
+  assert(arena.live == 0);
+
+  /* malformed or hostile headers */
+  npio_init_array2(&array, &alloc);
+  assert(parse_header("{'shape': (3,)}", &array, 2) == EINVAL);
+  npio_free_array(&array);
+  npio_init_array2(&array, &alloc);
+  assert(parse_header("{'descr': '<f4'}", &array, 2) == EINVAL);
+  npio_free_array(&array);
+  npio_init_array2(&array, &alloc);
+  assert(parse_header("{'descr': '<f4', 'shape': (3,), 'shape': (3,)}"
+    , &array, 2) == EINVAL);
+  npio_free_array(&array);
+  npio_init_array2(&array, &alloc);
+  assert(parse_header("{'descr': '<f4', 'shape': (,3)}", &array, 2) == EINVAL);
+  npio_free_array(&array);
+  npio_init_array2(&array, &alloc);
+  assert(parse_header("{'descr': '<f4', 'shape': (1, 2, 3)}", &array, 2)
+    == ERANGE);
+  npio_free_array(&array);
+  npio_init_array2(&array, &alloc);
+  assert(parse_header("{'descr': '<f4', 'shape': (99999999999999999999999,)}"
+    , &array, 2) == ERANGE);
+  npio_free_array(&array);
+  npio_init_array2(&array, &alloc);
+  assert(parse_header("{'descr': '<f8', 'shape': (4294967296, 4294967296)}"
+    , &array, 2) == ERANGE);
+  npio_free_array(&array);
+  assert(arena.live == 0);
+
+  printf("test21 passed\n");
+}
+
+
+void test22()
+{
+  static size_t shape[30000];
+  npio_Array array;
+  npio_Writer writer;
+  int16_t v[6] = {1, 2, 3, 4, 5, 6};
+  size_t i;
+  int version;
+
+  for (version = 1; version <= 3; ++version)
+  {
+    npio_init_array(&array);
+    array.major_version = version;
+    array.dim = 2;
+    array.shape = shape;
+    shape[0] = 2;
+    shape[1] = 3;
+    array.bit_width = 16;
+    array.floating_point = 0;
+    array.data = v;
+    assert(npio_save("test22-out.npy", &array) == 0);
+
+    npio_init_array(&array);
+    assert(npio_load("test22-out.npy", &array) == 0);
+    assert(array.major_version == version && array.minor_version == 0);
+    assert((array.header_len + (version == 1 ? 10 : 12))
+      % NPIO_HEADER_ALIGNMENT == 0);
+    assert((uintptr_t) array.data % NPIO_HEADER_ALIGNMENT == 0);
+    assert(array.size == 6 && ((int16_t*) array.data)[5] == 6);
+    npio_free_array(&array);
+  }
+
+  /* a structure filled in without npio_init_array, then too long for
+     version 1, so written as version 2 */
+  for (i = 0; i < 30000; ++i)
+    shape[i] = 1;
+  memset(&array, 0, sizeof(array));
+  array.little_endian = (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+  array.dim = 2;
+  array.shape = shape;
+  array.bit_width = 16;
+  array.is_signed = 1;
+  array.data = v;
+  assert(npio_save("test22-out.npy", &array) == 0);
+  npio_init_array(&array);
+  assert(npio_load("test22-out.npy", &array) == 0);
+  assert(array.major_version == 1 && array.size == 1);
+  assert(((int16_t*) array.data)[0] == 1);
+  npio_free_array(&array);
+
+  npio_init_array(&array);
+  array.dim = 30000;
+  array.shape = shape;
+  array.bit_width = 16;
+  array.floating_point = 0;
+  array.data = v;
+  assert(npio_save("test22-out.npy", &array) == 0);
+  npio_init_array(&array);
+  assert(npio_load3("test22-out.npy", &array, 30000) == 0);
+  assert(array.major_version == 2 && array.header_len > 0xffff);
+  assert(array.dim == 30000 && array.size == 1);
+  assert((uintptr_t) array.data % NPIO_HEADER_ALIGNMENT == 0);
+  npio_free_array(&array);
+
+  /* a streamed file keeps the version of its description */
+  npio_init_array(&array);
+  array.major_version = 3;
+  array.dim = 1;
+  shape[0] = 2;
+  array.shape = shape;
+  array.bit_width = 16;
+  array.floating_point = 0;
+  assert(npio_writer_open(&writer, "test22-out.npy", &array) == 0);
+  assert(npio_writer_append(&writer, v, 3) == 0);
+  assert(npio_writer_close(&writer) == 0);
+  npio_init_array(&array);
+  assert(npio_load("test22-out.npy", &array) == 0);
+  assert(array.major_version == 3 && array.shape[0] == 3);
+  assert(((int16_t*) array.data)[5] == 6);
+  npio_free_array(&array);
+
+  npio_init_array(&array);
+  array.major_version = 4;
+  assert(npio_save("test22-out.npy", &array) == ENOTSUP);
+
+  printf("test22 passed\n");
+}
+
+
+void test23()
+{
+  static float f[65536], g[65536];
+  static uint16_t h[65536], k[65536];
+  npio_Array array;
+  size_t i, shape[] = {2, 3};
+  float c8[12], c8s[12];
+  double c16[12];
+  uint32_t u;
+
+  /* every half converts to float and back, with and without SIMD */
+  for (i = 0; i < 65536; ++i)
+    h[i] = i;
+  npio_half_to_f32_(0, 65536, h, f);
+  npio_f32_to_half_(0, 65536, f, k);
+  for (i = 0; i < 65536; ++i)
+  {
+    if (f[i] != f[i])
+    {
+      assert((h[i] & 0x7c00) == 0x7c00 && (h[i] & 0x3ff));
+      continue;
+    }
+    assert(f[i] == npio_f16_to_f32_scalar_(h[i]));
+    assert(k[i] == h[i] && npio_f32_to_f16_scalar_(f[i]) == h[i]);
+  }
+
+  /* rounding to nearest even, overflow and subnormals */
+  assert(npio_f32_to_f16_scalar_(1.0f) == 0x3c00);
+  assert(npio_f32_to_f16_scalar_(1.0f + 1.0f / 2048) == 0x3c00);
+  assert(npio_f32_to_f16_scalar_(1.0f + 3.0f / 2048) == 0x3c02);
+  assert(npio_f32_to_f16_scalar_(65504.0f) == 0x7bff);
+  assert(npio_f32_to_f16_scalar_(65520.0f) == 0x7c00);
+  assert(npio_f32_to_f16_scalar_(-1.0f / 16777216) == 0x8001);
+  assert(npio_f32_to_f16_scalar_(1.0f / 33554432) == 0);
+  assert(npio_f32_to_f16_scalar_(3.0f / 33554432) == 0x0002);
+  assert(npio_f32_to_bf16_scalar_(1.0f) == 0x3f80);
+  assert(npio_f32_to_bf16_scalar_(1.0f + 1.0f / 256) == 0x3f80);
+  assert(npio_f32_to_bf16_scalar_(1.0f + 3.0f / 256) == 0x3f82);
+
+  /* the vector kernels round as the scalar code does */
+  for (i = 0, u = 12345; i < 65536; ++i)
+  {
+    u = u * 1664525 + 1013904223;
+    memcpy(&f[i], &u, 4);
+    if (f[i] != f[i])
+      f[i] = 0;
+  }
+  npio_f32_to_half_(0, 65536, f, h);
+  npio_f32_to_half_(1, 65536, f, k);
+  npio_half_to_f32_(1, 65536, k, g);
+  for (i = 0; i < 65536; ++i)
+  {
+    assert(h[i] == npio_f32_to_f16_scalar_(f[i]));
+    assert(k[i] == npio_f32_to_bf16_scalar_(f[i]));
+    assert(g[i] == npio_bf16_to_f32_scalar_(k[i]));
+  }
+
+  /* a big-endian float16 file, converted on load */
+  for (i = 0; i < 6; ++i)
+  {
+    h[i] = npio_f32_to_f16_scalar_(i * 0.5f);
+    h[i] = (h[i] >> 8) | (h[i] << 8);
+  }
+  npio_init_array(&array);
+  array.dim = 2;
+  array.shape = shape;
+  array.bit_width = 16;
+  array.little_endian = 0;
+  array.data = h;
+  assert(npio_save("test23-out.npy", &array) == 0);
+  npio_init_array(&array);
+  assert(npio_load_header("test23-out.npy", &array) == 0);
+  assert(strcmp(array.dtype, ">f2") == 0 && array.bit_width == 16);
+  assert(npio_load_data_as(&array, g, "=f4") == 0);
+  for (i = 0; i < 6; ++i)
+    assert(g[i] == i * 0.5f);
+  npio_free_array(&array);
+
+  npio_init_array(&array);
+  assert(npio_load("test23-out.npy", &array) == 0);
+  assert(npio_convert_data(&array, k, "bfloat16") == 0);
+  for (i = 0; i < 6; ++i)
+    assert(npio_bf16_to_f32_scalar_(k[i]) == i * 0.5f);
+  npio_free_array(&array);
+
+  /* bfloat16 has no numpy dtype to save it with */
+  npio_init_array(&array);
+  array.dim = 2;
+  array.shape = shape;
+  array.bit_width = 16;
+  array.is_bfloat16 = 1;
+  array.data = k;
+  assert(npio_save("test23-out.npy", &array) == ENOTSUP);
+
+  /* complex numbers swap their two parts separately */
+  for (i = 0; i < 12; ++i)
+  {
+    c8[i] = i + 0.25f;
+    memcpy(&u, &c8[i], 4);
+    u = npio_bswap32_(u);
+    memcpy(&c8s[i], &u, 4);
+  }
+  npio_init_array(&array);
+  array.dim = 2;
+  array.shape = shape;
+  array.bit_width = 64;
+  array.is_complex = 1;
+  array.little_endian = !(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+  array.data = c8s;
+  assert(npio_save("test23-out.npy", &array) == 0);
+  npio_init_array(&array);
+  assert(npio_load("test23-out.npy", &array) == 0);
+  assert(array.is_complex && array.floating_point && array.bit_width == 64);
+  assert(memcmp(array.data, c8, sizeof(c8)) == 0);
+  assert(npio_convert_data(&array, c16, ">c16") == 0);
+  assert(npio_convert_data(&array, g, "<f4") == ENOTSUP);
+  npio_free_array(&array);
+
+  npio_init_array(&array);
+  assert(npio_load_header("test23-out.npy", &array) == 0);
+  assert(npio_load_data_as(&array, c16, "=c16") == 0);
+  for (i = 0; i < 12; ++i)
+    assert(c16[i] == i + 0.25);
+  npio_free_array(&array);
+
+  printf("test23 passed\n");
+}
+
+
+void test24()
+{
+  npio_Array array;
+  npio_FieldView view;
+  npio_Field fields[3];
+  char rec[4 * 40], *r;
+  size_t i, k, shape[] = {4};
+  double t, pos[12];
+  uint32_t id, ids[4];
+  uint16_t flags[4];
+
+  /* a descriptor as numpy writes it, with padding */
+  npio_init_array(&array);
+  assert(parse_header("{'descr': [('t', '<f8'), ('id', '<u4'), ('', '|V4')"
+    ", ('pos', '<f4', (3,)), ('flag', '|u1')], 'fortran_order': False"
+    ", 'shape': (4,), }", &array, 2) == 0);
+  assert(array.nfields == 4 && array.bit_width == 29 * 8 && array.size == 4);
+  assert(strcmp(array.fields[1].name, "id") == 0 && array.fields[1].offset == 8);
+  assert(array.fields[2].offset == 16 && array.fields[2].count == 3);
+  assert(array.fields[2].dim == 1 && array.fields[2].floating_point);
+  assert(array.fields[3].offset == 28 && array.fields[3].bit_width == 8);
+  assert(array.little_endian);
+  npio_free_array(&array);
+
+  npio_init_array(&array);
+  assert(parse_header("{'descr': [('a', '<f8'), ('b', '>u4')], 'shape': (4,)}"
+    , &array, 2) == ENOTSUP);
+  npio_free_array(&array);
+  npio_init_array(&array);
+  assert(parse_header("{'descr': [('a', [('b', '<f8')])], 'shape': (4,)}"
+    , &array, 2) == ENOTSUP);
+  npio_free_array(&array);
+  npio_init_array(&array);
+  assert(parse_header("{'descr': [('a', '<f8'), ('b' '<u4')], 'shape': (4,)}"
+    , &array, 2) == EINVAL);
+  npio_free_array(&array);
+
+  /* big-endian records of a time, an id and a position, with a gap */
+  memset(fields, 0, sizeof(fields));
+  fields[0].name = "t";
+  fields[0].count = 1;
+  fields[0].floating_point = 1;
+  fields[0].bit_width = 64;
+  fields[1].name = "id";
+  fields[1].offset = 8;
+  fields[1].count = 1;
+  fields[1].bit_width = 32;
+  fields[2].name = "pos";
+  fields[2].offset = 16;
+  fields[2].dim = 1;
+  fields[2].shape[0] = 3;
+  fields[2].count = 3;
+  fields[2].floating_point = 1;
+  fields[2].bit_width = 64;
+  memset(rec, 0, sizeof(rec));
+  for (i = 0; i < 4; ++i)
+  {
+    r = rec + i * 40;
+    t = i * 0.5;
+    id = 100 + i;
+    npio_swap_bytes4(1, 64, &t, r);
+    npio_swap_bytes4(1, 32, &id, r + 8);
+    for (k = 0; k < 3; ++k)
+    {
+      t = i * 10 + k;
+      npio_swap_bytes4(1, 64, &t, r + 16 + 8 * k);
+    }
+  }
+
+  npio_init_array(&array);
+  array.dim = 1;
+  array.shape = shape;
+  array.nfields = 3;
+  array.fields = fields;
+  array.bit_width = 40 * 8;
+  array.little_endian = 0;
+  array.data = rec;
+  assert(npio_save("test24-out.npy", &array) == 0);
+
+  npio_init_array(&array);
+  assert(npio_load("test24-out.npy", &array) == 0);
+  assert(strcmp(array.dtype, "[('t', '>f8'), ('id', '>u4'), ('', '|V4')"
+    ", ('pos', '>f8', (3, )), ]") == 0);
+  assert(array.nfields == 3 && array.bit_width == 40 * 8);
+  assert(array.little_endian == (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__));
+
+  /* views see the swapped records in place */
+  assert(npio_field_view(&array, "id", &view) == 0);
+  assert(view.stride == 40 && view.n == 4 && view.field->offset == 8);
+  memcpy(&id, view.base + 3 * view.stride, 4);
+  assert(id == 103);
+  assert(npio_field_view(&array, "speed", &view) == ENOENT);
+
+  /* and gather columns, converted or not */
+  assert(npio_field_view(&array, "pos", &view) == 0);
+  assert(npio_field_gather(&view, pos, "=f8") == 0);
+  for (i = 0; i < 12; ++i)
+    assert(pos[i] == (i / 3) * 10 + i % 3);
+  assert(npio_field_view(&array, "id", &view) == 0);
+  assert(npio_field_gather(&view, ids, "=u4") == 0);
+  assert(npio_field_gather(&view, flags, "<u2") == 0);
+  for (i = 0; i < 4; ++i)
+    assert(ids[i] == 100 + i && flags[i] == 100 + i);
+  assert(npio_field_gather(&view, pos, "<c8") == ENOTSUP);
+
+  /* whole records take no part in conversions */
+  assert(npio_convert_data(&array, rec, "<f8") == ENOTSUP);
+  npio_free_array(&array);
+
+  printf("test24 passed\n");
+}
+
+
+/* load statistics */
+void test25()
+{
+#ifdef NPIO_ENABLE_STATS
+  npio_Array array;
+  struct stat st;
+  static char buf[90000];
+  static float f[20000];
+  size_t i, shape[] = {20000};
+  ssize_t n;
+  int fd;
+
+  assert(stat("test2.npy", &st) == 0);
+
+  /* a small file is read whole */
+  npio_init_array(&array);
+  assert(npio_load("test2.npy", &array) == 0);
+  assert(array.stats.path == (NPIO_PATH_PREAD | NPIO_PATH_ALLOC));
+  assert(array.stats.bytes_read == (size_t) st.st_size);
+  assert(array.stats.bytes_allocated == (size_t) st.st_size);
+  assert(array.stats.bytes_mapped == 0 && array.stats.bytes_swapped == 0);
+  assert(array.stats.read_ns > 0 && array.stats.map_ns == 0);
+  assert(array.stats.minor_faults >= 0 && array.stats.major_faults >= 0);
+  npio_free_array(&array);
+
+  npio_init_array(&array);
+  assert(npio_load_header4("test2.npy", &array, 8, NPIO_MAP_SHARED) == 0);
+  assert(npio_load_data(&array) == 0);
+  assert(array.stats.path == NPIO_PATH_MMAP);
+  assert(array.stats.bytes_mapped == (size_t) st.st_size);
+  assert(array.stats.bytes_read == 0 && array.stats.bytes_allocated == 0);
+  npio_free_array(&array);
+
+  /* files above NPIO_MMAP_THRESHOLD that need swapping */
+  for (i = 0; i < 20000; ++i)
+    f[i] = i;
+  npio_swap_bytes(20000, 32, f);
+  npio_init_array(&array);
+  array.dim = 1;
+  array.shape = shape;
+  array.little_endian = !array.little_endian;
+  array.data = f;
+  assert(npio_save("test25-out.npy", &array) == 0);
+  assert(stat("test25-out.npy", &st) == 0);
+
+  npio_init_array(&array);
+  assert(npio_load_header4("test25-out.npy", &array, 8, NPIO_NO_MMAP) == 0);
+  assert(npio_load_data(&array) == 0);
+  assert(array.stats.path == (NPIO_PATH_READ | NPIO_PATH_READ_DATA
+    | NPIO_PATH_ALLOC | NPIO_PATH_SWAP));
+  assert(array.stats.bytes_read == (size_t) st.st_size);
+  assert(array.stats.bytes_allocated == 80000);
+  assert(array.stats.bytes_swapped == 80000);
+  npio_free_array(&array);
+
+  /* a shared mapping is swapped into a copy */
+  npio_init_array(&array);
+  assert(npio_load_header4("test25-out.npy", &array, 8, NPIO_MAP_SHARED) == 0);
+  assert(npio_load_data(&array) == 0);
+  assert(array.stats.path == (NPIO_PATH_MMAP | NPIO_PATH_SWAP
+    | NPIO_PATH_ALLOC));
+  assert(array.stats.bytes_mapped == (size_t) st.st_size);
+  assert(array.stats.bytes_swapped == 80000);
+  assert(array.stats.bytes_allocated == 80000);
+  npio_free_array(&array);
+
+  /* from memory */
+  assert((fd = open("test25-out.npy", O_RDONLY)) >= 0);
+  assert((n = read(fd, buf, sizeof(buf))) == st.st_size);
+  close(fd);
+  npio_init_array(&array);
+  assert(npio_load_mem(buf, n, &array) == 0);
+  assert(array.stats.path == (NPIO_PATH_MEM | NPIO_PATH_SWAP));
+  assert(array.stats.bytes_swapped == 80000 && array.stats.bytes_read == 0);
+  assert(((float*) array.data)[19999] == 19999);
+  npio_free_array(&array);
+#endif
+}
+
+
+/* filling a mapped output file in place */
+void test26()
+{
+  npio_Array desc, array;
+  size_t i, shape[] = {1000, 3}, big_shape[40];
+  struct stat st;
+  double *d;
+
+  npio_init_array(&desc);
+  desc.dim = 2;
+  desc.shape = shape;
+  desc.bit_width = 64;
+  desc.major_version = 3;
+
+  npio_init_array(&array);
+  assert(npio_create_mapped("test26-out.npy", &desc, &array) == 0);
+  assert(array.dim == 2 && array.shape[1] == 3 && array.size == 3000);
+
+  /* the blocks are reserved, not left sparse */
+  assert(stat("test26-out.npy", &st) == 0);
+  assert((size_t) st.st_blocks * 512 >= array._buf_size);
+  assert(array.major_version == 3 && array.floating_point);
+  assert((uintptr_t) array.data % NPIO_HEADER_ALIGNMENT == 0);
+  d = (double*) array.data;
+  for (i = 0; i < 3000; ++i)
+    d[i] = i * 0.5;
+  assert(npio_sync_mapped(&array) == 0);
+  npio_free_array(&array);
+
+  npio_init_array(&array);
+  assert(npio_load("test26-out.npy", &array) == 0);
+  assert(array.size == 3000 && ((double*) array.data)[2999] == 2999 * 0.5);
+  npio_free_array(&array);
+
+  /* a header too long for the stack buffer, and an empty array */
+  for (i = 0; i < 40; ++i)
+    big_shape[i] = i == 39 ? 0 : 1;
+  desc.dim = 40;
+  desc.shape = big_shape;
+  npio_init_array(&array);
+  assert(npio_create_mapped("test26-out.npy", &desc, &array) == 0);
+  assert(array.dim == 40 && array.size == 0);
+  npio_free_array(&array);
+
+  npio_init_array(&array);
+  assert(npio_load3("test26-out.npy", &array, 40) == 0);
+  assert(array.dim == 40 && array.size == 0);
+  npio_free_array(&array);
+
+  /* errors */
+  desc.dim = 2;
+  desc.shape = shape;
+  desc.major_version = 4;
+  npio_init_array(&array);
+  assert(npio_create_mapped("test26-out.npy", &desc, &array) == ENOTSUP);
+  npio_free_array(&array);
+  desc.major_version = 1;
+  npio_init_array(&array);
+  assert(npio_create_mapped("no-such-dir/test26-out.npy", &desc, &array)
+    == ENOENT);
+  assert(npio_sync_mapped(&array) == EINVAL);
+  npio_free_array(&array);
+  shape[0] = (size_t) 1 << 62;
+  npio_init_array(&array);
+  assert(npio_create_mapped("test26-out.npy", &desc, &array) == ERANGE);
+  npio_free_array(&array);
+}
+
+
+/* prefetching rows */
+void test27()
+{
+  npio_Array array;
+  size_t shape[] = {1000, 20};
+  float f[20000];
+  size_t i;
+
+  for (i = 0; i < 20000; ++i)
+    f[i] = i;
+  npio_init_array(&array);
+  array.dim = 2;
+  array.shape = shape;
+  array.data = f;
+  assert(npio_save("test27-out.npy", &array) == 0);
+
+  /* mapped */
+  npio_init_array(&array);
+  assert(npio_load_header("test27-out.npy", &array) == 0);
+  assert(array._mmapped);
+  assert(npio_prefetch(&array, 10, 20) == 0);
+  assert(npio_prefetch(&array, 990, 2000) == 0);
+  assert(npio_prefetch(&array, 2000, 3000) == 0);
+  assert(npio_prefetch(&array, 20, 10) == EINVAL);
+  assert(npio_load_data(&array) == 0);
+  assert(((float*) array.data)[19999] == 19999);
+  npio_free_array(&array);
+
+  /* read, where the descriptor must stay at the data */
+  npio_init_array(&array);
+  assert(npio_load_header4("test27-out.npy", &array, 2, NPIO_NO_MMAP) == 0);
+  assert(!array._mmapped && array._fd >= 0);
+  assert(npio_prefetch(&array, 500, 600) == 0);
+  assert(npio_load_data(&array) == 0);
+  assert(((float*) array.data)[12345] == 12345);
+  assert(npio_prefetch(&array, 0, 1000) == 0);
+  npio_free_array(&array);
+}
+
+
+void test28()
+{
+  npio_Array array;
+  npio_Parser parser;
+  size_t shape[] = {3, 4}, empty_shape[] = {0};
+  int32_t x[12];
+  char hdr[2][256], stream[1024], small[16], *p = stream;
+  struct iovec iov[2];
+  size_t i, sz, n, consumed;
+  int iovcnt, err;
+  void* dst;
+
+  /* a big-endian array that the parser must swap, then an empty array */
+  for (i = 0; i < 12; ++i)
+    x[i] = i * 1000;
+  npio_swap_bytes(12, 32, x);
+  npio_init_array(&array);
+  array.dim = 2;
+  array.shape = shape;
+  array.is_signed = 1;
+  array.floating_point = 0;
+  array.bit_width = 32;
+  array.little_endian = 0;
+  array.data = x;
+
+  assert(npio_serialize_iov(&array, small, sizeof(small), iov, &iovcnt)
+    == ERANGE);
+  assert(npio_header_bound(&array) <= sizeof(hdr[0]));
+  assert(npio_serialize_iov(&array, hdr[0], sizeof(hdr[0]), iov, &iovcnt) == 0);
+  assert(iovcnt == 2 && iov[1].iov_base == x && iov[1].iov_len == 48);
+  assert(iov[0].iov_len % 16 == 0);
+  assert(npio_serialized_size(&array, &sz) == 0);
+  assert(sz == iov[0].iov_len + iov[1].iov_len);
+  for (i = 0; i < 2; ++i)
+  {
+    memcpy(p, iov[i].iov_base, iov[i].iov_len);
+    p += iov[i].iov_len;
+  }
+
+  array.shape = empty_shape;
+  array.dim = 1;
+  assert(npio_serialize_iov(&array, hdr[1], sizeof(hdr[1]), iov, &iovcnt) == 0);
+  assert(iovcnt == 1);
+  memcpy(p, iov[0].iov_base, iov[0].iov_len);
+  p += iov[0].iov_len;
+
+  /* one byte at a time, never asking for more than the first array */
+  npio_parser_init(&parser);
+  i = 0;
+  do
+  {
+    npio_parser_buffer(&parser, &dst, &n);
+    assert(n > 0 && i + n <= sz);
+    *(char*) dst = stream[i++];
+  } while ((err = npio_parser_advance(&parser, 1)) == EAGAIN);
+  assert(err == 0 && i == sz);
+  npio_parser_buffer(&parser, &dst, &n);
+  assert(n == 0);
+  assert(parser.array.dim == 2 && parser.array.shape[1] == 4);
+  assert(parser.array.little_endian);
+  for (i = 0; i < 12; ++i)
+    assert(((int32_t*) parser.array.data)[i] == (int32_t) i * 1000);
+  npio_parser_free(&parser);
+
+  /* the rest in one piece */
+  npio_parser_init(&parser);
+  assert(npio_parser_feed(&parser, stream + sz, p - stream - sz, &consumed)
+    == 0);
+  assert(consumed == (size_t) (p - stream) - sz);
+  assert(parser.array.size == 0 && parser.array.shape[0] == 0);
+  npio_parser_free(&parser);
+
+  /* both arrays in uneven chunks, and the second left over */
+  npio_parser_init(&parser);
+  assert(npio_parser_feed(&parser, stream, 5, &consumed) == EAGAIN);
+  assert(consumed == 5);
+  assert(npio_parser_feed(&parser, stream + 5, p - stream - 5, &consumed)
+    == 0);
+  assert(consumed == sz - 5);
+  assert(((int32_t*) parser.array.data)[11] == 11000);
+  npio_parser_free(&parser);
+
+  /* more than was asked for */
+  npio_parser_init(&parser);
+  npio_parser_buffer(&parser, &dst, &n);
+  assert(npio_parser_advance(&parser, n + 1) == EINVAL);
+  npio_parser_free(&parser);
+
+  /* a header that leaves the data misaligned */
+  npio_parser_init(&parser);
+  stream[8]--;
+  assert(npio_parser_feed(&parser, stream, sz, &consumed) == EINVAL);
+  assert(consumed == 12);
+  npio_parser_free(&parser);
+  stream[8]++;
+
+  /* a corrupt prelude */
+  npio_parser_init(&parser);
+  stream[0] = 'x';
+  assert(npio_parser_feed(&parser, stream, sz, &consumed) == EINVAL);
+  npio_parser_free(&parser);
+}
+
+
+void test29()
+{
+  npio_Array array;
+  size_t shape[] = {1 << 20};
+  uint32_t* x = (uint32_t*) malloc(sizeof(uint32_t) << 20);
+  size_t i;
+
+  for (i = 0; i < shape[0]; ++i)
+    x[i] = i;
+  npio_init_array(&array);
+  array.dim = 1;
+  array.shape = shape;
+  array.is_signed = 0;
+  array.floating_point = 0;
+  array.bit_width = 32;
+  array.data = x;
+  assert(npio_save("test29-out.npy", &array) == 0);
+
+  /* placed data is read into page aligned memory */
+  npio_init_array(&array);
+  assert(npio_load_header4("test29-out.npy", &array, 1, NPIO_NUMA_INTERLEAVE)
+    == 0);
+  assert(!array._mmapped);
+  assert(npio_load_data(&array) == 0);
+  assert(array._malloced && (uintptr_t) array.data % 4096 == 0);
+  assert(memcmp(array.data, x, sizeof(uint32_t) << 20) == 0);
+  npio_free_array(&array);
+
+  /* huge pages, bound to the first node, read by several threads */
+  npio_init_array(&array);
+  assert(npio_load_header4("test29-out.npy", &array, 1
+    , NPIO_NUMA_NODE(0) | NPIO_MADV_HUGEPAGE) == 0);
+  assert(npio_load_data3(&array, 1, 4) == 0);
+  assert((uintptr_t) array.data % NPIO_HUGE_PAGE_SIZE == 0);
+  assert(((uint32_t*) array.data)[shape[0] - 1] == shape[0] - 1);
+  npio_free_array(&array);
+
+  /* a shared mapping is left alone */
+  npio_init_array(&array);
+  assert(npio_load_header4("test29-out.npy", &array, 1
+    , NPIO_NUMA_INTERLEAVE | NPIO_MAP_SHARED) == 0);
+  assert(array._mmapped);
+  assert(npio_load_data(&array) == 0);
+  assert(((uint32_t*) array.data)[12345] == 12345);
+  npio_free_array(&array);
+
+  free(x);
+}
+
+
+void test30()
+{
+  static double rec[400 * 200];
+  static char buf[400 * 200 * 8 + 8192];
+  npio_Array array;
+  npio_Parser parser;
+  npio_Field fields[200];
+  char names[200][8];
+  size_t shape[] = {400}, i, n, consumed;
+  int fds[2], status;
+  pid_t pid;
+  FILE* f;
+
+  /* a record descriptor much longer than any shape, saved by npio_save */
+  memset(fields, 0, sizeof(fields));
+  for (i = 0; i < 200; ++i)
+  {
+    sprintf(names[i], "f%zu", i);
+    fields[i].name = names[i];
+    fields[i].offset = i * 8;
+    fields[i].count = 1;
+    fields[i].floating_point = 1;
+    fields[i].bit_width = 64;
+  }
+  for (i = 0; i < 400 * 200; ++i)
+    rec[i] = i;
+  npio_init_array(&array);
+  array.dim = 1;
+  array.shape = shape;
+  array.nfields = 200;
+  array.fields = fields;
+  array.bit_width = 200 * 64;
+  array.data = rec;
+  assert(npio_save("test30-out.npy", &array) == 0);
+
+  /* read rather than mapped */
+  npio_init_array(&array);
+  assert(npio_load_header4("test30-out.npy", &array, 1, NPIO_NO_MMAP) == 0);
+  assert(array.header_len > 1024 + 32 * 20 && array.nfields == 200);
+  assert(npio_load_data(&array) == 0);
+  assert(((double*) array.data)[400 * 200 - 1] == 400 * 200 - 1);
+  npio_free_array(&array);
+
+  /* through the incremental parser */
+  f = fopen("test30-out.npy", "rb");
+  n = fread(buf, 1, sizeof(buf), f);
+  fclose(f);
+  npio_parser_init(&parser);
+  assert(npio_parser_feed(&parser, buf, n, &consumed) == 0 && consumed == n);
+  assert(parser.array.nfields == 200);
+  assert(strcmp(parser.array.fields[199].name, "f199") == 0);
+  assert(((double*) parser.array.data)[12345] == 12345);
+  npio_parser_free(&parser);
+
+  /* from a pipe */
+  assert(pipe(fds) == 0);
+  if ((pid = fork()) == 0)
+  {
+    close(fds[0]);
+    _exit(write(fds[1], buf, n) != (ssize_t) n);
+  }
+  close(fds[1]);
+  npio_init_array(&array);
+  assert(npio_load_fd(fds[0], &array) == 0);
+  assert(array.nfields == 200 && array.size == 400);
+  assert(((double*) array.data)[400 * 200 - 1] == 400 * 200 - 1);
+  npio_free_array(&array);
+  close(fds[0]);
+  waitpid(pid, &status, 0);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  /* a long header is only allowed for records */
+  memcpy(buf + 10 + 10, "'<f8'  ", 7);
+  npio_parser_init(&parser);
+  assert(npio_parser_feed(&parser, buf, n, &consumed) == ERANGE);
+  npio_parser_free(&parser);
+}
+
+
 int main()
 {
   test1();
@@ -218,5 +1972,30 @@ int main()
   test3();
   test4();
   test5();
+  test6();
+  test7();
+  test8();
+  test9();
+  test10();
+  test11();
+  test12();
+  test13();
+  test14();
+  test15();
+  test16();
+  test17();
+  test18();
+  test19();
+  test20();
+  test21();
+  test22();
+  test23();
+  test24();
+  test25();
+  test26();
+  test27();
+  test28();
+  test29();
+  test30();
   return 0;
 }
@@ -1,6 +1,25 @@
 #include <cassert>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
 #include "npio.h"
 
+// A visitor for any element type.
+struct FirstPlusLast
+{
+  template <class T> double operator()(const T* p) const
+  {
+    return double(p[0]) + double(p[99]);
+  }
+
+  template <class T> double operator()(const std::complex<T>* p) const
+  {
+    return p[0].real() + p[99].real();
+  }
+};
+
+
 int main()
 {
   npio::Array a("test1.npy");
@@ -9,5 +28,412 @@ int main()
   for (size_t i = 0; i < a.size(); ++i)
     total += values[i];
   assert(total == 4950);
+
+  double converted[100];
+  assert(a.copy_to(converted) == 0);
+  for (size_t i = 0; i < a.size(); ++i)
+    assert(converted[i] == i);
+
+  npio::Reader r("test1.npy");
+  int64_t chunk[8];
+  total = 0;
+  size_t rows = 0;
+  for (auto& c : r.chunks(chunk, 8))
+  {
+    assert(c.row == rows && c.rows <= 8);
+    for (size_t i = 0; i < c.rows; ++i)
+      total += c.data[i];
+    rows += c.rows;
+  }
+  assert(rows == 100 && total == 4950);
+
+  {
+    npio::Writer<double> w("test-cpp-out.npy", {2});
+    double row[4] = {1, 2, 3, 4};
+    for (int i = 0; i < 5; ++i)
+      assert(w.append(row, 2) == 0);
+    assert(w.rows() == 10);
+  }
+  npio::Array b("test-cpp-out.npy");
+  assert(b.dim() == 2 && b.shape(0) == 10 && b.shape(1) == 2);
+  assert(b.get<double>()[19] == 4);
+
+  {
+    npio::Writer<std::complex<float> > w("test-cpp-out.npy", {2});
+    std::complex<float> row[2] = {{1, 2}, {3, 4}};
+    assert(w.append(row, 1) == 0);
+  }
+  npio::Array z("test-cpp-out.npy");
+  assert(z.isType<std::complex<float> >() && z.dim() == 2 && z.shape(0) == 1);
+  assert(z.get<std::complex<float> >()[1] == std::complex<float>(3, 4));
+  {
+    npio::Writer<npio::bfloat16> w("test-cpp-out.npy", {2});
+    assert(w.error() == ENOTSUP);
+  }
+
+  {
+    // page aligned, so the data goes out with O_DIRECT where it is supported
+    size_t shape[] = {1 << 21};
+    void* p = 0;
+    assert(posix_memalign(&p, NPIO_DIRECT_ALIGNMENT, shape[0] * 4) == 0);
+    int32_t* v = static_cast<int32_t*>(p);
+    for (size_t i = 0; i < shape[0]; ++i)
+      v[i] = i;
+    assert(npio::save("test-cpp-out.npy", 1, shape, v, 4, NPIO_SAVE_DIRECT) == 0);
+    free(p);
+
+    npio::Array c("test-cpp-out.npy");
+    assert(c.size() == shape[0] && c.get<int32_t>()[shape[0] - 1] == 2097151);
+#ifdef O_DIRECT
+    npio_Array h;
+    npio_init_array(&h);
+    assert(npio_load_header("test-cpp-out.npy", &h) == 0);
+    assert(h.header_len + 10 == NPIO_DIRECT_ALIGNMENT);
+    npio_free_array(&h);
+#endif
+  }
+
+  {
+    std::complex<float> z[3] = {{1, 2}, {3, 4}, {5, 6}};
+    size_t shape[] = {3};
+    assert(npio::save("test-cpp-out.npy", 1, shape, z) == 0);
+    npio::Array c("test-cpp-out.npy");
+    assert(c.isType<std::complex<float> >() && !c.isType<double>());
+    assert(c.get<std::complex<float> >()[2] == std::complex<float>(5, 6));
+    std::complex<double> w[3];
+    assert(c.copy_to(w) == 0 && w[1] == std::complex<double>(3, 4));
+
+    npio::float16 h[3] = {npio::float16(0.5f), npio::float16(1.5f)
+      , npio::float16(-2)};
+    assert(npio::save("test-cpp-out.npy", 1, shape, h) == 0);
+    npio::Array d("test-cpp-out.npy");
+    assert(d.isType<npio::float16>() && !d.isType<npio::bfloat16>());
+    float f[3];
+    assert(d.copy_to(f) == 0 && f[0] == 0.5f && f[2] == -2);
+    npio::bfloat16 b[3];
+    assert(d.copy_to(b) == 0 && float(b[1]) == 1.5f);
+  }
+
+  {
+    npio::Array c("test2.npy");
+    npio::View<float, 3> v = c.view<float, 3>();
+    const float* flat = c.get<float>();
+    assert(v.shape(0) == 100 && v.stride(0) == 100 && v.contiguous());
+    assert(v(42, 3, 7) == flat[4237] && &v[42][3][7] == &flat[4237]);
+    assert((c.view<float, 2>().data() == 0));
+    assert((c.view<double, 3>().data() == 0));
+
+    npio::View<float, 2> r = v.row(42);
+    assert(r.shape(0) == 10 && &r(3, 7) == &flat[4237] && r.contiguous());
+
+    // every other row of a block: strided, walked by carrying indices
+    size_t begin[] = {10, 2, 0}, end[] = {20, 4, 10};
+    npio::View<float, 3> s = v.subarray(begin, end).slice(0, 0, 10, 2);
+    assert(s.shape(0) == 5 && s.shape(1) == 2 && !s.contiguous());
+    size_t n = 0;
+    for (npio::View<float, 3>::iterator i = s.begin(); i != s.end(); ++i, ++n)
+      assert(*i == flat[(10 + (n / 20) * 2) * 100 + (2 + n / 10 % 2) * 10
+        + n % 10]);
+    assert(n == s.size() && n == 100);
+    assert(v.slice(1, 2, 5, 0).shape(1) == 3);
+
+    // fortran order: the first index varies fastest
+    double f[6] = {0, 1, 2, 3, 4, 5};
+    size_t shape[] = {2, 3};
+    npio_Array a;
+    npio_init_array(&a);
+    a.dim = 2;
+    a.shape = shape;
+    a.bit_width = 64;
+    a.fortran_order = 1;
+    a.data = f;
+    assert(npio_save("test-cpp-out.npy", &a) == 0);
+    npio::Array d("test-cpp-out.npy");
+    npio::View<double, 2> w = d.view<double, 2>();
+    assert(w(1, 0) == 1 && w(0, 1) == 2 && w(1, 2) == 5 && !w.contiguous());
+    double expect[] = {0, 2, 4, 1, 3, 5};
+    n = 0;
+    for (double x : w)
+      assert(x == expect[n++]);
+    assert(w[1][2] == 5 && w.row(1).stride(0) == 2);
+  }
+
+  // moving and sharing
+  {
+    std::vector<npio::Array> v;
+    v.emplace_back("test1.npy");
+    v.emplace_back("test2.npy");
+    v.push_back(npio::Array("test1.npy"));
+    for (size_t i = 0; i < v.size(); ++i)
+      assert(!v[i].empty() && v[i].error() == 0);
+    assert(v[1].shape(0) == 100 && v[1].shape()[2] == 10);
+    assert(v[2].get<int64_t>()[99] == 99);
+
+    npio::Array e;
+    assert(e.empty() && e.size() == 0 && e.error() == 0);
+    const void* p = v[1].data();
+    e = std::move(v[1]);
+    assert(v[1].empty() && v[1].data() == 0 && e.data() == p);
+    assert(e.isType<float>() && e.dim() == 3 && e.shape()[1] == 10);
+    e.swap(v[0]);
+    assert(e.isType<int64_t>() && v[0].data() == p);
+
+    npio::SharedArray s = e.share();
+    npio::SharedArray t = s;
+    assert(e.empty() && s.use_count() == 2 && t->get<int64_t>()[42] == 42);
+    s.reset();
+    assert(t->size() == 100 && t->get<int64_t>()[99] == 99);
+  }
+
+  // the mapping cache
+  {
+    struct stat st1, st2;
+    assert(stat("test1.npy", &st1) == 0 && stat("test2.npy", &st2) == 0);
+
+    npio::MappingCache cache(1 << 20);
+    npio::SharedArray a = cache.get("test1.npy");
+    npio::SharedArray b = cache.get("test1.npy");
+    assert(a && a == b && cache.hits() == 1 && cache.misses() == 1);
+    assert(b->get<int64_t>()[99] == 99);
+    npio::SharedArray c = cache.get("test2.npy");
+    assert(c->isType<float>() && cache.size() == 2);
+    assert(cache.bytes() == size_t(st1.st_size + st2.st_size));
+
+    // test1.npy is the least recently used
+    assert(cache.get("test2.npy") == c);
+    cache.set_budget(st2.st_size);
+    assert(cache.size() == 1 && cache.get("test2.npy") == c);
+    assert(a->get<int64_t>()[42] == 42);
+    assert(cache.get("test1.npy") != a && cache.size() == 1);
+
+    // a replaced file is loaded again, while the old one stays mapped
+    cache.set_budget(1 << 20);
+    int64_t x[] = {1, 2, 3};
+    assert(npio::save("test-cpp-out.npy", {3}, x) == 0);
+    npio::SharedArray d = cache.get("test-cpp-out.npy");
+    assert(d->size() == 3 && d->get<int64_t>()[2] == 3);
+    int64_t y[] = {4, 5, 6, 7};
+    assert(npio::save("test-cpp-tmp-out.npy", {4}, y) == 0);
+    assert(rename("test-cpp-tmp-out.npy", "test-cpp-out.npy") == 0);
+    npio::SharedArray e = cache.get("test-cpp-out.npy");
+    assert(e != d && e->size() == 4 && d->get<int64_t>()[2] == 3);
+    cache.invalidate("test-cpp-out.npy");
+    assert(cache.get("test-cpp-out.npy") != e);
+
+    // including versions whose file has been replaced or deleted
+    size_t before = cache.size();
+    assert(npio::save("test-cpp-tmp-out.npy", {3}, x) == 0);
+    assert(rename("test-cpp-tmp-out.npy", "test-cpp-out.npy") == 0);
+    cache.invalidate("test-cpp-out.npy");
+    assert(cache.size() == before - 1);
+    assert(cache.get("test-cpp-out.npy")->size() == 3);
+    assert(unlink("test-cpp-out.npy") == 0);
+    cache.invalidate("test-cpp-out.npy");
+    assert(cache.size() == before - 1);
+
+    assert(!cache.get("no-such-file.npy") && errno == ENOENT);
+    cache.clear();
+    assert(cache.size() == 0 && cache.bytes() == 0);
+  }
+
+  // filling a mapped file
+  {
+    npio::Array m = npio::Array::create_mapped<float>("test-cpp-out.npy"
+      , {10, 20});
+    assert(m.error() == 0 && m.dim() == 2 && m.shape(1) == 20);
+    float* f = m.get<float>();
+    for (size_t i = 0; i < m.size(); ++i)
+      f[i] = i;
+    assert(m.sync() == 0);
+    npio::Array r("test-cpp-out.npy");
+    assert(r.isType<float>() && r.size() == 200 && r.get<float>()[199] == 199);
+  }
+
+  // lazy loading, here of a big-endian file above NPIO_MMAP_THRESHOLD
+  {
+    std::vector<float> f(20000);
+    for (size_t i = 0; i < f.size(); ++i)
+      f[i] = i;
+    npio_swap_bytes(f.size(), 32, f.data());
+    size_t shape[] = {1000, 20};
+    npio_Array a;
+    npio_init_array(&a);
+    a.dim = 2;
+    a.shape = shape;
+    a.little_endian = 0;
+    a.data = f.data();
+    assert(npio_save("test-cpp-out.npy", &a) == 0);
+
+    npio::Array l("test-cpp-out.npy", 2, NPIO_LAZY | NPIO_NO_MMAP);
+    assert(l.error() == 0 && l.shape(0) == 1000 && !l.little_endian());
+    assert(l.isType<float>() && l.prefetch(100, 200) == 0);
+    assert(l.get<float>()[12345] == 12345 && l.little_endian());
+    assert((l.view<float, 2>()(999, 19) == 19999));
+
+    npio::SharedArray s = std::make_shared<const npio::Array>(
+      "test-cpp-out.npy", 2, NPIO_LAZY);
+    assert(s->prefetch(0, 10) == 0);
+    std::vector<std::thread> threads;
+    std::vector<const float*> seen(4);
+    for (size_t i = 0; i < seen.size(); ++i)
+      threads.emplace_back([&, i] { seen[i] = s->get<float>(); });
+    for (size_t i = 0; i < threads.size(); ++i)
+      threads[i].join();
+    for (size_t i = 0; i < seen.size(); ++i)
+      assert(seen[i] == seen[0] && seen[i][19999] == 19999);
+
+    npio::Array m("test-cpp-out.npy", 2, NPIO_LAZY | NPIO_NO_MMAP);
+    npio::Array n(std::move(m));
+    assert(m.empty() && n.load_data() == 0 && n.get<float>()[1] == 1);
+  }
+
+  // typed arrays and visiting
+  {
+    assert(strcmp(npio::Traits<double>::descr(), "<f8") == 0);
+    assert(strcmp(npio::Traits<uint8_t>::descr(), "|u1") == 0);
+    assert(strcmp(npio::Traits<std::complex<double> >::descr(), "<c16") == 0);
+    assert(strcmp(npio::Traits<npio::bfloat16>::descr(), "bfloat16") == 0);
+    static_assert(npio::Traits<int16_t>::descr()[2] == '2', "constexpr descr");
+    constexpr const char* descr = npio::Traits<std::complex<float> >::descr();
+    assert(strcmp(descr + 1, "c8") == 0);
+
+    npio::TypedArray<float, 3> t("test2.npy");
+    npio::Array plain("test2.npy");
+    const float* flat = plain.get<float>();
+    assert(!t.empty() && t.size() == 10000 && t.shape(0) == 100);
+    assert(t(10, 2, 3) == flat[1023] && t[99][9][9] == flat[9999]);
+    assert(t.data()[5] == flat[5]);
+    size_t k = 0;
+    for (float x : t)
+      assert(x == flat[k++]);
+    assert(k == 10000);
+    npio::TypedArray<float, 3> u(std::move(t));
+    assert(t.empty() && u.data()[9999] == flat[9999]);
+
+    npio::TypedArray<double, 3> wrong_type("test2.npy");
+    npio::TypedArray<float, 2> wrong_dim(npio::Array("test2.npy"));
+    assert(wrong_type.empty() && wrong_dim.empty());
+    assert(wrong_dim.array().size() == 10000);
+
+    assert(npio::visit(npio::Array("test1.npy"), FirstPlusLast()) == 99);
+    assert(npio::visit(plain, FirstPlusLast())
+      == double(flat[0]) + double(flat[99]));
+    size_t width = npio::visit(npio::Array("test2.npy"), [](const auto* p)
+      { return sizeof(*p); });
+    assert(width == 4);
+    assert(npio::visit(npio::Array(), FirstPlusLast()) == 0);
+    npio::Array c("test-cpp-out.npy");
+    assert(npio::visit(c, [](const auto* p) { return p == 0; }) == false);
+  }
+
+  // shards concatenated along axis 0
+  {
+    std::vector<std::string> paths;
+    const size_t rows[] = {3, 0, 5, 2};
+    float next = 0;
+    for (size_t i = 0; i < 4; ++i)
+    {
+      std::vector<float> f(rows[i] * 2);
+      for (size_t j = 0; j < f.size(); ++j)
+        f[j] = next++;
+      char path[64];
+      sprintf(path, "test-cpp-shard%zu-out.npy", i);
+      assert(npio::save(path, {rows[i], 2}, f.data()) == 0);
+      paths.push_back(path);
+    }
+
+    npio::ShardedArray s(paths, 1);
+    assert(s.error() == 0 && s.isType<float>() && !s.isType<double>());
+    assert(s.dim() == 2 && s.rows() == 10 && s.shape(1) == 2);
+    assert(s.size() == 20 && s.row_size() == 8 && s.nshards() == 4);
+    assert(s.find(0) == 0 && s.find(2) == 0 && s.find(3) == 2);
+    assert(s.find(7) == 2 && s.find(8) == 3 && s.shard_row(3) == 8);
+    assert(s.open_shards() == 0);
+
+    // rows across shard boundaries, with only one shard kept loaded
+    float out[20];
+    assert(s.read_rows(1, 10, out) == 0);
+    for (size_t j = 0; j < 18; ++j)
+      assert(out[j] == j + 2);
+    assert(s.open_shards() == 1);
+    assert(s.read_rows(5, 4, out) == ERANGE && s.read_rows(0, 11, out) == ERANGE);
+
+    size_t chunks = 0, row = 2;
+    for (auto& chunk : s.chunks<float>(2, 9))
+    {
+      assert(chunk.row == row && chunk.data[0] == row * 2);
+      assert(chunk.shard && chunk.rows > 0);
+      row += chunk.rows;
+      ++chunks;
+    }
+    assert(chunks == 3 && row == 9);
+    assert(s.chunks<double>(0, 10).begin() == s.chunks<double>(0, 10).end());
+    assert(s.chunks<double>(0, 10).error() == EINVAL);
+
+    // a shard that is gone by the time it is loaded ends the chunks
+    npio::ShardedArray x(paths);
+    assert(rename(paths[3].c_str(), "test-cpp-shard-moved-out.npy") == 0);
+    auto range = x.chunks<float>(0, 10);
+    chunks = 0;
+    for (auto& chunk : range)
+      chunks += chunk.rows > 0;
+    assert(chunks == 2 && range.error() == ENOENT);
+    assert(rename("test-cpp-shard-moved-out.npy", paths[3].c_str()) == 0);
+    assert(x.chunks<float>(0, 10).error() == 0);
+
+    npio::SharedArray held = s.shard(0);
+    s.set_max_open(4);
+    assert(s.shard(2) && s.shard(0) == held && s.open_shards() == 2);
+
+    // the headers from an index, and shards that do not match
+    std::vector<const char*> names;
+    for (size_t i = 0; i < paths.size(); ++i)
+      names.push_back(paths[i].c_str());
+    names.push_back("test2.npy");
+    assert(npio_index_build("test-cpp-out.idx", names.size(), names.data(), 0)
+      == 0);
+    npio_Index index;
+    assert(npio_index_open(&index, "test-cpp-out.idx") == 0);
+    npio::ShardedArray t(paths, index);
+    assert(t.error() == 0 && t.rows() == 10);
+    assert(t.read_rows(8, 10, out) == 0 && out[3] == 19);
+
+    paths.push_back("test2.npy");
+    npio::ShardedArray u(paths, index);
+    assert(u.error() == EINVAL && u.nshards() == 0);
+    paths.back() = "no-such-file.npy";
+    npio::ShardedArray v(paths);
+    assert(v.error() == ENOENT);
+    npio::ShardedArray w(std::vector<std::string>(), index);
+    assert(w.error() == EINVAL);
+
+    // records are not supported
+    const char header[] = "{'descr': [('a','<f4')], 'fortran_order': False"
+      ", 'shape': (2,), }";
+    char file[128];
+    memset(file, ' ', sizeof(file));
+    memcpy(file, "\x93NUMPY\x01\x00\x76\x00", 10);
+    memcpy(file + 10, header, sizeof(header) - 1);
+    file[127] = '\n';
+    FILE* fp = fopen("test-cpp-record-out.npy", "wb");
+    assert(fp && fwrite(file, 1, 128, fp) == 128 && fwrite(out, 4, 2, fp) == 2);
+    fclose(fp);
+    npio::ShardedArray y(std::vector<std::string>(1, "test-cpp-record-out.npy"));
+    assert(y.error() == ENOTSUP);
+    remove("test-cpp-record-out.npy");
+    npio_index_close(&index);
+  }
+
+#ifdef NPIO_CXX_PMR
+  {
+    char buf[4096];
+    std::pmr::monotonic_buffer_resource mr(buf, sizeof(buf)
+      , std::pmr::null_memory_resource());
+    npio::Array c("test1.npy", mr);
+    assert(c.error() == 0);
+    assert((char*) c.data() >= buf && (char*) c.data() < buf + sizeof(buf));
+    assert(c.get<int64_t>()[99] == 99);
+  }
+#endif
   return 0;
 }